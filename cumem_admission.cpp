@@ -0,0 +1,426 @@
+// Admission control for cuMemCreate per NUMA node
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <tuple>
+
+#include "cumem_admission.h"
+
+static std::atomic<AdmissionController*> g_create_admission(nullptr);
+
+void set_create_admission(AdmissionController* admission) {
+  g_create_admission.store(admission, std::memory_order_release);
+}
+
+// Join the SharedAdmission named by CUMEM_ADMISSION_SHM, unless a controller
+// was installed explicitly first. It stays joined for the process lifetime.
+static void join_admission_from_environment() {
+  const char* name = getenv("CUMEM_ADMISSION_SHM");
+  if (!name || g_create_admission.load(std::memory_order_acquire)) {
+    return;
+  }
+  SharedAdmissionOptions options;
+  if (const char* limit = getenv("CUMEM_ADMISSION_LIMIT")) {
+    options.limit = strtoul(limit, nullptr, 10);
+  }
+  if (const char* stagger = getenv("CUMEM_ADMISSION_STAGGER_MS")) {
+    options.stagger_seconds = strtod(stagger, nullptr) / 1000.0;
+  }
+  static std::unique_ptr<SharedAdmission> shared = SharedAdmission::join(name, options);
+  AdmissionController* expected = nullptr;
+  g_create_admission.compare_exchange_strong(expected, shared.get());
+}
+
+AdmissionController* get_create_admission() {
+  static std::once_flag environment_once;
+  std::call_once(environment_once, join_admission_from_environment);
+  return g_create_admission.load(std::memory_order_acquire);
+}
+
+CreateAdmission::CreateAdmission(size_t default_limit) : default_limit_(default_limit) {}
+
+CreateAdmission::Node& CreateAdmission::node_locked(int node) {
+  auto it = nodes_.find(node);
+  if (it == nodes_.end()) {
+    it = nodes_.emplace(std::piecewise_construct, std::forward_as_tuple(node), std::forward_as_tuple()).first;
+    Node& entry = it->second;
+    entry.limit = default_limit_;
+    entry.active = 0;
+    entry.next_ticket = 0;
+    entry.serving = 0;
+    entry.stats = AdmissionStats{node, default_limit_, 0, 0, 0, 0.0, 0.0};
+  }
+  return it->second;
+}
+
+void CreateAdmission::set_limit(int node, size_t limit) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Node& entry = node_locked(node);
+  entry.limit = limit;
+  entry.stats.limit = limit;
+  // A higher limit may admit queued callers right away
+  entry.cv.notify_all();
+}
+
+void CreateAdmission::enter(int node) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  Node& entry = node_locked(node);
+  unsigned long long ticket = entry.next_ticket++;
+  auto admissible = [&]() { return ticket == entry.serving && (entry.limit == 0 || entry.active < entry.limit); };
+  if (!admissible()) {
+    auto wait_start = std::chrono::high_resolution_clock::now();
+    entry.cv.wait(lock, admissible);
+    std::chrono::duration<double> waited = std::chrono::high_resolution_clock::now() - wait_start;
+    ++entry.stats.waited;
+    entry.stats.wait_seconds += waited.count();
+    if (waited.count() > entry.stats.max_wait_seconds) {
+      entry.stats.max_wait_seconds = waited.count();
+    }
+  }
+  ++entry.serving;
+  ++entry.active;
+  ++entry.stats.admitted;
+  if (entry.active > entry.stats.peak_active) {
+    entry.stats.peak_active = entry.active;
+  }
+  // The next ticket may fit under the limit as well
+  entry.cv.notify_all();
+}
+
+void CreateAdmission::leave(int node) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Node& entry = node_locked(node);
+  --entry.active;
+  entry.cv.notify_all();
+}
+
+std::vector<AdmissionStats> CreateAdmission::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<AdmissionStats> result;
+  for (const auto& entry : nodes_) {
+    result.push_back(entry.second.stats);
+  }
+  return result;
+}
+
+// SharedAdmission
+
+static const uint64_t kSharedAdmissionMagic = 0x434d454d41444d31ull;  // "CMEMADM1"
+
+struct SharedAdmission::Segment {
+  uint64_t magic;
+  std::atomic<uint32_t> ready;  // Set by the creator once initialized
+  std::atomic<uint32_t> wake_seq;  // Futex word, bumped whenever a waiter may proceed
+  pthread_mutex_t mutex;  // Robust and process-shared; guards the rest
+  uint64_t stagger_ns;
+  uint64_t next_ticket;
+  uint64_t recovered;
+
+  struct NodeState {
+    uint64_t limit;
+    uint64_t active;
+    uint64_t last_admit_ns;
+    AdmissionStats stats;
+  } nodes[kSharedAdmissionMaxNodes];
+
+  // Queued callers, oldest first; each node is served in this order
+  struct Waiter {
+    uint64_t ticket;
+    int32_t pid;
+    int32_t node;
+  } waiters[kSharedAdmissionMaxWaiters];
+  uint32_t num_waiters;
+
+  // Slots held per process and node, to give back those of dead processes
+  struct Holder {
+    int32_t pid;  // 0 when free
+    int32_t node;
+    uint64_t count;
+  } holders[kSharedAdmissionMaxHolders];
+};
+
+static uint64_t monotonic_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static bool process_alive(pid_t pid) {
+  return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+std::unique_ptr<SharedAdmission> SharedAdmission::join(const std::string& name,
+                                                       const SharedAdmissionOptions& options) {
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+  if (fd < 0) {
+    std::cerr << "Error opening admission segment " << name << ": " << strerror(errno) << std::endl;
+    return nullptr;
+  }
+  // Whoever holds the file lock and finds the segment uninitialized sets it
+  // up, so a creator that died half way (and so dropped the lock) is simply
+  // succeeded by the next process to join
+  while (flock(fd, LOCK_EX) != 0) {
+    if (errno != EINTR) {
+      std::cerr << "Error locking admission segment " << name << ": " << strerror(errno) << std::endl;
+      close(fd);
+      return nullptr;
+    }
+  }
+  auto fail = [&](const char* what) {
+    std::cerr << "Error " << what << " admission segment " << name << ": " << strerror(errno) << std::endl;
+    flock(fd, LOCK_UN);
+    close(fd);
+    return std::unique_ptr<SharedAdmission>();
+  };
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return fail("inspecting");
+  }
+  if ((size_t)st.st_size < sizeof(Segment) && ftruncate(fd, sizeof(Segment)) != 0) {
+    return fail("sizing");
+  }
+  void* mapping = mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    return fail("mapping");
+  }
+  Segment* segment = static_cast<Segment*>(mapping);
+
+  if (segment->ready.load(std::memory_order_acquire) == 0) {
+    // Nothing can have used the segment before it was ready. Fields a
+    // failed creator may have written are reset.
+    memset(static_cast<void*>(segment), 0, sizeof(Segment));
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&segment->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    segment->magic = kSharedAdmissionMagic;
+    segment->stagger_ns = (uint64_t)(options.stagger_seconds * 1e9);
+    for (int node = 0; node < kSharedAdmissionMaxNodes; ++node) {
+      segment->nodes[node].limit = options.limit;
+      segment->nodes[node].stats.node = node;
+      segment->nodes[node].stats.limit = options.limit;
+    }
+    segment->ready.store(1, std::memory_order_release);
+  } else if (segment->magic != kSharedAdmissionMagic) {
+    std::cerr << "Admission segment " << name << " is not an admission segment" << std::endl;
+    munmap(mapping, sizeof(Segment));
+    flock(fd, LOCK_UN);
+    close(fd);
+    return nullptr;
+  }
+  flock(fd, LOCK_UN);
+  close(fd);
+  return std::unique_ptr<SharedAdmission>(new SharedAdmission(segment));
+}
+
+bool SharedAdmission::remove(const std::string& name) {
+  return shm_unlink(name.c_str()) == 0;
+}
+
+SharedAdmission::~SharedAdmission() {
+  munmap(segment_, sizeof(Segment));
+}
+
+void SharedAdmission::lock() const {
+  int result = pthread_mutex_lock(&segment_->mutex);
+  if (result == EOWNERDEAD) {
+    // The owner died inside a short critical section; the state is
+    // consistent apart from its own slots, which pruning gives back
+    pthread_mutex_consistent(&segment_->mutex);
+    prune_dead_locked();
+  }
+}
+
+void SharedAdmission::unlock() const {
+  pthread_mutex_unlock(&segment_->mutex);
+}
+
+void SharedAdmission::wake_all() const {
+  segment_->wake_seq.fetch_add(1, std::memory_order_release);
+  syscall(SYS_futex, &segment_->wake_seq, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+void SharedAdmission::prune_dead_locked() const {
+  bool changed = false;
+  for (Segment::Holder& holder : segment_->holders) {
+    if (holder.pid != 0 && !process_alive(holder.pid)) {
+      segment_->nodes[holder.node].active -= holder.count;
+      segment_->recovered += holder.count;
+      holder = Segment::Holder{0, 0, 0};
+      changed = true;
+    }
+  }
+  uint32_t kept = 0;
+  for (uint32_t i = 0; i < segment_->num_waiters; ++i) {
+    if (process_alive(segment_->waiters[i].pid)) {
+      segment_->waiters[kept++] = segment_->waiters[i];
+    } else {
+      ++segment_->recovered;
+      changed = true;
+    }
+  }
+  segment_->num_waiters = kept;
+  if (changed) {
+    wake_all();
+  }
+}
+
+void SharedAdmission::set_limit(int node, size_t limit) {
+  if (node < 0 || node >= kSharedAdmissionMaxNodes) {
+    return;
+  }
+  lock();
+  segment_->nodes[node].limit = limit;
+  segment_->nodes[node].stats.limit = limit;
+  unlock();
+  wake_all();
+}
+
+void SharedAdmission::enter(int node) {
+  if (node < 0 || node >= kSharedAdmissionMaxNodes) {
+    return;
+  }
+  const pid_t pid = getpid();
+  lock();
+  prune_dead_locked();
+  // Join the queue, or wait for room in it
+  while (segment_->num_waiters == kSharedAdmissionMaxWaiters) {
+    uint32_t seq = segment_->wake_seq.load(std::memory_order_acquire);
+    unlock();
+    struct timespec timeout = {0, 100 * 1000 * 1000};
+    syscall(SYS_futex, &segment_->wake_seq, FUTEX_WAIT, seq, &timeout, nullptr, 0);
+    lock();
+  }
+  uint64_t ticket = segment_->next_ticket++;
+  segment_->waiters[segment_->num_waiters++] = Segment::Waiter{ticket, pid, node};
+
+  // This process's holder entry for node, or else a free one to take
+  auto find_holder = [&]() {
+    Segment::Holder* free_holder = nullptr;
+    for (Segment::Holder& candidate : segment_->holders) {
+      if (candidate.pid == pid && candidate.node == node) {
+        return &candidate;
+      }
+      if (candidate.pid == 0 && !free_holder) {
+        free_holder = &candidate;
+      }
+    }
+    return free_holder;
+  };
+
+  Segment::NodeState& state = segment_->nodes[node];
+  uint64_t wait_start = monotonic_ns();
+  bool waited = false;
+  Segment::Holder* holder = nullptr;
+  for (;;) {
+    // Only the oldest waiter of the node may go
+    uint32_t position = 0;
+    while (segment_->waiters[position].node != node) {
+      ++position;
+    }
+    uint64_t now = monotonic_ns();
+    bool first = segment_->waiters[position].ticket == ticket;
+    bool room = state.limit == 0 || state.active < state.limit;
+    bool staggered = state.last_admit_ns == 0 || now >= state.last_admit_ns + segment_->stagger_ns;
+    // A slot that is not recorded could not be recovered if we died, so
+    // wait for a holder entry as well
+    holder = find_holder();
+    if (first && room && staggered && holder) {
+      memmove(&segment_->waiters[position], &segment_->waiters[position + 1],
+              (segment_->num_waiters - position - 1) * sizeof(Segment::Waiter));
+      --segment_->num_waiters;
+      break;
+    }
+    // Wake up for the stagger deadline if that is all that holds us back,
+    // and otherwise every 100ms to look for waiters or holders that died
+    uint64_t timeout_ns = 100 * 1000 * 1000;
+    if (first && room && holder) {
+      timeout_ns = std::min(timeout_ns, state.last_admit_ns + segment_->stagger_ns - now);
+    }
+    uint32_t seq = segment_->wake_seq.load(std::memory_order_acquire);
+    unlock();
+    struct timespec timeout = {(time_t)(timeout_ns / 1000000000ull), (long)(timeout_ns % 1000000000ull)};
+    syscall(SYS_futex, &segment_->wake_seq, FUTEX_WAIT, seq, &timeout, nullptr, 0);
+    waited = true;
+    lock();
+    prune_dead_locked();
+  }
+
+  ++state.active;
+  state.last_admit_ns = monotonic_ns();
+  ++state.stats.admitted;
+  if (state.active > state.stats.peak_active) {
+    state.stats.peak_active = state.active;
+  }
+  if (waited) {
+    double seconds = (state.last_admit_ns - wait_start) / 1e9;
+    ++state.stats.waited;
+    state.stats.wait_seconds += seconds;
+    if (seconds > state.stats.max_wait_seconds) {
+      state.stats.max_wait_seconds = seconds;
+    }
+  }
+  if (holder->pid == 0) {
+    *holder = Segment::Holder{pid, node, 0};
+  }
+  ++holder->count;
+  unlock();
+  // The next waiter of the node may fit under the limit as well
+  wake_all();
+}
+
+void SharedAdmission::leave(int node) {
+  if (node < 0 || node >= kSharedAdmissionMaxNodes) {
+    return;
+  }
+  const pid_t pid = getpid();
+  lock();
+  --segment_->nodes[node].active;
+  for (Segment::Holder& holder : segment_->holders) {
+    if (holder.pid == pid && holder.node == node) {
+      if (--holder.count == 0) {
+        holder = Segment::Holder{0, 0, 0};
+      }
+      break;
+    }
+  }
+  unlock();
+  wake_all();
+}
+
+std::vector<AdmissionStats> SharedAdmission::stats() const {
+  std::vector<AdmissionStats> result;
+  lock();
+  for (const Segment::NodeState& state : segment_->nodes) {
+    if (state.stats.admitted != 0 || state.active != 0) {
+      result.push_back(state.stats);
+    }
+  }
+  unlock();
+  return result;
+}
+
+size_t SharedAdmission::recovered() const {
+  lock();
+  size_t recovered = segment_->recovered;
+  unlock();
+  return recovered;
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+// Admission control for cuMemCreate, per NUMA node.
+//
+// Devices on the same NUMA node share that node's kernel page allocator, and
+// when several of them create chunks at once, lock contention there can cut
+// the aggregate throughput below what fewer concurrent callers achieve.
+// CreateAdmission caps the number of cuMemCreate calls in flight on each
+// node. Callers over the cap wait in strict FIFO order (a ticket queue), so
+// devices sharing a node take turns chunk by chunk and none is starved.
+//
+// SharedAdmission enforces the same limits across processes, for hosts where
+// every GPU is driven by its own rank: its state lives in a POSIX shared
+// memory segment that every process joins by name, guarded by a robust
+// process-shared mutex, and waiters sleep on a futex in the segment. It can
+// also stagger admissions on a node by a minimum interval. A process that
+// dies while holding or waiting for a slot is detected (its pid is gone) and
+// its slots and queue entries are reclaimed by the next process to look.
+//
+// Once installed with set_create_admission(), either controller sees every
+// cuMemCreate issued by create_and_map and its pipelined, striped and
+// chunked variants, keyed by get_numa_node_for_gpu() of the chunk's device.
+// Setting CUMEM_ADMISSION_SHM=<name> in the environment makes a process
+// join that SharedAdmission on its first create without any code change
+// (with CUMEM_ADMISSION_LIMIT and CUMEM_ADMISSION_STAGGER_MS used if it
+// creates the segment).
+
+#include <condition_variable>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct AdmissionStats {
+  int node;
+  size_t limit;  // 0 when unlimited
+  size_t admitted;
+  size_t waited;  // Admissions that had to queue
+  size_t peak_active;
+  double wait_seconds;  // Summed over all admissions
+  double max_wait_seconds;
+};
+
+// Something that admits cuMemCreate calls per node
+class AdmissionController {
+ public:
+  virtual ~AdmissionController() {}
+  // 0 means unlimited
+  virtual void set_limit(int node, size_t limit) = 0;
+  // Block until a create on node may start, behind every earlier caller
+  virtual void enter(int node) = 0;
+  virtual void leave(int node) = 0;
+  virtual std::vector<AdmissionStats> stats() const = 0;
+};
+
+// Limits within this process
+class CreateAdmission : public AdmissionController {
+ public:
+  // default_limit applies to nodes without a set_limit(); 0 means unlimited
+  explicit CreateAdmission(size_t default_limit);
+
+  CreateAdmission(const CreateAdmission&) = delete;
+  CreateAdmission& operator=(const CreateAdmission&) = delete;
+
+  void set_limit(int node, size_t limit) override;
+  void enter(int node) override;
+  void leave(int node) override;
+  std::vector<AdmissionStats> stats() const override;
+
+ private:
+  struct Node {
+    size_t limit;
+    size_t active;
+    unsigned long long next_ticket;  // Handed to the next caller of enter()
+    unsigned long long serving;  // Lowest ticket not yet admitted
+    AdmissionStats stats;
+    std::condition_variable cv;
+  };
+
+  Node& node_locked(int node);
+
+  size_t default_limit_;
+  mutable std::mutex mutex_;
+  std::map<int, Node> nodes_;
+};
+
+const int kSharedAdmissionMaxNodes = 8;
+const int kSharedAdmissionMaxWaiters = 256;
+const int kSharedAdmissionMaxHolders = 256;
+
+struct SharedAdmissionOptions {
+  size_t limit = 0;  // Per node; 0 means unlimited
+  double stagger_seconds = 0.0;  // Minimum time between admissions on a node
+};
+
+// Limits across the processes that joined the same segment. Nodes are
+// 0 .. kSharedAdmissionMaxNodes - 1; creates on other nodes are not limited.
+class SharedAdmission : public AdmissionController {
+ public:
+  // Open the segment called name (e.g. "/cumem-admission"), creating it
+  // with options if no process has yet; null on failure. Options are
+  // ignored when the segment already exists, unless the process that
+  // created it died before setting it up, in which case this one does.
+  static std::unique_ptr<SharedAdmission> join(const std::string& name, const SharedAdmissionOptions& options);
+  // Unlink the segment; processes that joined keep their mapping
+  static bool remove(const std::string& name);
+
+  ~SharedAdmission();
+
+  SharedAdmission(const SharedAdmission&) = delete;
+  SharedAdmission& operator=(const SharedAdmission&) = delete;
+
+  void set_limit(int node, size_t limit) override;
+  void enter(int node) override;
+  void leave(int node) override;
+  std::vector<AdmissionStats> stats() const override;
+
+  // Slots and queue entries taken back from processes that died
+  size_t recovered() const;
+
+ private:
+  struct Segment;
+
+  explicit SharedAdmission(Segment* segment) : segment_(segment) {}
+
+  void lock() const;
+  void unlock() const;
+  void prune_dead_locked() const;
+  void wake_all() const;
+
+  Segment* segment_;
+};
+
+// Holds a slot on node for its lifetime; a no-op when admission is null
+class AdmissionGuard {
+ public:
+  AdmissionGuard(AdmissionController* admission, int node) : admission_(admission), node_(node) {
+    if (admission_) {
+      admission_->enter(node_);
+    }
+  }
+  ~AdmissionGuard() {
+    if (admission_) {
+      admission_->leave(node_);
+    }
+  }
+
+  AdmissionGuard(const AdmissionGuard&) = delete;
+  AdmissionGuard& operator=(const AdmissionGuard&) = delete;
+
+ private:
+  AdmissionController* admission_;
+  int node_;
+};
+
+// Route cuMemCreate through admission, or admit everything when null (the
+// default). The caller keeps ownership and must keep it alive until it is
+// uninstalled and no create is in flight.
+void set_create_admission(AdmissionController* admission);
+AdmissionController* get_create_admission();
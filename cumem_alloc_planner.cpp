@@ -0,0 +1,198 @@
+// Free-memory-aware allocation ordering
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+
+#include "cumem_alloc_planner.h"
+
+int get_numa_node_for_gpu(unsigned long long device);
+
+static std::string node_path(int node, const char* file) {
+  return "/sys/devices/system/node/node" + std::to_string(node) + "/" + file;
+}
+
+static bool read_text(const std::string& path, std::string* text) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  char buffer[4096];
+  ssize_t n;
+  text->clear();
+  while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+    text->append(buffer, n);
+  }
+  close(fd);
+  return n == 0;
+}
+
+static bool write_text(const std::string& path, const std::string& text) {
+  int fd = open(path.c_str(), O_WRONLY);
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = write(fd, text.data(), text.size()) == (ssize_t)text.size();
+  close(fd);
+  return ok;
+}
+
+// Value of a "Node <n> <key>: <value> kB" line, in bytes
+static bool meminfo_bytes(const std::string& meminfo, const char* key, size_t* bytes) {
+  size_t pos = meminfo.find(std::string(" ") + key + ":");
+  if (pos == std::string::npos) {
+    return false;
+  }
+  *bytes = strtoull(meminfo.c_str() + pos + strlen(key) + 2, nullptr, 10) * 1024;
+  return true;
+}
+
+bool read_node_memory(int node, NodeMemory* memory) {
+  std::string meminfo;
+  memory->node = node;
+  return read_text(node_path(node, "meminfo"), &meminfo) &&
+         meminfo_bytes(meminfo, "MemTotal", &memory->total_bytes) &&
+         meminfo_bytes(meminfo, "MemFree", &memory->free_bytes);
+}
+
+AllocationPlan plan_allocation_order(const std::vector<unsigned long long>& devices, size_t bytes_per_device) {
+  std::map<int, std::vector<unsigned long long>> pending;
+  for (unsigned long long device : devices) {
+    pending[get_numa_node_for_gpu(device)].push_back(device);
+  }
+  // Free memory per node, less what the planned allocations will take. A
+  // node whose meminfo cannot be read is never considered short.
+  std::map<int, size_t> free_bytes;
+  std::map<int, size_t> remaining;
+  for (auto& entry : pending) {
+    std::sort(entry.second.begin(), entry.second.end());
+    NodeMemory memory;
+    bool known = read_node_memory(entry.first, &memory);
+    free_bytes[entry.first] = known ? memory.free_bytes : 0;
+    remaining[entry.first] = known ? memory.free_bytes : SIZE_MAX;
+  }
+
+  AllocationPlan plan;
+  std::map<int, size_t> deferred_per_node;
+  for (size_t n = 0; n < devices.size(); ++n) {
+    // The node with the most memory left goes next
+    int node = -1;
+    for (const auto& entry : pending) {
+      if (!entry.second.empty() && (node < 0 || remaining[entry.first] > remaining[node])) {
+        node = entry.first;
+      }
+    }
+    bool deferred = remaining[node] < bytes_per_device;
+    plan.steps.push_back(AllocationStep{pending[node].front(), node, free_bytes[node], deferred});
+    pending[node].erase(pending[node].begin());
+    remaining[node] -= std::min(remaining[node], bytes_per_device);
+    if (deferred) {
+      ++deferred_per_node[node];
+    }
+  }
+  // Every deferred step came after all the others, since remaining only
+  // shrinks; record how far short each starved node is
+  for (const auto& entry : deferred_per_node) {
+    size_t demand = 0;
+    for (const AllocationStep& step : plan.steps) {
+      demand += step.node == entry.first ? bytes_per_device : 0;
+    }
+    plan.starved_nodes.push_back(entry.first);
+    plan.shortfall_bytes.push_back(demand - std::min(demand, free_bytes[entry.first]));
+  }
+  return plan;
+}
+
+NodeReclaimer::NodeReclaimer(int node, size_t bytes) : node_(node), done_(false) {
+  thread_ = std::thread([this, bytes]() {
+    // Compaction builds the contiguous free runs large allocations need;
+    // per-node proactive reclaim (newer kernels) evicts caches on the node
+    bool compacted = write_text(node_path(node_, "compact"), "1");
+    int compact_error = errno;
+    bool reclaimed = write_text(node_path(node_, "reclaim"), std::to_string(bytes));
+    if (!compacted && !reclaimed) {
+      std::cerr << "Could not start reclaim on NUMA node " << node_ << ": " << strerror(compact_error)
+                << std::endl;
+    }
+    done_.store(true, std::memory_order_release);
+  });
+}
+
+NodeReclaimer::~NodeReclaimer() {
+  thread_.join();
+}
+
+bool run_allocation_plan(const AllocationPlan& plan, size_t bytes_per_device,
+                         const std::function<bool(unsigned long long)>& allocate,
+                         double defer_timeout_seconds, AllocationRun* run) {
+  auto start_time = std::chrono::high_resolution_clock::now();
+  auto seconds_since = [](std::chrono::high_resolution_clock::time_point since) {
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - since;
+    return elapsed.count();
+  };
+  AllocationRun local = {};
+
+  std::map<int, std::unique_ptr<NodeReclaimer>> reclaimers;
+  for (size_t i = 0; i < plan.starved_nodes.size(); ++i) {
+    reclaimers[plan.starved_nodes[i]].reset(new NodeReclaimer(plan.starved_nodes[i], plan.shortfall_bytes[i]));
+    ++local.reclaims_started;
+  }
+
+  bool ok = true;
+  auto allocate_step = [&](const AllocationStep& step) {
+    ok = allocate(step.device) && ok;
+    local.order.push_back(step.device);
+    local.finish_seconds.push_back(seconds_since(start_time));
+  };
+
+  std::vector<AllocationStep> deferred;
+  for (const AllocationStep& step : plan.steps) {
+    if (step.deferred) {
+      deferred.push_back(step);
+    } else {
+      allocate_step(step);
+    }
+  }
+
+  while (!deferred.empty()) {
+    auto wait_start = std::chrono::high_resolution_clock::now();
+    size_t next = 0;
+    for (;;) {
+      // The first deferred device whose node has room by now
+      bool found = false;
+      bool reclaiming = false;
+      for (size_t i = 0; i < deferred.size() && !found; ++i) {
+        NodeMemory memory;
+        if (read_node_memory(deferred[i].node, &memory) && memory.free_bytes >= bytes_per_device) {
+          next = i;
+          found = true;
+        }
+        auto it = reclaimers.find(deferred[i].node);
+        reclaiming = reclaiming || (it != reclaimers.end() && !it->second->done());
+      }
+      if (found || !reclaiming || seconds_since(wait_start) >= defer_timeout_seconds) {
+        break;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    local.deferred_wait_seconds += seconds_since(wait_start);
+    allocate_step(deferred[next]);
+    deferred.erase(deferred.begin() + next);
+  }
+
+  // Reclaim still running once everything is allocated is not waited for
+  // in the reported time
+  local.seconds = seconds_since(start_time);
+  reclaimers.clear();
+  if (run) {
+    *run = local;
+  }
+  return ok;
+}
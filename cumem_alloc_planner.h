@@ -0,0 +1,88 @@
+#pragma once
+
+// Free-memory-aware ordering of per-device allocations.
+//
+// Creating a large region on a device draws on the host memory of the
+// device's NUMA node, and a node that is short of free memory makes the
+// kernel reclaim or compact under the allocation, which stalls it. The
+// planner reads each node's free memory from
+// /sys/devices/system/node/node<N>/meminfo and orders the devices greedily:
+// the next device is always one on the node with the most free memory left
+// after the allocations planned so far. Devices whose node would not have
+// room for them are deferred to the end, and reclaim is started on those
+// nodes (compaction, plus per-node proactive reclaim where the kernel has
+// it) so that it runs while the well-stocked nodes allocate.
+//
+// run_allocation_plan() then allocates in plan order. Before a deferred
+// device it takes, of the remaining deferred devices, the first whose node
+// now has room; if none has, it waits for one to get room or for the
+// reclaim on its node to finish, up to a timeout, so the actual order can
+// differ from the planned one.
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+struct NodeMemory {
+  int node;
+  size_t total_bytes;
+  size_t free_bytes;
+};
+
+// Read a node's meminfo; false if the node does not exist
+bool read_node_memory(int node, NodeMemory* memory);
+
+struct AllocationStep {
+  unsigned long long device;
+  int node;
+  size_t node_free_bytes;  // Free on the node when the plan was made
+  bool deferred;  // The node was not expected to have room left
+};
+
+struct AllocationPlan {
+  std::vector<AllocationStep> steps;
+  std::vector<int> starved_nodes;
+  std::vector<size_t> shortfall_bytes;  // Per starved node
+};
+
+// Plan allocations of bytes_per_device host memory on each device
+AllocationPlan plan_allocation_order(const std::vector<unsigned long long>& devices, size_t bytes_per_device);
+
+// Background compaction and reclaim of one node. Both need root; a node
+// where neither interface can be written finishes right away.
+class NodeReclaimer {
+ public:
+  NodeReclaimer(int node, size_t bytes);
+  // Waits for the reclaim to finish
+  ~NodeReclaimer();
+
+  NodeReclaimer(const NodeReclaimer&) = delete;
+  NodeReclaimer& operator=(const NodeReclaimer&) = delete;
+
+  int node() const { return node_; }
+  bool done() const { return done_.load(std::memory_order_acquire); }
+
+ private:
+  int node_;
+  std::atomic<bool> done_;
+  std::thread thread_;
+};
+
+struct AllocationRun {
+  std::vector<unsigned long long> order;  // Devices in the order they were allocated
+  std::vector<double> finish_seconds;  // Per entry of order, since the start
+  size_t reclaims_started;
+  double deferred_wait_seconds;  // Spent waiting for starved nodes
+  double seconds;
+};
+
+// Allocate on every device of plan with allocate(device), starting reclaim on
+// the starved nodes first. A deferred device waits at most
+// defer_timeout_seconds for its node. Returns false if any allocation failed;
+// the others are still attempted.
+bool run_allocation_plan(const AllocationPlan& plan, size_t bytes_per_device,
+                         const std::function<bool(unsigned long long)>& allocate,
+                         double defer_timeout_seconds, AllocationRun* run);
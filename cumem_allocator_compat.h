@@ -10,6 +10,9 @@ extern "C" {
   #ifndef CUDA_SUCCESS
     #define CUDA_SUCCESS hipSuccess
   #endif  // CUDA_SUCCESS
+  #ifndef CUDA_ERROR_NOT_SUPPORTED
+    #define CUDA_ERROR_NOT_SUPPORTED hipErrorNotSupported
+  #endif  // CUDA_ERROR_NOT_SUPPORTED
 
 // https://rocm.docs.amd.com/projects/HIPIFY/en/latest/tables/CUDA_Driver_API_functions_supported_by_HIP.html
 typedef unsigned long long CUdevice;
@@ -17,6 +20,7 @@ typedef hipDeviceptr_t CUdeviceptr;
 typedef hipError_t CUresult;
 typedef hipCtx_t CUcontext;
 typedef hipStream_t CUstream;
+typedef hipEvent_t CUevent;
 typedef hipMemGenericAllocationHandle_t CUmemGenericAllocationHandle;
 typedef hipMemAllocationGranularity_flags CUmemAllocationGranularity_flags;
 typedef hipMemAllocationProp CUmemAllocationProp;
@@ -24,6 +28,7 @@ typedef hipMemAccessDesc CUmemAccessDesc;
 
   #define CU_MEM_ALLOCATION_TYPE_PINNED hipMemAllocationTypePinned
   #define CU_MEM_LOCATION_TYPE_DEVICE hipMemLocationTypeDevice
+  #define CU_MEM_ACCESS_FLAGS_PROT_READ hipMemAccessFlagsProtRead
   #define CU_MEM_ACCESS_FLAGS_PROT_READWRITE hipMemAccessFlagsProtReadWrite
   #define CU_MEM_ALLOC_GRANULARITY_MINIMUM hipMemAllocationGranularityMinimum
 
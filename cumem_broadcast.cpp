@@ -0,0 +1,152 @@
+// Broadcast restore across devices
+#define USE_ROCM
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <hip/hip_runtime.h>
+
+#include "cumem_broadcast.h"
+
+void ensure_context(unsigned long long device);
+int get_numa_node_for_gpu(unsigned long long device);
+bool set_peer_access(unsigned long long device, ssize_t size, CUdeviceptr d_mem,
+                     const unsigned long long* peer_devices, size_t num_peers,
+                     bool read_only);
+
+// Order the replicas so that every parent comes before its children and
+// return each one's parent (-1 for the roots, which read from host)
+static std::vector<int> plan_broadcast(std::vector<BroadcastReplica>* replicas, BroadcastTopology topology) {
+  std::map<int, std::vector<BroadcastReplica>> groups;
+  for (const BroadcastReplica& replica : *replicas) {
+    groups[get_numa_node_for_gpu(replica.device)].push_back(replica);
+  }
+  replicas->clear();
+  std::vector<int> parents;
+  for (auto& entry : groups) {
+    std::vector<BroadcastReplica>& group = entry.second;
+    std::sort(group.begin(), group.end(),
+              [](const BroadcastReplica& a, const BroadcastReplica& b) { return a.device < b.device; });
+    int root = (int)replicas->size();
+    for (size_t j = 0; j < group.size(); ++j) {
+      if (j == 0) {
+        parents.push_back(-1);
+      } else if (topology == BroadcastTopology::kRing) {
+        parents.push_back(root + (int)j - 1);
+      } else {
+        parents.push_back(root + (int)(j - 1) / 2);
+      }
+      replicas->push_back(group[j]);
+    }
+  }
+  return parents;
+}
+
+// Give the children of every parent read access to its region
+static bool grant_children_access(const std::vector<BroadcastReplica>& replicas, const std::vector<int>& parents) {
+  bool ok = true;
+  for (size_t i = 0; i < replicas.size(); ++i) {
+    std::vector<unsigned long long> children;
+    for (size_t j = 0; j < replicas.size(); ++j) {
+      if (parents[j] == (int)i) {
+        children.push_back(replicas[j].device);
+      }
+    }
+    if (!children.empty()) {
+      ok = set_peer_access(replicas[i].device, replicas[i].mapped_size, replicas[i].d_mem, children.data(),
+                           children.size(), true) && ok;
+    }
+  }
+  return ok;
+}
+
+bool broadcast_restore(const void* host, size_t size, const std::vector<BroadcastReplica>& replicas,
+                       const BroadcastOptions& options, BroadcastStats* stats) {
+  auto start_time = std::chrono::high_resolution_clock::now();
+  BroadcastStats local = {};
+  for (const BroadcastReplica& replica : replicas) {
+    if (size > replica.mapped_size) {
+      std::cerr << "Broadcast of " << size << " bytes does not fit the region on device " << replica.device
+                << std::endl;
+      return false;
+    }
+  }
+  if (replicas.empty() || size == 0 || options.chunk_size == 0) {
+    return true;
+  }
+
+  std::vector<BroadcastReplica> order = replicas;
+  std::vector<int> parents = plan_broadcast(&order, options.topology);
+  if (!grant_children_access(order, parents)) {
+    return false;
+  }
+
+  // Registration fails harmlessly if the caller's buffer is already pinned;
+  // only unregister what was registered here
+  bool registered = hipHostRegister(const_cast<void*>(host), size, hipHostRegisterPortable) == hipSuccess;
+
+  std::vector<hipStream_t> streams(order.size(), nullptr);
+  std::vector<hipEvent_t> events(order.size(), nullptr);
+  bool ok = true;
+  for (size_t i = 0; i < order.size() && ok; ++i) {
+    ensure_context(order[i].device);
+    ok = hipStreamCreateWithFlags(&streams[i], hipStreamNonBlocking) == hipSuccess &&
+         hipEventCreateWithFlags(&events[i], hipEventDisableTiming) == hipSuccess;
+  }
+
+  // Enqueue chunk by chunk in topological order. A child's stream waits for
+  // the event its parent recorded after the same chunk; re-recording the
+  // event for the next chunk does not affect waits already enqueued.
+  for (size_t offset = 0; offset < size && ok; offset += options.chunk_size) {
+    size_t n = std::min(options.chunk_size, size - offset);
+    for (size_t i = 0; i < order.size() && ok; ++i) {
+      ensure_context(order[i].device);
+      void* dst = (void*)((uintptr_t)order[i].d_mem + offset);
+      hipError_t hip_result;
+      if (parents[i] < 0) {
+        hip_result = hipMemcpyAsync(dst, (const char*)host + offset, n, hipMemcpyHostToDevice, streams[i]);
+        local.bytes_from_host += n;
+      } else {
+        const void* src = (const void*)((uintptr_t)order[parents[i]].d_mem + offset);
+        hip_result = hipStreamWaitEvent(streams[i], events[parents[i]], 0);
+        if (hip_result == hipSuccess) {
+          hip_result = hipMemcpyAsync(dst, src, n, hipMemcpyDeviceToDevice, streams[i]);
+        }
+        local.bytes_peer += n;
+      }
+      if (hip_result == hipSuccess) {
+        hip_result = hipEventRecord(events[i], streams[i]);
+      }
+      if (hip_result != hipSuccess) {
+        std::cerr << "Error broadcasting to device " << order[i].device << ": " << hipGetErrorString(hip_result)
+                  << std::endl;
+        ok = false;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < order.size(); ++i) {
+    if (streams[i]) {
+      ensure_context(order[i].device);
+      ok = hipStreamSynchronize(streams[i]) == hipSuccess && ok;
+      hipStreamDestroy(streams[i]);
+    }
+    if (events[i]) {
+      hipEventDestroy(events[i]);
+    }
+    if (parents[i] < 0) {
+      ++local.num_roots;
+    }
+  }
+  if (registered) {
+    hipHostUnregister(const_cast<void*>(host));
+  }
+
+  std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+  local.seconds = elapsed.count();
+  if (stats) {
+    *stats = local;
+  }
+  return ok;
+}
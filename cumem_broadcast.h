@@ -0,0 +1,46 @@
+#pragma once
+
+// Broadcast restore: load the same host data into a region on every device
+// while reading host memory only once per NUMA node.
+//
+// Replicas are grouped by the NUMA node of their device. In each group one
+// replica (the lowest device) is the root and copies from host; every other
+// replica pulls from a parent in its group over device-to-device copies:
+//  - kRing chains the group, device after device, so every link carries
+//    the data once;
+//  - kTree uses a binary tree, halving the depth of the chain at the cost
+//    of each parent feeding two children.
+// The copy is cut into chunks and every replica has its own stream, so while
+// the root loads chunk c + 1 from host its child already forwards chunk c and
+// the host uplinks stay busy. Children are granted read access to their
+// parent's region with set_peer_access and keep it afterwards.
+
+#include <cstddef>
+#include <vector>
+
+#include "cumem_allocator_compat.h"
+
+struct BroadcastReplica {
+  unsigned long long device;
+  CUdeviceptr d_mem;
+  size_t mapped_size;  // Size of the mapped region at d_mem
+};
+
+enum class BroadcastTopology { kRing, kTree };
+
+struct BroadcastOptions {
+  BroadcastTopology topology = BroadcastTopology::kRing;
+  size_t chunk_size = 128 * 1024 * 1024;  // Pipelining unit
+};
+
+struct BroadcastStats {
+  size_t num_roots;  // Replicas loaded from host, one per NUMA node
+  size_t bytes_from_host;
+  size_t bytes_peer;  // Copied device to device
+  double seconds;
+};
+
+// Copy size bytes from host into the start of every replica. host is
+// registered for the duration of the call unless it is already pinned.
+bool broadcast_restore(const void* host, size_t size, const std::vector<BroadcastReplica>& replicas,
+                       const BroadcastOptions& options, BroadcastStats* stats);
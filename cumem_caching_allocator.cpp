@@ -0,0 +1,490 @@
+// Caching sub-allocator carving blocks out of mapped regions
+#define USE_ROCM
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <hip/hip_runtime.h>
+
+#include "cumem_caching_allocator.h"
+#include "cumem_region.h"
+#include "cumem_registry.h"
+
+void ensure_context(unsigned long long device);
+
+void unmap_and_release(unsigned long long device, ssize_t size, CUdeviceptr d_mem,
+                       CUmemGenericAllocationHandle** p_memHandle,
+                       unsigned long long* chunk_sizes, size_t num_chunks,
+                       size_t* p_saved_calls);
+
+static size_t round_up(size_t size, size_t alignment) {
+  return ((size + alignment - 1) / alignment) * alignment;
+}
+
+// DeviceSegmentSource
+
+DeviceSegmentSource::DeviceSegmentSource(unsigned long long device, size_t granularity)
+    : device_(device), granularity_(granularity) {}
+
+DeviceSegmentSource::~DeviceSegmentSource() {
+  std::vector<uintptr_t> bases;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& entry : segments_) {
+      bases.push_back(entry.first);
+    }
+  }
+  for (uintptr_t base : bases) {
+    size_t size = 0;
+    for (unsigned long long chunk_size : segments_[base].chunk_sizes) {
+      size += chunk_size;
+    }
+    release_segment(base, size);
+  }
+}
+
+uintptr_t DeviceSegmentSource::allocate_segment(size_t size) {
+  const size_t kChunkSize = round_up(128 * 1024 * 1024, granularity_);
+  size = round_up(size, granularity_);
+  ensure_context(device_);
+
+  CUdeviceptr d_mem = 0;
+  CUresult result = cuMemAddressReserve(&d_mem, size, granularity_, 0, 0);
+  if (result != CUDA_SUCCESS) {
+    const char* error_string;
+    cuGetErrorString(result, &error_string);
+    std::cerr << "CUDA Error in cuMemAddressReserve for segment: " << error_string << std::endl;
+    return 0;
+  }
+
+  Segment segment;
+  for (size_t remaining = size; remaining > 0;) {
+    size_t chunk = std::min(remaining, kChunkSize);
+    segment.chunk_sizes.push_back(chunk);
+    remaining -= chunk;
+  }
+  segment.handles.resize(segment.chunk_sizes.size());
+  std::vector<CUmemGenericAllocationHandle*> pointers(segment.handles.size());
+  for (size_t i = 0; i < pointers.size(); ++i) {
+    pointers[i] = &segment.handles[i];
+  }
+  if (!create_and_map_chunks(device_, d_mem, pointers.data(), segment.chunk_sizes.data(),
+                             segment.chunk_sizes.size())) {
+    cuMemAddressFree(d_mem, size);
+    return 0;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  segments_[(uintptr_t)d_mem] = std::move(segment);
+  return (uintptr_t)d_mem;
+}
+
+void DeviceSegmentSource::release_segment(uintptr_t base, size_t size) {
+  Segment segment;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = segments_.find(base);
+    if (it == segments_.end()) {
+      return;
+    }
+    segment = std::move(it->second);
+    segments_.erase(it);
+  }
+  std::vector<CUmemGenericAllocationHandle*> pointers(segment.handles.size());
+  for (size_t i = 0; i < pointers.size(); ++i) {
+    pointers[i] = &segment.handles[i];
+  }
+  unmap_and_release(device_, size, (CUdeviceptr)base, pointers.data(), segment.chunk_sizes.data(),
+                    segment.handles.size(), nullptr);
+  cuMemAddressFree((CUdeviceptr)base, round_up(size, granularity_));
+}
+
+// HostSegmentSource
+
+uintptr_t HostSegmentSource::allocate_segment(size_t size) {
+  void* ptr = nullptr;
+  if (posix_memalign(&ptr, granularity(), size) != 0) {
+    return 0;
+  }
+  return (uintptr_t)ptr;
+}
+
+void HostSegmentSource::release_segment(uintptr_t base, size_t /*size*/) {
+  ::free((void*)base);
+}
+
+// CachingAllocator
+
+// Every allocated block of every allocator, keyed by its pointer. Blocks are
+// only ever freed by their base, so no interval index is kept.
+static AllocationRegistry g_allocated_blocks(false);
+
+const size_t CachingAllocator::kMinBlockSize;
+const size_t CachingAllocator::kSmallLimit;
+const size_t CachingAllocator::kSmallSlabSize;
+const size_t CachingAllocator::kLargeSegmentSize;
+const size_t CachingAllocator::kMinSplitRemainder;
+const size_t CachingAllocator::kNumSmallClasses;
+
+CachingAllocator::CachingAllocator(SegmentSource* source) : source_(source), stats_() {}
+
+CachingAllocator::~CachingAllocator() {
+  for (auto& entry : segments_) {
+    Segment* segment = entry.second;
+    source_->release_segment(segment->base, segment->size);
+    for (Block* block : segment->blocks) {
+      if (block->allocated) {
+        g_allocated_blocks.erase(block->ptr);
+      }
+      delete block;
+    }
+    // Free large blocks are deleted with the pools below
+    for (Block* block = segment->head; block;) {
+      Block* next = block->next;
+      if (block->allocated) {
+        g_allocated_blocks.erase(block->ptr);
+        delete block;
+      }
+      block = next;
+    }
+    delete segment;
+  }
+  for (auto& entry : pools_) {
+    for (Block* block : entry.second.large) {
+      delete block;
+    }
+  }
+  for (Block* block : spare_blocks_) {
+    delete block;
+  }
+}
+
+// Four classes per power of two: (2^k, 2^(k+1)] is split into steps of 2^(k-2)
+size_t CachingAllocator::small_class(size_t size, size_t* class_size) {
+  if (size <= kMinBlockSize) {
+    *class_size = kMinBlockSize;
+    return 0;
+  }
+  size_t k = 63 - __builtin_clzll(size - 1);
+  size_t step = (size_t)1 << (k - 2);
+  size_t sub = (size - ((size_t)1 << k) + step - 1) / step;
+  *class_size = ((size_t)1 << k) + sub * step;
+  return 1 + (k - 9) * 4 + (sub - 1);
+}
+
+CachingAllocator::Block* CachingAllocator::new_block() {
+  if (!spare_blocks_.empty()) {
+    Block* block = spare_blocks_.back();
+    spare_blocks_.pop_back();
+    return block;
+  }
+  return new Block();
+}
+
+void CachingAllocator::delete_block(Block* block) {
+  spare_blocks_.push_back(block);
+}
+
+CachingAllocator::Block* CachingAllocator::malloc_small(size_t size, CUstream stream, StreamPools& pools) {
+  size_t class_size;
+  size_t index = small_class(size, &class_size);
+  std::vector<Block*>& free_list = pools.small[index];
+  if (!free_list.empty()) {
+    Block* block = free_list.back();
+    free_list.pop_back();
+    stats_.num_cache_hits++;
+    return block;
+  }
+
+  // Carve a new slab into blocks of this class
+  size_t slab_size = round_up(kSmallSlabSize, source_->granularity());
+  uintptr_t base = source_->allocate_segment(slab_size);
+  if (base == 0) {
+    return nullptr;
+  }
+  Segment* segment = new Segment();
+  segment->owner = this;
+  segment->base = base;
+  segment->size = slab_size;
+  segment->small = true;
+  segment->num_allocated = 0;
+  segment->head = nullptr;
+  segments_[base] = segment;
+  stats_.num_segments++;
+  stats_.reserved_bytes += slab_size;
+
+  size_t num_blocks = slab_size / class_size;
+  segment->blocks.reserve(num_blocks);
+  for (size_t i = 0; i < num_blocks; ++i) {
+    Block* block = new Block();
+    block->ptr = base + i * class_size;
+    block->size = class_size;
+    block->stream = stream;
+    block->allocated = false;
+    block->small = true;
+    block->prev = nullptr;
+    block->next = nullptr;
+    block->segment = segment;
+    segment->blocks.push_back(block);
+  }
+  // Hand out the lowest block first
+  for (size_t i = num_blocks; i > 1; --i) {
+    free_list.push_back(segment->blocks[i - 1]);
+  }
+  return segment->blocks[0];
+}
+
+CachingAllocator::Block* CachingAllocator::malloc_large(size_t size, CUstream stream, StreamPools& pools) {
+  size = round_up(size, kMinBlockSize);
+
+  // Best fit among this stream's cached blocks
+  Block key;
+  key.size = size;
+  key.ptr = 0;
+  auto it = pools.large.lower_bound(&key);
+  Block* block = nullptr;
+  if (it != pools.large.end()) {
+    block = *it;
+    pools.large.erase(it);
+    stats_.num_cache_hits++;
+  } else {
+    size_t segment_size = round_up(std::max(size, kLargeSegmentSize), source_->granularity());
+    uintptr_t base = source_->allocate_segment(segment_size);
+    if (base == 0) {
+      return nullptr;
+    }
+    Segment* segment = new Segment();
+    segment->owner = this;
+    segment->base = base;
+    segment->size = segment_size;
+    segment->small = false;
+    segment->num_allocated = 0;
+    segments_[base] = segment;
+    stats_.num_segments++;
+    stats_.reserved_bytes += segment_size;
+
+    block = new_block();
+    block->ptr = base;
+    block->size = segment_size;
+    block->stream = stream;
+    block->allocated = false;
+    block->small = false;
+    block->prev = nullptr;
+    block->next = nullptr;
+    block->segment = segment;
+    segment->head = block;
+  }
+
+  // Split off the remainder if it is worth keeping
+  if (block->size - size >= kMinSplitRemainder) {
+    Block* remainder = new_block();
+    remainder->ptr = block->ptr + size;
+    remainder->size = block->size - size;
+    remainder->stream = stream;
+    remainder->allocated = false;
+    remainder->small = false;
+    remainder->prev = block;
+    remainder->next = block->next;
+    remainder->segment = block->segment;
+    if (block->next) {
+      block->next->prev = remainder;
+    }
+    block->next = remainder;
+    block->size = size;
+    pools.large.insert(remainder);
+  }
+  return block;
+}
+
+void* CachingAllocator::malloc(size_t size, CUstream stream) {
+  if (size == 0) {
+    size = 1;
+  }
+  Block* block;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    StreamPools& pools = pools_[stream];
+    block = size <= kSmallLimit ? malloc_small(size, stream, pools)
+                                : malloc_large(size, stream, pools);
+    if (!block) {
+      return nullptr;
+    }
+    block->allocated = true;
+    block->segment->num_allocated++;
+    stats_.allocated_bytes += block->size;
+    stats_.num_allocs++;
+  }
+  // Nobody else can reach the block before its pointer is returned
+  g_allocated_blocks.insert(block->ptr, block->size, block);
+  return (void*)block->ptr;
+}
+
+CachingAllocator* CachingAllocator::owner_of(void* ptr) {
+  AllocationRegistry::Entry entry;
+  if (!g_allocated_blocks.find((uintptr_t)ptr, &entry)) {
+    return nullptr;
+  }
+  return static_cast<Block*>(entry.data)->segment->owner;
+}
+
+void CachingAllocator::free_large(Block* block, StreamPools& pools) {
+  // Merge with free neighbours in the same segment
+  Block* prev = block->prev;
+  if (prev && !prev->allocated) {
+    pools.large.erase(prev);
+    prev->size += block->size;
+    prev->next = block->next;
+    if (block->next) {
+      block->next->prev = prev;
+    }
+    delete_block(block);
+    block = prev;
+  }
+  Block* next = block->next;
+  if (next && !next->allocated) {
+    pools.large.erase(next);
+    block->size += next->size;
+    block->next = next->next;
+    if (next->next) {
+      next->next->prev = block;
+    }
+    delete_block(next);
+  }
+  pools.large.insert(block);
+}
+
+bool CachingAllocator::free(void* ptr) {
+  // Look the block up before taking the allocator's lock
+  AllocationRegistry::Entry entry;
+  if (!g_allocated_blocks.erase((uintptr_t)ptr, &entry)) {
+    return false;
+  }
+  Block* block = static_cast<Block*>(entry.data);
+  if (block->segment->owner != this) {
+    g_allocated_blocks.insert(entry.base, entry.size, entry.data);
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  block->allocated = false;
+  block->segment->num_allocated--;
+  stats_.allocated_bytes -= block->size;
+
+  // Cached blocks go back to the stream they were allocated on
+  StreamPools& pools = pools_[block->stream];
+  if (block->small) {
+    size_t class_size;
+    pools.small[small_class(block->size, &class_size)].push_back(block);
+  } else {
+    free_large(block, pools);
+  }
+  return true;
+}
+
+void CachingAllocator::empty_cache() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto it = segments_.begin(); it != segments_.end();) {
+    Segment* segment = it->second;
+    if (segment->num_allocated != 0) {
+      ++it;
+      continue;
+    }
+
+    // Drop the segment's blocks from every free list
+    for (auto& entry : pools_) {
+      StreamPools& pools = entry.second;
+      if (segment->small) {
+        for (std::vector<Block*>& free_list : pools.small) {
+          free_list.erase(std::remove_if(free_list.begin(), free_list.end(),
+                                         [segment](Block* b) { return b->segment == segment; }),
+                          free_list.end());
+        }
+      } else {
+        for (auto block_it = pools.large.begin(); block_it != pools.large.end();) {
+          if ((*block_it)->segment == segment) {
+            delete_block(*block_it);
+            block_it = pools.large.erase(block_it);
+          } else {
+            ++block_it;
+          }
+        }
+      }
+    }
+    for (Block* block : segment->blocks) {
+      delete block;
+    }
+
+    source_->release_segment(segment->base, segment->size);
+    stats_.num_segments--;
+    stats_.reserved_bytes -= segment->size;
+    delete segment;
+    it = segments_.erase(it);
+  }
+}
+
+CachingAllocatorStats CachingAllocator::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+// PyTorch pluggable allocator ABI
+
+namespace {
+
+struct DeviceAllocator {
+  std::unique_ptr<DeviceSegmentSource> source;
+  std::unique_ptr<CachingAllocator> allocator;
+};
+
+std::mutex g_device_allocators_mutex;
+std::unordered_map<int, DeviceAllocator> g_device_allocators;
+
+CachingAllocator* device_allocator(int device) {
+  std::lock_guard<std::mutex> lock(g_device_allocators_mutex);
+  DeviceAllocator& entry = g_device_allocators[device];
+  if (!entry.allocator) {
+    CUmemAllocationProp prop = {};
+    prop.type = CU_MEM_ALLOCATION_TYPE_PINNED;
+    prop.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+    prop.location.id = device;
+    prop.allocFlags.compressionType = CU_MEM_ALLOCATION_COMP_NONE;
+    size_t granularity = 0;
+    if (cuMemGetAllocationGranularity(&granularity, &prop, CU_MEM_ALLOC_GRANULARITY_MINIMUM) !=
+            CUDA_SUCCESS ||
+        granularity == 0) {
+      granularity = 2 * 1024 * 1024;
+    }
+    entry.source.reset(new DeviceSegmentSource(device, granularity));
+    entry.allocator.reset(new CachingAllocator(entry.source.get()));
+  }
+  return entry.allocator.get();
+}
+
+}  // namespace
+
+extern "C" {
+
+void* cumem_malloc(ssize_t size, int device, CUstream stream) {
+  if (size < 0) {
+    return nullptr;
+  }
+  return device_allocator(device)->malloc(size, stream);
+}
+
+void cumem_free(void* ptr, ssize_t /*size*/, int device, CUstream /*stream*/) {
+  if (!ptr) {
+    return;
+  }
+  // The registry knows the allocator, so the per-device table and its lock
+  // are not needed here
+  CachingAllocator* allocator = CachingAllocator::owner_of(ptr);
+  if (!allocator || !allocator->free(ptr)) {
+    std::cerr << "cumem_free: " << ptr << " was not allocated on device " << device << std::endl;
+  }
+}
+
+void cumem_empty_cache(int device) {
+  device_allocator(device)->empty_cache();
+}
+
+}  // extern "C"
@@ -0,0 +1,164 @@
+#pragma once
+
+// Caching sub-allocator on top of regions built by create_and_map.
+//
+// Segments (whole mapped regions) are obtained from a SegmentSource and carved
+// into blocks:
+//  - small requests (<= 1MB) are rounded up to one of 45 size classes (four
+//    per power of two, starting at 512B) and served from 2MB slabs through
+//    segregated free lists;
+//  - large requests are served best-fit from large segments, splitting blocks
+//    on allocation and coalescing neighbours on free.
+// Free blocks are cached per stream and only reused by the stream that freed
+// them, so no cross-stream synchronisation is needed. Segments go back to the
+// source only in empty_cache(). Allocated blocks are looked up by pointer in
+// an AllocationRegistry shared by every allocator, so a free takes the
+// allocator's lock only to put the block back on a free list.
+//
+// cumem_malloc/cumem_free at the bottom match the PyTorch pluggable allocator
+// ABI (torch.cuda.memory.CUDAPluggableAllocator).
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+#include "cumem_allocator_compat.h"
+
+// Where the caching allocator gets its segments from
+class SegmentSource {
+ public:
+  virtual ~SegmentSource() {}
+  // Returns the base of a new segment of exactly size bytes, or 0
+  virtual uintptr_t allocate_segment(size_t size) = 0;
+  virtual void release_segment(uintptr_t base, size_t size) = 0;
+  // Segment sizes are rounded up to a multiple of this
+  virtual size_t granularity() const = 0;
+};
+
+// Segments backed by device memory: a VA reservation mapped with 128MB chunks
+// via create_and_map_chunks
+class DeviceSegmentSource : public SegmentSource {
+ public:
+  DeviceSegmentSource(unsigned long long device, size_t granularity);
+  ~DeviceSegmentSource();
+  uintptr_t allocate_segment(size_t size) override;
+  void release_segment(uintptr_t base, size_t size) override;
+  size_t granularity() const override { return granularity_; }
+
+ private:
+  struct Segment {
+    std::vector<CUmemGenericAllocationHandle> handles;
+    std::vector<unsigned long long> chunk_sizes;
+  };
+
+  unsigned long long device_;
+  size_t granularity_;
+  std::mutex mutex_;
+  std::unordered_map<uintptr_t, Segment> segments_;
+};
+
+// Segments backed by pageable host memory; used to benchmark and test the
+// allocator's bookkeeping without a device
+class HostSegmentSource : public SegmentSource {
+ public:
+  uintptr_t allocate_segment(size_t size) override;
+  void release_segment(uintptr_t base, size_t size) override;
+  size_t granularity() const override { return 2 * 1024 * 1024; }
+};
+
+struct CachingAllocatorStats {
+  size_t allocated_bytes;  // Bytes handed out to callers (after rounding)
+  size_t reserved_bytes;   // Bytes held in segments
+  size_t num_segments;
+  size_t num_allocs;
+  size_t num_cache_hits;   // Allocations served without a new segment
+};
+
+class CachingAllocator {
+ public:
+  static const size_t kMinBlockSize = 512;
+  static const size_t kSmallLimit = 1024 * 1024;
+  static const size_t kSmallSlabSize = 2 * 1024 * 1024;
+  static const size_t kLargeSegmentSize = 64 * 1024 * 1024;
+  static const size_t kMinSplitRemainder = 1024 * 1024;
+  static const size_t kNumSmallClasses = 45;
+
+  // The allocator does not take ownership of source
+  explicit CachingAllocator(SegmentSource* source);
+  ~CachingAllocator();
+
+  CachingAllocator(const CachingAllocator&) = delete;
+  CachingAllocator& operator=(const CachingAllocator&) = delete;
+
+  void* malloc(size_t size, CUstream stream);
+  // Returns false if ptr was not allocated here
+  bool free(void* ptr);
+  // The allocator ptr was allocated from, or null
+  static CachingAllocator* owner_of(void* ptr);
+  // Release every segment that has no allocated block
+  void empty_cache();
+  CachingAllocatorStats stats() const;
+
+  // Size class index and rounded size for a small request
+  static size_t small_class(size_t size, size_t* class_size);
+
+ private:
+  struct Segment;
+
+  struct Block {
+    uintptr_t ptr;
+    size_t size;
+    CUstream stream;
+    bool allocated;
+    bool small;
+    Block* prev;  // Neighbours inside a large segment, for coalescing
+    Block* next;
+    Segment* segment;
+  };
+
+  struct Segment {
+    CachingAllocator* owner;
+    uintptr_t base;
+    size_t size;
+    bool small;
+    size_t num_allocated;
+    std::vector<Block*> blocks;  // Small slabs only: every block carved from it
+    Block* head;  // Large segments only: the block at base, which never merges away
+  };
+
+  struct BlockBySize {
+    bool operator()(const Block* a, const Block* b) const {
+      return a->size != b->size ? a->size < b->size : a->ptr < b->ptr;
+    }
+  };
+
+  struct StreamPools {
+    std::vector<Block*> small[kNumSmallClasses];
+    std::set<Block*, BlockBySize> large;
+  };
+
+  Block* new_block();
+  void delete_block(Block* block);
+  Block* malloc_small(size_t size, CUstream stream, StreamPools& pools);
+  Block* malloc_large(size_t size, CUstream stream, StreamPools& pools);
+  void free_large(Block* block, StreamPools& pools);
+
+  SegmentSource* source_;
+  mutable std::mutex mutex_;
+  std::unordered_map<CUstream, StreamPools> pools_;
+  std::unordered_map<uintptr_t, Segment*> segments_;
+  std::vector<Block*> spare_blocks_;
+  CachingAllocatorStats stats_;
+};
+
+// PyTorch pluggable allocator entry points. One CachingAllocator per device,
+// backed by DeviceSegmentSource, created on first use.
+extern "C" {
+void* cumem_malloc(ssize_t size, int device, CUstream stream);
+void cumem_free(void* ptr, ssize_t size, int device, CUstream stream);
+void cumem_empty_cache(int device);
+}
@@ -0,0 +1,362 @@
+// Region checkpoints to local files
+#define USE_ROCM
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <hip/hip_runtime.h>
+
+#include "cumem_checkpoint.h"
+#include "cumem_io_engine.h"
+#include "cumem_staging_pool.h"
+
+void ensure_context(unsigned long long device);
+int get_numa_node_for_gpu(unsigned long long device);
+
+static const char kCheckpointMagic[8] = {'C', 'U', 'M', 'E', 'M', 'C', 'K', '1'};
+static const uint32_t kCheckpointVersion = 1;
+
+struct CheckpointHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t num_chunks;
+  uint64_t region_size;
+  uint64_t data_offset;  // Size of the header block, where chunk 0 starts
+};
+
+struct CheckpointIndexEntry {
+  uint64_t file_offset;
+  uint64_t size;
+};
+
+static size_t align_up(size_t size) {
+  return (size + kCheckpointAlignment - 1) / kCheckpointAlignment * kCheckpointAlignment;
+}
+
+static size_t header_block_size(size_t num_chunks) {
+  return align_up(sizeof(CheckpointHeader) + num_chunks * sizeof(CheckpointIndexEntry));
+}
+
+static int open_checkpoint(const std::string& path, int flags, bool* direct_io) {
+  int fd = open(path.c_str(), flags | O_DIRECT, 0644);
+  *direct_io = fd >= 0;
+  if (fd < 0 && errno == EINVAL) {
+    // tmpfs and some network filesystems do not support O_DIRECT
+    fd = open(path.c_str(), flags, 0644);
+  }
+  if (fd < 0) {
+    std::cerr << "Error opening checkpoint " << path << ": " << strerror(errno) << std::endl;
+  }
+  return fd;
+}
+
+static bool allocate_buffers(const CheckpointOptions& options, unsigned long long device,
+                             std::vector<void*>* buffers) {
+  if (options.buffer_size == 0 || options.buffer_size % kCheckpointAlignment != 0 ||
+      options.io_size == 0 || options.io_size % kCheckpointAlignment != 0 || options.num_buffers == 0 ||
+      options.queue_depth == 0) {
+    std::cerr << "Checkpoint buffers and I/O sizes must be non-zero multiples of " << kCheckpointAlignment
+              << " bytes" << std::endl;
+    return false;
+  }
+  StagingPool* pool = options.staging_pool;
+  bool use_pool = pool && pool->slab_size() >= options.buffer_size;
+  int node = get_numa_node_for_gpu(device);
+  for (size_t i = 0; i < options.num_buffers; ++i) {
+    // Slabs and hipHostMalloc memory are both page aligned, as O_DIRECT
+    // requires
+    void* buffer = use_pool ? pool->acquire(node) : nullptr;
+    if (buffer) {
+      buffers->push_back(buffer);
+      continue;
+    }
+    hipError_t hip_result = hipHostMalloc(&buffer, options.buffer_size);
+    if (hip_result != hipSuccess) {
+      std::cerr << "Error allocating checkpoint buffer: " << hipGetErrorString(hip_result) << std::endl;
+      return false;
+    }
+    buffers->push_back(buffer);
+  }
+  return true;
+}
+
+static std::unique_ptr<IoEngine> open_engine(int fd, bool write, unsigned long long device,
+                                             const std::vector<void*>& buffers,
+                                             const CheckpointOptions& options, CheckpointStats* stats) {
+  std::unique_ptr<IoEngine> engine =
+      create_io_engine(options.engine, fd, write, buffers, options.buffer_size, options.queue_depth,
+                       options.io_size, get_numa_node_for_gpu(device));
+  if (engine) {
+    stats->engine = engine->name();
+    stats->registered_buffers = engine->registered_buffers();
+  }
+  return engine;
+}
+
+static void free_buffers(const CheckpointOptions& options, std::vector<void*>& buffers) {
+  for (void* buffer : buffers) {
+    if (options.staging_pool && options.staging_pool->owns(buffer)) {
+      options.staging_pool->release(buffer);
+    } else {
+      hipHostFree(buffer);
+    }
+  }
+  buffers.clear();
+}
+
+bool save_region_checkpoint(const std::string& path, unsigned long long device, CUdeviceptr d_mem,
+                            const unsigned long long* chunk_sizes, size_t num_chunks,
+                            const CheckpointOptions& options, CheckpointStats* stats) {
+  auto start_time = std::chrono::high_resolution_clock::now();
+  CheckpointStats local = {};
+  ensure_context(device);
+
+  std::vector<void*> buffers;
+  if (!allocate_buffers(options, device, &buffers)) {
+    free_buffers(options, buffers);
+    return false;
+  }
+  int fd = open_checkpoint(path, O_WRONLY | O_CREAT | O_TRUNC, &local.direct_io);
+  if (fd < 0) {
+    free_buffers(options, buffers);
+    return false;
+  }
+
+  size_t header_size = header_block_size(num_chunks);
+  void* header_block = nullptr;
+  if (posix_memalign(&header_block, kCheckpointAlignment, header_size) != 0) {
+    close(fd);
+    free_buffers(options, buffers);
+    return false;
+  }
+  memset(header_block, 0, header_size);
+  CheckpointHeader* header = static_cast<CheckpointHeader*>(header_block);
+  CheckpointIndexEntry* index = reinterpret_cast<CheckpointIndexEntry*>(header + 1);
+
+  std::unique_ptr<IoEngine> io = open_engine(fd, true, device, buffers, options, &local);
+  bool ok = io != nullptr;
+  int io_error = 0;
+  double io_seconds = 0;
+  if (ok) {
+    std::vector<size_t> free_list;
+    for (size_t i = 0; i < buffers.size(); ++i) {
+      free_list.push_back(i);
+    }
+    size_t in_flight = 0;
+    uint64_t file_offset = header_size;
+    uintptr_t device_offset = 0;
+    for (size_t i = 0; i < num_chunks && ok; ++i) {
+      index[i].file_offset = file_offset;
+      index[i].size = chunk_sizes[i];
+      for (size_t piece = 0; piece < chunk_sizes[i] && ok; piece += options.buffer_size) {
+        if (free_list.empty()) {
+          IoRequest done = io->wait();
+          --in_flight;
+          io_error = done.error;
+          ok = io_error == 0;
+          free_list.push_back(done.buffer);
+          if (!ok) {
+            break;
+          }
+        }
+        size_t buffer = free_list.back();
+        free_list.pop_back();
+        size_t length = std::min<size_t>(options.buffer_size, chunk_sizes[i] - piece);
+
+        auto copy_start = std::chrono::high_resolution_clock::now();
+        hipError_t hip_result = hipMemcpy(buffers[buffer], (void*)((uintptr_t)d_mem + device_offset + piece),
+                                          length, hipMemcpyDeviceToHost);
+        std::chrono::duration<double> copy_time = std::chrono::high_resolution_clock::now() - copy_start;
+        local.copy_seconds += copy_time.count();
+        if (hip_result != hipSuccess) {
+          std::cerr << "Error copying chunk " << i << " for checkpoint: " << hipGetErrorString(hip_result)
+                    << std::endl;
+          ok = false;
+          break;
+        }
+        // Pad the last piece of an unaligned chunk with zeros
+        memset((char*)buffers[buffer] + length, 0, align_up(length) - length);
+        io->submit(IoRequest{buffer, file_offset + piece, align_up(length), device_offset + piece, length, 0});
+        ++in_flight;
+        local.bytes += length;
+      }
+      file_offset += align_up(chunk_sizes[i]);
+      device_offset += chunk_sizes[i];
+    }
+    while (in_flight > 0) {
+      IoRequest done = io->wait();
+      --in_flight;
+      if (done.error) {
+        io_error = done.error;
+        ok = false;
+      }
+    }
+    io_seconds = io->wait_seconds();
+    io.reset();
+  }
+
+  if (ok) {
+    // The header goes last so that a partially written file never validates
+    memcpy(header->magic, kCheckpointMagic, sizeof(header->magic));
+    header->version = kCheckpointVersion;
+    header->num_chunks = num_chunks;
+    header->data_offset = header_size;
+    for (size_t i = 0; i < num_chunks; ++i) {
+      header->region_size += chunk_sizes[i];
+    }
+    auto io_start = std::chrono::high_resolution_clock::now();
+    errno = 0;
+    ok = pwrite_all(fd, header_block, header_size, 0) && fdatasync(fd) == 0;
+    if (!ok) {
+      io_error = errno ? errno : EIO;
+    }
+    std::chrono::duration<double> io_time = std::chrono::high_resolution_clock::now() - io_start;
+    io_seconds += io_time.count();
+  }
+  if (io_error) {
+    std::cerr << "Error writing checkpoint " << path << ": " << strerror(io_error) << std::endl;
+  }
+
+  free(header_block);
+  close(fd);
+  if (!ok) {
+    unlink(path.c_str());
+  }
+  free_buffers(options, buffers);
+
+  std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+  local.seconds = elapsed.count();
+  local.io_seconds = io_seconds;
+  if (stats) {
+    *stats = local;
+  }
+  return ok;
+}
+
+// Read and validate the header block against the region's chunk layout
+static bool read_checkpoint_index(int fd, const std::string& path, const unsigned long long* chunk_sizes,
+                                  size_t num_chunks, std::vector<CheckpointIndexEntry>* index) {
+  size_t header_size = header_block_size(num_chunks);
+  void* header_block = nullptr;
+  if (posix_memalign(&header_block, kCheckpointAlignment, header_size) != 0) {
+    return false;
+  }
+  bool ok = pread_all(fd, header_block, header_size, 0);
+  const CheckpointHeader* header = static_cast<const CheckpointHeader*>(header_block);
+  if (!ok || memcmp(header->magic, kCheckpointMagic, sizeof(header->magic)) != 0 ||
+      header->version != kCheckpointVersion || header->num_chunks != num_chunks ||
+      header->data_offset != header_size) {
+    std::cerr << "Checkpoint " << path << " is incomplete or does not match the region" << std::endl;
+    free(header_block);
+    return false;
+  }
+  const CheckpointIndexEntry* entries = reinterpret_cast<const CheckpointIndexEntry*>(header + 1);
+  index->assign(entries, entries + num_chunks);
+  free(header_block);
+  for (size_t i = 0; i < num_chunks; ++i) {
+    if ((*index)[i].size != chunk_sizes[i] || (*index)[i].file_offset % kCheckpointAlignment != 0) {
+      std::cerr << "Checkpoint " << path << " chunk " << i << " does not match the region" << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool load_region_checkpoint(const std::string& path, unsigned long long device, CUdeviceptr d_mem,
+                            const unsigned long long* chunk_sizes, size_t num_chunks,
+                            size_t first_chunk, size_t count, const CheckpointOptions& options,
+                            CheckpointStats* stats) {
+  auto start_time = std::chrono::high_resolution_clock::now();
+  CheckpointStats local = {};
+  if (first_chunk > num_chunks || count > num_chunks - first_chunk) {
+    std::cerr << "Checkpoint chunk range out of bounds" << std::endl;
+    return false;
+  }
+  ensure_context(device);
+
+  int fd = open_checkpoint(path, O_RDONLY, &local.direct_io);
+  if (fd < 0) {
+    return false;
+  }
+  std::vector<CheckpointIndexEntry> index;
+  std::vector<void*> buffers;
+  if (!read_checkpoint_index(fd, path, chunk_sizes, num_chunks, &index) ||
+      !allocate_buffers(options, device, &buffers)) {
+    free_buffers(options, buffers);
+    close(fd);
+    return false;
+  }
+
+  // Every piece to read, in file order
+  std::vector<IoRequest> pieces;
+  uintptr_t device_offset = 0;
+  for (size_t i = 0; i < first_chunk + count; ++i) {
+    if (i >= first_chunk) {
+      for (size_t piece = 0; piece < chunk_sizes[i]; piece += options.buffer_size) {
+        size_t length = std::min<size_t>(options.buffer_size, chunk_sizes[i] - piece);
+        pieces.push_back(IoRequest{0, index[i].file_offset + piece, align_up(length), device_offset + piece,
+                                   length, 0});
+      }
+    }
+    device_offset += chunk_sizes[i];
+  }
+
+  std::unique_ptr<IoEngine> io = open_engine(fd, false, device, buffers, options, &local);
+  bool ok = io != nullptr;
+  if (ok) {
+    size_t next = 0;
+    size_t in_flight = 0;
+    for (; next < pieces.size() && next < buffers.size(); ++next) {
+      pieces[next].buffer = next;
+      io->submit(pieces[next]);
+      ++in_flight;
+    }
+    while (in_flight > 0) {
+      IoRequest done = io->wait();
+      --in_flight;
+      if (done.error) {
+        std::cerr << "Error reading checkpoint " << path << ": " << strerror(done.error) << std::endl;
+        ok = false;
+      }
+      if (!ok) {
+        continue;
+      }
+      auto copy_start = std::chrono::high_resolution_clock::now();
+      hipError_t hip_result = hipMemcpy((void*)((uintptr_t)d_mem + done.device_offset), buffers[done.buffer],
+                                        done.copy_length, hipMemcpyHostToDevice);
+      std::chrono::duration<double> copy_time = std::chrono::high_resolution_clock::now() - copy_start;
+      local.copy_seconds += copy_time.count();
+      if (hip_result != hipSuccess) {
+        std::cerr << "Error restoring checkpoint data: " << hipGetErrorString(hip_result) << std::endl;
+        ok = false;
+        continue;
+      }
+      local.bytes += done.copy_length;
+      if (next < pieces.size()) {
+        pieces[next].buffer = done.buffer;
+        io->submit(pieces[next]);
+        ++in_flight;
+        ++next;
+      }
+    }
+    local.io_seconds = io->wait_seconds();
+    io.reset();
+  }
+
+  free_buffers(options, buffers);
+  close(fd);
+
+  std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+  local.seconds = elapsed.count();
+  if (stats) {
+    *stats = local;
+  }
+  return ok;
+}
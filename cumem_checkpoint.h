@@ -0,0 +1,62 @@
+#pragma once
+
+// Spill tier: stream a mapped region to a local file and back.
+//
+// The calling thread copies the region between the device and a few pinned
+// buffers while an IoEngine (cumem_io_engine.h) writes or reads the previous
+// buffers, so device copies and file I/O overlap. The file is opened with
+// O_DIRECT (falling back to buffered I/O where the filesystem refuses it) so
+// that hundreds of GB do not go through the page cache.
+//
+// File layout (all offsets and lengths multiples of kCheckpointAlignment):
+//   [header + chunk index][chunk 0][chunk 1]...
+// The header holds a magic, the chunk count and the region size; the index
+// gives each chunk's file offset and size, so any run of chunks can be
+// restored with a seek. The header is written last, after all data, so a
+// file from an interrupted save is rejected.
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "cumem_allocator_compat.h"
+#include "cumem_io_engine.h"
+
+const size_t kCheckpointAlignment = 4096;
+
+class StagingPool;
+
+struct CheckpointOptions {
+  size_t buffer_size = 64 * 1024 * 1024;  // Multiple of kCheckpointAlignment
+  size_t num_buffers = 4;
+  // Take the buffers from slabs of this pool on the device's NUMA node, as
+  // long as its slabs hold buffer_size and some are free; the rest are
+  // allocated for the call
+  StagingPool* staging_pool = nullptr;
+  IoEngineKind engine = IoEngineKind::kAuto;
+  size_t queue_depth = 32;  // File I/O operations in flight
+  size_t io_size = 1024 * 1024;  // Bytes per operation, multiple of kCheckpointAlignment
+};
+
+struct CheckpointStats {
+  size_t bytes;  // Chunk bytes written or read
+  double seconds;  // Wall time
+  double copy_seconds;  // Calling thread's time in device copies
+  double io_seconds;  // Calling thread's time waiting for file I/O
+  bool direct_io;  // The file was opened with O_DIRECT
+  const char* engine;  // Name of the I/O engine used
+  bool registered_buffers;  // The engine registered the buffers with the kernel
+};
+
+// Write every chunk of the region at d_mem to path, replacing the file
+bool save_region_checkpoint(const std::string& path, unsigned long long device, CUdeviceptr d_mem,
+                            const unsigned long long* chunk_sizes, size_t num_chunks,
+                            const CheckpointOptions& options, CheckpointStats* stats);
+
+// Read chunks [first_chunk, first_chunk + count) of a checkpoint back into
+// the same chunks of the region at d_mem. The region's chunk layout must
+// match the one the checkpoint was saved with.
+bool load_region_checkpoint(const std::string& path, unsigned long long device, CUdeviceptr d_mem,
+                            const unsigned long long* chunk_sizes, size_t num_chunks,
+                            size_t first_chunk, size_t count, const CheckpointOptions& options,
+                            CheckpointStats* stats);
@@ -0,0 +1,250 @@
+// Chunk codecs for offloaded host copies
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "cumem_compress.h"
+
+static const size_t kHashBits = 16;
+static const size_t kMinMatch = 4;
+static const size_t kMaxOffset = 65535;
+// The last bytes of the input are always emitted as literals, so match
+// extension never has to check for the end of the buffer byte by byte
+static const size_t kLastLiterals = 8;
+
+static uint32_t read32(const uint8_t* p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static uint64_t read64(const uint8_t* p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static size_t hash4(uint32_t sequence) {
+  return (sequence * 2654435761u) >> (32 - kHashBits);
+}
+
+static void write_length(uint8_t*& op, size_t length) {
+  while (length >= 255) {
+    *op++ = 255;
+    length -= 255;
+  }
+  *op++ = (uint8_t)length;
+}
+
+static bool read_length(const uint8_t*& ip, const uint8_t* iend, size_t* length) {
+  uint8_t byte;
+  do {
+    if (ip >= iend) {
+      return false;
+    }
+    byte = *ip++;
+    *length += byte;
+  } while (byte == 255);
+  return true;
+}
+
+// One sequence: literals followed by a match, or only literals when
+// match_length is 0 (the last sequence)
+static bool emit_sequence(uint8_t*& op, const uint8_t* oend, const uint8_t* literals,
+                          size_t literal_length, size_t offset, size_t match_length) {
+  size_t worst_case = 1 + literal_length / 255 + 1 + literal_length + 2 + match_length / 255 + 1;
+  if ((size_t)(oend - op) < worst_case) {
+    return false;
+  }
+  size_t match_code = match_length ? match_length - kMinMatch : 0;
+  uint8_t* token = op++;
+  *token = (uint8_t)((std::min<size_t>(literal_length, 15) << 4) | std::min<size_t>(match_code, 15));
+  if (literal_length >= 15) {
+    write_length(op, literal_length - 15);
+  }
+  memcpy(op, literals, literal_length);
+  op += literal_length;
+  if (match_length) {
+    *op++ = (uint8_t)(offset & 0xFF);
+    *op++ = (uint8_t)(offset >> 8);
+    if (match_code >= 15) {
+      write_length(op, match_code - 15);
+    }
+  }
+  return true;
+}
+
+static size_t lz_compress(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity) {
+  thread_local std::vector<uint32_t> table;
+  table.assign((size_t)1 << kHashBits, 0);
+
+  uint8_t* op = dst;
+  const uint8_t* oend = dst + capacity;
+  size_t anchor = 0;
+  size_t ip = 0;
+  size_t misses = 0;
+  size_t match_limit = size > kLastLiterals + kMinMatch ? size - kLastLiterals - kMinMatch : 0;
+  while (ip < match_limit) {
+    uint32_t sequence = read32(src + ip);
+    size_t slot = hash4(sequence);
+    size_t ref = table[slot];  // Position + 1, 0 if empty
+    table[slot] = (uint32_t)(ip + 1);
+    if (ref == 0 || ip - (ref - 1) > kMaxOffset || read32(src + ref - 1) != sequence) {
+      // Step one byte further for every 64 misses in a row
+      ip += 1 + (misses++ >> 6);
+      continue;
+    }
+    --ref;
+    misses = 0;
+
+    size_t length = kMinMatch;
+    size_t max_length = size - kLastLiterals - ip;
+    while (length + 8 <= max_length) {
+      uint64_t diff = read64(src + ref + length) ^ read64(src + ip + length);
+      if (diff) {
+        length += __builtin_ctzll(diff) / 8;
+        break;
+      }
+      length += 8;
+    }
+    if (length + 8 > max_length) {
+      while (length < max_length && src[ref + length] == src[ip + length]) {
+        ++length;
+      }
+    }
+
+    if (!emit_sequence(op, oend, src + anchor, ip - anchor, ip - ref, length)) {
+      return 0;
+    }
+    ip += length;
+    anchor = ip;
+  }
+  if (!emit_sequence(op, oend, src + anchor, size - anchor, 0, 0)) {
+    return 0;
+  }
+  return op - dst;
+}
+
+static bool lz_decompress(const uint8_t* src, size_t compressed_size, uint8_t* dst, size_t size) {
+  const uint8_t* ip = src;
+  const uint8_t* iend = src + compressed_size;
+  uint8_t* op = dst;
+  const uint8_t* oend = dst + size;
+  for (;;) {
+    if (ip >= iend) {
+      return false;
+    }
+    uint8_t token = *ip++;
+    size_t literal_length = token >> 4;
+    if (literal_length == 15 && !read_length(ip, iend, &literal_length)) {
+      return false;
+    }
+    if (literal_length > (size_t)(iend - ip) || literal_length > (size_t)(oend - op)) {
+      return false;
+    }
+    memcpy(op, ip, literal_length);
+    ip += literal_length;
+    op += literal_length;
+    if (ip == iend) {
+      return op == oend;
+    }
+
+    if (iend - ip < 2) {
+      return false;
+    }
+    size_t offset = ip[0] | ((size_t)ip[1] << 8);
+    ip += 2;
+    size_t match_length = token & 15;
+    if (match_length == 15 && !read_length(ip, iend, &match_length)) {
+      return false;
+    }
+    match_length += kMinMatch;
+    if (offset == 0 || offset > (size_t)(op - dst) || match_length > (size_t)(oend - op)) {
+      return false;
+    }
+
+    // The match may overlap the bytes it produces (offset < length), which
+    // repeats the last offset bytes. Copy one period, then keep doubling the
+    // copied span; every copy reads only bytes that are already final.
+    const uint8_t* match = op - offset;
+    size_t copied = std::min(offset, match_length);
+    memcpy(op, match, copied);
+    while (copied < match_length) {
+      size_t n = std::min(copied - copied % offset, match_length - copied);
+      memcpy(op + copied, op, n);
+      copied += n;
+    }
+    op += match_length;
+  }
+}
+
+// Byte planes of 16-bit elements; an odd trailing byte stays at the end
+static void shuffle2(const uint8_t* src, size_t size, uint8_t* dst) {
+  size_t half = size / 2;
+  for (size_t i = 0; i < half; ++i) {
+    dst[i] = src[2 * i];
+    dst[half + i] = src[2 * i + 1];
+  }
+  if (size & 1) {
+    dst[size - 1] = src[size - 1];
+  }
+}
+
+static void unshuffle2(const uint8_t* src, size_t size, uint8_t* dst) {
+  size_t half = size / 2;
+  for (size_t i = 0; i < half; ++i) {
+    dst[2 * i] = src[i];
+    dst[2 * i + 1] = src[half + i];
+  }
+  if (size & 1) {
+    dst[size - 1] = src[size - 1];
+  }
+}
+
+bool parse_compression_codec(const char* name, CompressionCodec* codec) {
+  if (strcmp(name, "none") == 0) {
+    *codec = CompressionCodec::kNone;
+  } else if (strcmp(name, "lz") == 0) {
+    *codec = CompressionCodec::kLz;
+  } else if (strcmp(name, "shuffle-lz") == 0) {
+    *codec = CompressionCodec::kShuffleLz;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+size_t compress_chunk(CompressionCodec codec, const void* src, size_t size, void* dst) {
+  const uint8_t* input = static_cast<const uint8_t*>(src);
+  thread_local std::vector<uint8_t> scratch;
+  if (codec == CompressionCodec::kShuffleLz) {
+    scratch.resize(size);
+    shuffle2(input, size, scratch.data());
+    input = scratch.data();
+  } else if (codec != CompressionCodec::kLz) {
+    return 0;
+  }
+  // Give up as soon as the output would not be smaller than the input
+  size_t compressed = lz_compress(input, size, static_cast<uint8_t*>(dst), size);
+  return compressed < size ? compressed : 0;
+}
+
+bool decompress_chunk(CompressionCodec codec, const void* src, size_t compressed_size, void* dst,
+                      size_t size) {
+  const uint8_t* input = static_cast<const uint8_t*>(src);
+  uint8_t* output = static_cast<uint8_t*>(dst);
+  if (codec == CompressionCodec::kLz) {
+    return lz_decompress(input, compressed_size, output, size);
+  }
+  if (codec == CompressionCodec::kShuffleLz) {
+    thread_local std::vector<uint8_t> scratch;
+    scratch.resize(size);
+    if (!lz_decompress(input, compressed_size, scratch.data(), size)) {
+      return false;
+    }
+    unshuffle2(scratch.data(), size, output);
+    return true;
+  }
+  return false;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+// Chunk codecs for offloaded host copies.
+//
+// kLz is a byte-oriented LZ77 in the LZ4 mould: greedy matching through a
+// 64K-entry hash of 4-byte sequences, 64KB window, sequences of
+// (token, literal length, literals, 16-bit offset, match length). It trades
+// ratio for speed and is strong on sparse or repetitive chunks.
+// kShuffleLz first splits the chunk into byte planes of 16-bit elements
+// (all low bytes, then all high bytes) so that the sign/exponent bytes of
+// bf16/fp16 tensors sit next to each other, then runs kLz over the result.
+
+#include <cstddef>
+
+enum class CompressionCodec { kNone, kLz, kShuffleLz };
+
+// Parse "lz" / "shuffle-lz" / "none"; returns false for anything else
+bool parse_compression_codec(const char* name, CompressionCodec* codec);
+
+// Compress size bytes from src into dst, which must hold size bytes.
+// Returns the compressed size, or 0 if it would not be smaller than size.
+size_t compress_chunk(CompressionCodec codec, const void* src, size_t size, void* dst);
+
+// Decompress into exactly size bytes at dst. Returns false on corrupt input.
+bool decompress_chunk(CompressionCodec codec, const void* src, size_t compressed_size, void* dst,
+                      size_t size);
@@ -0,0 +1,199 @@
+// Double-buffered host <-> device copies
+#define USE_ROCM
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <hip/hip_runtime.h>
+
+#include "cumem_copy_engine.h"
+#include "cumem_staging_pool.h"
+
+void ensure_context(unsigned long long device);
+int get_numa_node_for_gpu(unsigned long long device);
+
+namespace {
+
+double seconds_since(std::chrono::high_resolution_clock::time_point start_time) {
+  std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+  return elapsed.count();
+}
+
+}  // namespace
+
+CopyEngine::CopyEngine(unsigned long long device, const CopyEngineOptions& options)
+    : device_(device),
+      buffer_size_(options.buffer_size),
+      staging_pool_(options.staging_pool && options.staging_pool->slab_size() >= options.buffer_size
+                        ? options.staging_pool
+                        : nullptr),
+      ok_(options.buffer_size != 0 && options.num_buffers != 0),
+      buffers_(options.num_buffers, nullptr),
+      streams_(options.num_buffers, nullptr),
+      events_(options.num_buffers, nullptr),
+      recorded_(options.num_buffers, 0) {
+  ensure_context(device_);
+  int node = get_numa_node_for_gpu(device_);
+  for (size_t i = 0; i < buffers_.size() && ok_; ++i) {
+    buffers_[i] = staging_pool_ ? staging_pool_->acquire(node) : nullptr;
+    hipError_t hip_result = hipSuccess;
+    if (!buffers_[i]) {
+      hip_result = hipHostMalloc(&buffers_[i], buffer_size_, hipHostMallocDefault);
+    }
+    if (hip_result == hipSuccess) {
+      hip_result = hipStreamCreateWithFlags(&streams_[i], hipStreamNonBlocking);
+    }
+    if (hip_result == hipSuccess) {
+      hip_result = hipEventCreateWithFlags(&events_[i], hipEventDisableTiming);
+    }
+    if (hip_result != hipSuccess) {
+      std::cerr << "Error setting up copy engine for device " << device_ << ": " << hipGetErrorString(hip_result)
+                << std::endl;
+      ok_ = false;
+    }
+  }
+}
+
+CopyEngine::~CopyEngine() {
+  ensure_context(device_);
+  for (size_t i = 0; i < buffers_.size(); ++i) {
+    if (streams_[i]) {
+      hipStreamSynchronize(streams_[i]);
+      hipStreamDestroy(streams_[i]);
+    }
+    if (events_[i]) {
+      hipEventDestroy(events_[i]);
+    }
+    if (buffers_[i] && staging_pool_ && staging_pool_->owns(buffers_[i])) {
+      staging_pool_->release(buffers_[i]);
+    } else if (buffers_[i]) {
+      hipHostFree(buffers_[i]);
+    }
+  }
+}
+
+bool CopyEngine::wait(size_t buffer, CopyEngineStats* stats) {
+  if (!recorded_[buffer]) {
+    return true;
+  }
+  recorded_[buffer] = 0;
+  auto wait_start = std::chrono::high_resolution_clock::now();
+  hipError_t hip_result = hipEventSynchronize(events_[buffer]);
+  stats->wait_seconds += seconds_since(wait_start);
+  if (hip_result != hipSuccess) {
+    std::cerr << "Error waiting for copy on device " << device_ << ": " << hipGetErrorString(hip_result)
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool CopyEngine::to_device(CUdeviceptr d_mem, const void* host, size_t size, CopyEngineStats* stats) {
+  auto start_time = std::chrono::high_resolution_clock::now();
+  CopyEngineStats local = {};
+  if (!ok_) {
+    return false;
+  }
+  ensure_context(device_);
+
+  bool ok = true;
+  size_t num_pieces = (size + buffer_size_ - 1) / buffer_size_;
+  for (size_t k = 0; k < num_pieces && ok; ++k) {
+    size_t buffer = k % buffers_.size();
+    size_t offset = k * buffer_size_;
+    size_t n = std::min(buffer_size_, size - offset);
+    // The buffer's previous DMA must be done before it is overwritten; the
+    // other buffers keep transferring meanwhile
+    ok = wait(buffer, &local);
+    if (!ok) {
+      break;
+    }
+    auto stage_start = std::chrono::high_resolution_clock::now();
+    memcpy(buffers_[buffer], (const char*)host + offset, n);
+    local.stage_seconds += seconds_since(stage_start);
+
+    hipError_t hip_result = hipMemcpyAsync((void*)((uintptr_t)d_mem + offset), buffers_[buffer], n,
+                                           hipMemcpyHostToDevice, streams_[buffer]);
+    if (hip_result == hipSuccess) {
+      hip_result = hipEventRecord(events_[buffer], streams_[buffer]);
+    }
+    if (hip_result != hipSuccess) {
+      std::cerr << "Error copying to device " << device_ << ": " << hipGetErrorString(hip_result) << std::endl;
+      ok = false;
+      break;
+    }
+    recorded_[buffer] = 1;
+    local.bytes += n;
+    ++local.pieces;
+  }
+  for (size_t i = 0; i < buffers_.size(); ++i) {
+    ok = wait(i, &local) && ok;
+  }
+
+  local.seconds = seconds_since(start_time);
+  if (stats) {
+    *stats = local;
+  }
+  return ok;
+}
+
+bool CopyEngine::to_host(void* host, CUdeviceptr d_mem, size_t size, CopyEngineStats* stats) {
+  auto start_time = std::chrono::high_resolution_clock::now();
+  CopyEngineStats local = {};
+  if (!ok_) {
+    return false;
+  }
+  ensure_context(device_);
+
+  size_t num_pieces = (size + buffer_size_ - 1) / buffer_size_;
+  auto issue = [&](size_t k) {
+    size_t buffer = k % buffers_.size();
+    size_t offset = k * buffer_size_;
+    size_t n = std::min(buffer_size_, size - offset);
+    hipError_t hip_result = hipMemcpyAsync(buffers_[buffer], (const void*)((uintptr_t)d_mem + offset), n,
+                                           hipMemcpyDeviceToHost, streams_[buffer]);
+    if (hip_result == hipSuccess) {
+      hip_result = hipEventRecord(events_[buffer], streams_[buffer]);
+    }
+    if (hip_result != hipSuccess) {
+      std::cerr << "Error copying from device " << device_ << ": " << hipGetErrorString(hip_result) << std::endl;
+      return false;
+    }
+    recorded_[buffer] = 1;
+    return true;
+  };
+
+  // Fill every buffer, then unpack pieces in order, refilling each buffer
+  // as soon as it has been emptied
+  bool ok = true;
+  for (size_t k = 0; k < num_pieces && k < buffers_.size() && ok; ++k) {
+    ok = issue(k);
+  }
+  for (size_t k = 0; k < num_pieces && ok; ++k) {
+    size_t buffer = k % buffers_.size();
+    size_t offset = k * buffer_size_;
+    size_t n = std::min(buffer_size_, size - offset);
+    ok = wait(buffer, &local);
+    if (!ok) {
+      break;
+    }
+    auto stage_start = std::chrono::high_resolution_clock::now();
+    memcpy((char*)host + offset, buffers_[buffer], n);
+    local.stage_seconds += seconds_since(stage_start);
+    local.bytes += n;
+    ++local.pieces;
+    if (k + buffers_.size() < num_pieces) {
+      ok = issue(k + buffers_.size());
+    }
+  }
+  for (size_t i = 0; i < buffers_.size(); ++i) {
+    ok = wait(i, &local) && ok;
+  }
+
+  local.seconds = seconds_since(start_time);
+  if (stats) {
+    *stats = local;
+  }
+  return ok;
+}
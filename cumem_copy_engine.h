@@ -0,0 +1,69 @@
+#pragma once
+
+// Double-buffered copies between pageable host memory and a mapped region.
+//
+// A plain hipMemcpy from pageable memory stages through a driver buffer and
+// returns only when the DMA is done, so the host sits idle while the copy
+// engine runs and vice versa. CopyEngine keeps num_buffers pinned staging
+// buffers, each with its own stream and event, and cuts a copy into
+// buffer_size pieces:
+//  - to_device() packs piece k + 1 into a free staging buffer while piece k
+//    is still being DMA'd to the device from another one;
+//  - to_host() keeps up to num_buffers device-to-host DMAs in flight and
+//    unpacks each finished piece into the destination while the following
+//    ones are still transferring.
+// A staging buffer is reused only after the event recorded behind its last
+// DMA has fired. One engine serves one device and one copy at a time.
+
+#include <cstddef>
+#include <vector>
+
+#include "cumem_allocator_compat.h"
+
+class StagingPool;
+
+struct CopyEngineOptions {
+  size_t buffer_size = 64 * 1024 * 1024;  // Bytes per piece
+  size_t num_buffers = 2;  // Staging buffers, and streams
+  // Take the staging buffers from slabs of this pool on the device's NUMA
+  // node while it has free ones that hold buffer_size; must outlive the engine
+  StagingPool* staging_pool = nullptr;
+};
+
+struct CopyEngineStats {
+  size_t bytes;
+  size_t pieces;
+  double seconds;  // Wall time
+  double stage_seconds;  // Calling thread's time packing or unpacking staging buffers
+  double wait_seconds;  // Calling thread's time waiting for DMAs
+};
+
+class CopyEngine {
+ public:
+  CopyEngine(unsigned long long device, const CopyEngineOptions& options);
+  ~CopyEngine();
+
+  CopyEngine(const CopyEngine&) = delete;
+  CopyEngine& operator=(const CopyEngine&) = delete;
+
+  // The staging buffers, streams and events were all created
+  bool ok() const { return ok_; }
+
+  // Copy size bytes from host to d_mem
+  bool to_device(CUdeviceptr d_mem, const void* host, size_t size, CopyEngineStats* stats);
+  // Copy size bytes from d_mem to host
+  bool to_host(void* host, CUdeviceptr d_mem, size_t size, CopyEngineStats* stats);
+
+ private:
+  // Wait for the last DMA issued from buffer, if any
+  bool wait(size_t buffer, CopyEngineStats* stats);
+
+  unsigned long long device_;
+  size_t buffer_size_;
+  StagingPool* staging_pool_;
+  bool ok_;
+  std::vector<void*> buffers_;
+  std::vector<CUstream> streams_;
+  std::vector<CUevent> events_;
+  std::vector<char> recorded_;
+};
@@ -0,0 +1,261 @@
+// Per-device region pool with handle-remap defragmentation
+#define USE_ROCM
+
+#include <algorithm>
+#include <iostream>
+#include <hip/hip_runtime.h>
+
+#include "cumem_device_pool.h"
+#include "cumem_region.h"
+
+void ensure_context(unsigned long long device);
+
+void unmap_and_release(unsigned long long device, ssize_t size, CUdeviceptr d_mem,
+                       CUmemGenericAllocationHandle** p_memHandle,
+                       unsigned long long* chunk_sizes, size_t num_chunks,
+                       size_t* p_saved_calls);
+
+// create_and_map and friends take an array of handle pointers
+static std::vector<CUmemGenericAllocationHandle*> handle_pointers(
+    std::vector<CUmemGenericAllocationHandle>& handles) {
+  std::vector<CUmemGenericAllocationHandle*> pointers(handles.size());
+  for (size_t i = 0; i < handles.size(); ++i) {
+    pointers[i] = &handles[i];
+  }
+  return pointers;
+}
+
+DevicePool::DevicePool(unsigned long long device, size_t arena_size, size_t granularity,
+                       size_t chunk_size)
+    : device_(device),
+      arena_size_(((arena_size + granularity - 1) / granularity) * granularity),
+      granularity_(granularity),
+      chunk_size_(((chunk_size + granularity - 1) / granularity) * granularity),
+      arena_(0),
+      next_id_(1),
+      defrag_stop_(false) {
+  CUresult result = cuMemAddressReserve(&arena_, arena_size_, granularity_, 0, 0);
+  if (result != CUDA_SUCCESS) {
+    const char* error_string;
+    cuGetErrorString(result, &error_string);
+    std::cerr << "CUDA Error in cuMemAddressReserve for device pool: " << error_string << std::endl;
+    arena_ = 0;
+  }
+}
+
+DevicePool::~DevicePool() {
+  stop_background_defrag();
+  for (auto& entry : regions_) {
+    Region& region = entry.second;
+    std::vector<CUmemGenericAllocationHandle*> pointers = handle_pointers(region.handles);
+    unmap_and_release(device_, region.size, ptr_at(region.offset), pointers.data(),
+                      region.chunk_sizes.data(), region.handles.size(), nullptr);
+  }
+  if (arena_) {
+    cuMemAddressFree(arena_, arena_size_);
+  }
+}
+
+DevicePool::RegionId DevicePool::allocate(size_t size) {
+  size = ((size + granularity_ - 1) / granularity_) * granularity_;
+  if (size == 0 || !valid()) {
+    return 0;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  // First fit over the gaps between regions, in address order
+  size_t offset = 0;
+  bool found = false;
+  for (const auto& entry : by_offset_) {
+    if (entry.first - offset >= size) {
+      found = true;
+      break;
+    }
+    const Region& region = regions_.at(entry.second);
+    offset = region.offset + region.size;
+  }
+  if (!found && arena_size_ - offset < size) {
+    return 0;
+  }
+
+  Region region;
+  region.offset = offset;
+  region.size = size;
+  region.pin_count = 0;
+  for (size_t remaining = size; remaining > 0;) {
+    size_t chunk = std::min(remaining, chunk_size_);
+    region.chunk_sizes.push_back(chunk);
+    remaining -= chunk;
+  }
+  region.handles.resize(region.chunk_sizes.size());
+  std::vector<CUmemGenericAllocationHandle*> pointers = handle_pointers(region.handles);
+  if (!create_and_map_chunks(device_, ptr_at(offset), pointers.data(), region.chunk_sizes.data(),
+                             region.chunk_sizes.size())) {
+    return 0;
+  }
+
+  RegionId id = next_id_++;
+  by_offset_[offset] = id;
+  regions_[id] = std::move(region);
+  return id;
+}
+
+bool DevicePool::free(RegionId id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = regions_.find(id);
+  if (it == regions_.end()) {
+    return false;
+  }
+  Region& region = it->second;
+  std::vector<CUmemGenericAllocationHandle*> pointers = handle_pointers(region.handles);
+  unmap_and_release(device_, region.size, ptr_at(region.offset), pointers.data(),
+                    region.chunk_sizes.data(), region.handles.size(), nullptr);
+  by_offset_.erase(region.offset);
+  regions_.erase(it);
+  return true;
+}
+
+CUdeviceptr DevicePool::address(RegionId id) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = regions_.find(id);
+  return it == regions_.end() ? 0 : ptr_at(it->second.offset);
+}
+
+bool DevicePool::pin(RegionId id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = regions_.find(id);
+  if (it == regions_.end()) {
+    return false;
+  }
+  ++it->second.pin_count;
+  return true;
+}
+
+bool DevicePool::unpin(RegionId id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = regions_.find(id);
+  if (it == regions_.end() || it->second.pin_count == 0) {
+    return false;
+  }
+  --it->second.pin_count;
+  return true;
+}
+
+void DevicePool::set_relocation_callback(RelocationCallback callback) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  relocation_callback_ = std::move(callback);
+}
+
+bool DevicePool::move_region(RegionId id, Region& region, size_t new_offset) {
+  std::vector<CUmemGenericAllocationHandle*> pointers = handle_pointers(region.handles);
+  CUdeviceptr old_ptr = ptr_at(region.offset);
+  if (!remap_chunks(device_, old_ptr, ptr_at(new_offset), pointers.data(), region.chunk_sizes.data(),
+                    region.handles.size())) {
+    return false;
+  }
+  by_offset_.erase(region.offset);
+  by_offset_[new_offset] = id;
+  region.offset = new_offset;
+  if (relocation_callback_) {
+    relocation_callback_(id, old_ptr, ptr_at(new_offset), region.size);
+  }
+  return true;
+}
+
+size_t DevicePool::defrag_step(std::chrono::microseconds budget) {
+  auto deadline = std::chrono::steady_clock::now() + budget;
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  // Slide every movable region down to the end of the previous one
+  size_t bytes_moved = 0;
+  size_t cursor = 0;
+  std::vector<RegionId> order;
+  for (const auto& entry : by_offset_) {
+    order.push_back(entry.second);
+  }
+  for (RegionId id : order) {
+    Region& region = regions_.at(id);
+    if (region.offset > cursor && region.pin_count == 0) {
+      if (std::chrono::steady_clock::now() >= deadline) {
+        break;
+      }
+      if (move_region(id, region, cursor)) {
+        bytes_moved += region.size;
+      }
+    }
+    cursor = region.offset + region.size;
+  }
+  return bytes_moved;
+}
+
+void DevicePool::background_loop(std::chrono::microseconds budget_per_step,
+                                 std::chrono::milliseconds interval) {
+  std::unique_lock<std::mutex> lock(defrag_mutex_);
+  while (!defrag_stop_) {
+    lock.unlock();
+    defrag_step(budget_per_step);
+    lock.lock();
+    defrag_cv_.wait_for(lock, interval, [this]() { return defrag_stop_; });
+  }
+}
+
+void DevicePool::start_background_defrag(std::chrono::microseconds budget_per_step,
+                                         std::chrono::milliseconds interval) {
+  stop_background_defrag();
+  defrag_stop_ = false;
+  defrag_thread_ = std::thread([this, budget_per_step, interval]() {
+    ensure_context(device_);
+    background_loop(budget_per_step, interval);
+  });
+}
+
+void DevicePool::stop_background_defrag() {
+  if (!defrag_thread_.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(defrag_mutex_);
+    defrag_stop_ = true;
+  }
+  defrag_cv_.notify_all();
+  defrag_thread_.join();
+}
+
+size_t DevicePool::used_bytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  size_t used = 0;
+  for (const auto& entry : regions_) {
+    used += entry.second.size;
+  }
+  return used;
+}
+
+size_t DevicePool::largest_free_block_locked() const {
+  size_t largest = 0;
+  size_t offset = 0;
+  for (const auto& entry : by_offset_) {
+    largest = std::max(largest, entry.first - offset);
+    const Region& region = regions_.at(entry.second);
+    offset = region.offset + region.size;
+  }
+  return std::max(largest, arena_size_ - offset);
+}
+
+size_t DevicePool::largest_free_block() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return largest_free_block_locked();
+}
+
+double DevicePool::fragmentation() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  size_t used = 0;
+  for (const auto& entry : regions_) {
+    used += entry.second.size;
+  }
+  size_t free_bytes = arena_size_ - used;
+  if (free_bytes == 0) {
+    return 0.0;
+  }
+  return 1.0 - static_cast<double>(largest_free_block_locked()) / free_bytes;
+}
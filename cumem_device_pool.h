@@ -0,0 +1,97 @@
+#pragma once
+
+// Long-lived per-device pool of regions carved out of one reserved VA arena.
+// After many sleep/wake cycles and variable-size allocations the arena gets
+// fragmented even though every region is just a list of 128MB physical
+// handles, so the pool can compact itself: live regions are slid towards the
+// start of the arena by unmapping and remapping their handles, without
+// copying any device data.
+//
+// Regions are identified by an id rather than by address because their
+// address changes when they are moved. A region that is in use by the device
+// must be pinned; the defragmenter never moves pinned regions.
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "cumem_allocator_compat.h"
+
+class DevicePool {
+ public:
+  typedef uint64_t RegionId;
+  // Called (with the pool lock held) after a region has been moved
+  typedef std::function<void(RegionId id, CUdeviceptr old_ptr, CUdeviceptr new_ptr, size_t size)>
+      RelocationCallback;
+
+  DevicePool(unsigned long long device, size_t arena_size, size_t granularity, size_t chunk_size);
+  ~DevicePool();
+
+  DevicePool(const DevicePool&) = delete;
+  DevicePool& operator=(const DevicePool&) = delete;
+
+  bool valid() const { return arena_ != 0; }
+
+  // Place a new region in the first gap that fits. Returns 0 on failure.
+  RegionId allocate(size_t size);
+  bool free(RegionId id);
+  CUdeviceptr address(RegionId id) const;
+
+  // Pinned regions stay where they are during defragmentation
+  bool pin(RegionId id);
+  bool unpin(RegionId id);
+
+  void set_relocation_callback(RelocationCallback callback);
+
+  // Move regions down into gaps until the arena is compact or the time budget
+  // is used up. A region that has started moving is always finished, so a
+  // step may overrun the budget by one region move. Returns bytes moved.
+  size_t defrag_step(std::chrono::microseconds budget);
+
+  // Run defrag_step every interval on a background thread
+  void start_background_defrag(std::chrono::microseconds budget_per_step,
+                               std::chrono::milliseconds interval);
+  void stop_background_defrag();
+
+  size_t used_bytes() const;
+  size_t largest_free_block() const;
+  // 1 - largest free block / total free bytes; 0 means all free VA is contiguous
+  double fragmentation() const;
+
+ private:
+  struct Region {
+    size_t offset;
+    size_t size;
+    int pin_count;
+    std::vector<CUmemGenericAllocationHandle> handles;
+    std::vector<unsigned long long> chunk_sizes;
+  };
+
+  CUdeviceptr ptr_at(size_t offset) const { return (void*)((uintptr_t)arena_ + offset); }
+  bool move_region(RegionId id, Region& region, size_t new_offset);
+  size_t largest_free_block_locked() const;
+  void background_loop(std::chrono::microseconds budget_per_step, std::chrono::milliseconds interval);
+
+  unsigned long long device_;
+  size_t arena_size_;
+  size_t granularity_;
+  size_t chunk_size_;
+  CUdeviceptr arena_;
+
+  mutable std::mutex mutex_;
+  std::map<RegionId, Region> regions_;
+  std::map<size_t, RegionId> by_offset_;
+  RegionId next_id_;
+  RelocationCallback relocation_callback_;
+
+  std::thread defrag_thread_;
+  std::mutex defrag_mutex_;
+  std::condition_variable defrag_cv_;
+  bool defrag_stop_;
+};
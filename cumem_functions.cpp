@@ -2,6 +2,9 @@
 #define USE_ROCM
 
 #include <iostream>
+#include <atomic>
+#include <thread>
+#include <vector>
 #include <sched.h>       // For CPU affinity functions
 #include <unistd.h>      // For syscall
 #include <sys/syscall.h> // For SYS_gettid
@@ -14,6 +17,9 @@
 
 // Include compatibility layer
 #include "cumem_allocator_compat.h"
+#include "cumem_spsc_queue.h"
+#include "cumem_region.h"
+#include "cumem_admission.h"
 
 // Implementation of ensure_context
 void ensure_context(unsigned long long device) {
@@ -46,35 +52,47 @@ void ensure_context(unsigned long long device) {
   }
 }
 
-// Helper function to set CPU affinity based on GPU device ID
-void set_cpu_affinity_for_gpu(unsigned long long device) {
-  // Get current thread ID
+// NUMA node a GPU is attached to.
+// GPUs 0-3 are on NUMA node 0 (CPUs 0-47)
+// GPUs 4-7 are on NUMA node 1 (CPUs 48-95)
+int get_numa_node_for_gpu(unsigned long long device) {
+  return device <= 3 ? 0 : 1;
+}
+
+// CPUs of a NUMA node
+void get_numa_node_cpus(int node, cpu_set_t* mask) {
+  CPU_ZERO(mask);
+  for (int i = node * 48; i < (node + 1) * 48; i++) {
+    CPU_SET(i, mask);
+  }
+}
+
+// Pin the calling thread to the CPUs of a NUMA node
+bool set_cpu_affinity_for_node(int node) {
   pid_t tid = syscall(SYS_gettid);
-  
   cpu_set_t mask;
-  CPU_ZERO(&mask);
-  unsigned long long _device = device;
-  // GPUs 0-3 are on NUMA node 0 (CPUs 0-47)
-  // GPUs 4-7 are on NUMA node 1 (CPUs 48-95)
-  if (_device <= 3) {
-    // Set affinity to NUMA node 0 CPUs
-    for (int i = 0; i < 48; i++) {
-      CPU_SET(i, &mask);
-    }
-    std::cout << "Setting affinity for GPU " << device << " to NUMA node 0 (CPUs 0-47)" << std::endl;
-  } else {
-    // Set affinity to NUMA node 1 CPUs
-    for (int i = 48; i < 96; i++) {
-      CPU_SET(i, &mask);
-    }
-    std::cout << "Setting affinity for GPU " << device << " to NUMA node 1 (CPUs 48-95)" << std::endl;
-  }
-  
-  // Set the CPU affinity for this thread
+  get_numa_node_cpus(node, &mask);
   int result = sched_setaffinity(tid, sizeof(mask), &mask);
   if (result != 0) {
     std::cerr << "Failed to set CPU affinity for thread " << tid << ": " << strerror(errno) << std::endl;
+    return false;
   }
+  return true;
+}
+
+// Helper function to set CPU affinity based on GPU device ID
+void set_cpu_affinity_for_gpu(unsigned long long device) {
+  int node = get_numa_node_for_gpu(device);
+  std::cout << "Setting affinity for GPU " << device << " to NUMA node " << node << " (CPUs "
+            << node * 48 << "-" << (node + 1) * 48 - 1 << ")" << std::endl;
+  set_cpu_affinity_for_node(node);
+}
+
+// cuMemCreate, admitted by the NUMA admission controller if one is installed
+static CUresult admitted_mem_create(CUmemGenericAllocationHandle* handle, size_t size,
+                                    const CUmemAllocationProp* prop) {
+  AdmissionGuard guard(get_create_admission(), get_numa_node_for_gpu(prop->location.id));
+  return cuMemCreate(handle, size, prop, 0);
 }
 
 // Implementation of create_and_map
@@ -95,7 +113,7 @@ void create_and_map(unsigned long long device, ssize_t size, CUdeviceptr d_mem,
 
   // Create memory handles for each chunk
   for (auto i = 0; i < num_chunks; ++i) {
-    CUresult result = cuMemCreate(p_memHandle[i], chunk_sizes[i], &prop, 0);
+    CUresult result = admitted_mem_create(p_memHandle[i], chunk_sizes[i], &prop);
     if (result != CUDA_SUCCESS) {
       const char* error_string;
       cuGetErrorString(result, &error_string);
@@ -150,22 +168,360 @@ void create_and_map(unsigned long long device, ssize_t size, CUdeviceptr d_mem,
 #endif
 }
 
-// Implementation of unmap_and_release
-void unmap_and_release(unsigned long long device, ssize_t size,
-                       CUdeviceptr d_mem,
-                       CUmemGenericAllocationHandle** p_memHandle,
-                       unsigned long long* chunk_sizes, size_t num_chunks) {
+// Grant the owning device read-write access to [ptr, ptr + size)
+static bool set_device_access(unsigned long long device, CUdeviceptr ptr, size_t size) {
+  CUmemAccessDesc accessDesc = {};
+  accessDesc.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+  accessDesc.location.id = device;
+  accessDesc.flags = CU_MEM_ACCESS_FLAGS_PROT_READWRITE;
+
+  CUresult result = cuMemSetAccess(ptr, size, &accessDesc, 1);
+  if (result != CUDA_SUCCESS) {
+    const char* error_string;
+    cuGetErrorString(result, &error_string);
+    std::cerr << "CUDA Error in cuMemSetAccess: " << error_string << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Grant a list of peer devices access to a region owned by device, using a
+// single cuMemSetAccess call that carries one descriptor per device. Peers get
+// read-only or read-write access; the owner always keeps read-write access.
+// This lets tensor-parallel peers read the region directly instead of staging
+// through host memory.
+bool set_peer_access(unsigned long long device, ssize_t size, CUdeviceptr d_mem,
+                     const unsigned long long* peer_devices, size_t num_peers,
+                     bool read_only) {
+  ensure_context(device);
+
+  std::vector<CUmemAccessDesc> accessDescs(num_peers + 1);
+  accessDescs[0].location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+  accessDescs[0].location.id = device;
+  accessDescs[0].flags = CU_MEM_ACCESS_FLAGS_PROT_READWRITE;
+  for (size_t i = 0; i < num_peers; ++i) {
+    accessDescs[i + 1].location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+    accessDescs[i + 1].location.id = peer_devices[i];
+    accessDescs[i + 1].flags = read_only ? CU_MEM_ACCESS_FLAGS_PROT_READ
+                                         : CU_MEM_ACCESS_FLAGS_PROT_READWRITE;
+  }
+
+  CUresult result = cuMemSetAccess(d_mem, size, accessDescs.data(), accessDescs.size());
+  if (result != CUDA_SUCCESS) {
+    const char* error_string;
+    cuGetErrorString(result, &error_string);
+    std::cerr << "CUDA Error in cuMemSetAccess for " << num_peers << " peer(s): " << error_string << std::endl;
+    return false;
+  }
+
 #ifdef ENABLE_DEBUG_CUMEM
-  std::cout << "unmap_and_release: device=" << device << ", size=" << size 
+  std::cout << "set_peer_access: device=" << device << ", size=" << size
+            << ", d_mem=" << d_mem << ", num_peers=" << num_peers
+            << (read_only ? ", read-only" : ", read-write") << std::endl;
+#endif
+  return true;
+}
+
+// Striped variant of create_and_map. A single VA range is backed by chunks
+// created on several devices: each chunk goes to the device picked by a smooth
+// weighted round-robin over devices/weights (weights may be null for plain
+// round-robin), and its owner is written to chunk_devices[i] so callers can
+// keep it in their chunk table. Chunk sizes must be a multiple of every
+// device's granularity. All devices in the stripe set get read-write access
+// to the whole range, so a kernel stream on any of them can read the buffer.
+// Returns false if any driver call fails, after unmapping and releasing
+// everything created so far.
+bool create_and_map_striped(const unsigned long long* devices, const unsigned int* weights,
+                            size_t num_devices, ssize_t size, CUdeviceptr d_mem,
+                            CUmemGenericAllocationHandle** p_memHandle,
+                            unsigned long long* chunk_sizes, size_t num_chunks,
+                            unsigned long long* chunk_devices) {
+  if (num_devices == 0) {
+    return false;
+  }
+  ensure_context(devices[0]);
+
+  // Smooth weighted round-robin: every step adds each weight to its device's
+  // credit and picks the device with the most credit, which then pays back
+  // the total. This interleaves devices instead of emitting runs.
+  std::vector<long long> credit(num_devices, 0);
+  long long total_weight = 0;
+  for (size_t d = 0; d < num_devices; ++d) {
+    total_weight += weights ? weights[d] : 1;
+  }
+  if (total_weight == 0) {
+    std::cerr << "create_and_map_striped: all stripe weights are zero" << std::endl;
+    return false;
+  }
+  for (size_t i = 0; i < num_chunks; ++i) {
+    size_t best = 0;
+    for (size_t d = 0; d < num_devices; ++d) {
+      credit[d] += weights ? weights[d] : 1;
+      if (credit[d] > credit[best]) {
+        best = d;
+      }
+    }
+    credit[best] -= total_weight;
+    chunk_devices[i] = devices[best];
+  }
+
+  // Create and map each chunk on its owning device
+  CUmemAllocationProp prop = {};
+  prop.type = CU_MEM_ALLOCATION_TYPE_PINNED;
+  prop.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+  prop.allocFlags.compressionType = CU_MEM_ALLOCATION_COMP_NONE;
+
+  size_t num_created = 0;
+  size_t num_mapped = 0;
+  unsigned long long allocated_size = 0;
+  bool ok = true;
+  for (size_t i = 0; i < num_chunks; ++i) {
+    prop.location.id = chunk_devices[i];
+    CUresult result = admitted_mem_create(p_memHandle[i], chunk_sizes[i], &prop);
+    if (result != CUDA_SUCCESS) {
+      const char* error_string;
+      cuGetErrorString(result, &error_string);
+      std::cerr << "CUDA Error in cuMemCreate for chunk " << i << " on device "
+                << chunk_devices[i] << ": " << error_string << std::endl;
+      ok = false;
+      break;
+    }
+    ++num_created;
+
+    void* map_addr = (void*)((uintptr_t)d_mem + allocated_size);
+    result = cuMemMap(map_addr, chunk_sizes[i], 0, *(p_memHandle[i]), 0);
+    if (result != CUDA_SUCCESS) {
+      const char* error_string;
+      cuGetErrorString(result, &error_string);
+      std::cerr << "CUDA Error in cuMemMap for chunk " << i << ": " << error_string << std::endl;
+      ok = false;
+      break;
+    }
+    ++num_mapped;
+    allocated_size += chunk_sizes[i];
+  }
+
+  // Set memory access permissions for every device in the stripe set
+  if (ok) {
+    std::vector<CUmemAccessDesc> accessDescs(num_devices);
+    for (size_t d = 0; d < num_devices; ++d) {
+      accessDescs[d].location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+      accessDescs[d].location.id = devices[d];
+      accessDescs[d].flags = CU_MEM_ACCESS_FLAGS_PROT_READWRITE;
+    }
+    CUresult result = cuMemSetAccess(d_mem, size, accessDescs.data(), accessDescs.size());
+    if (result != CUDA_SUCCESS) {
+      const char* error_string;
+      cuGetErrorString(result, &error_string);
+      std::cerr << "CUDA Error in cuMemSetAccess: " << error_string << std::endl;
+      ok = false;
+    }
+  }
+
+  if (!ok) {
+    unsigned long long unmapped_size = 0;
+    for (size_t j = 0; j < num_mapped; ++j) {
+      cuMemUnmap((void*)((uintptr_t)d_mem + unmapped_size), chunk_sizes[j]);
+      unmapped_size += chunk_sizes[j];
+    }
+    for (size_t j = 0; j < num_created; ++j) {
+      cuMemRelease(*(p_memHandle[j]));
+    }
+    return false;
+  }
+
+#ifdef ENABLE_DEBUG_CUMEM
+  std::cout << "create_and_map_striped: num_devices=" << num_devices << ", size=" << size
             << ", d_mem=" << d_mem << ", p_memHandle=" << p_memHandle << std::endl;
 #endif
+  return true;
+}
+
+// Pipelined variant of create_and_map. A helper thread creates the chunk
+// handles and passes each one through a lock-free SPSC queue to the calling
+// thread, which maps it right away instead of waiting for every cuMemCreate to
+// finish. If p_usable_bytes is non-null it is advanced (with release ordering)
+// to the number of bytes from d_mem that are mapped and accessible, so callers
+// can start using the low part of the region while the rest is being built.
+//
+// With access_window == 0 access is granted over the whole region once the
+// last chunk is mapped, so the watermark jumps straight to size. Otherwise
+// cuMemSetAccess is issued every time at least access_window bytes have been
+// mapped since the previous call (and once more for the tail). Smaller windows
+// make the first bytes usable sooner at the cost of more cuMemSetAccess calls.
+//
+// If p_set_access_calls is non-null it receives the number of cuMemSetAccess
+// calls that were issued.
+//
+// Returns false if any driver call fails; everything created or mapped so far
+// is then unmapped and released again and the watermark is reset to 0.
+bool create_and_map_pipelined(unsigned long long device, ssize_t size, CUdeviceptr d_mem,
+                              CUmemGenericAllocationHandle** p_memHandle,
+                              unsigned long long* chunk_sizes, size_t num_chunks,
+                              std::atomic<unsigned long long>* p_usable_bytes,
+                              unsigned long long access_window,
+                              size_t* p_set_access_calls) {
   ensure_context(device);
 
-  // Unmap each chunk
+  // Set CPU affinity based on the GPU device
+  set_cpu_affinity_for_gpu(device);
+
+  if (p_usable_bytes) {
+    p_usable_bytes->store(0, std::memory_order_release);
+  }
+
+  const size_t kQueueDepth = 64;
+  SpscQueue<size_t> created(kQueueDepth);
+  std::atomic<bool> map_failed(false);
+  std::atomic<size_t> num_created(0);
+  size_t num_set_access_calls = 0;
+
+  // Create memory handles for each chunk on a helper thread
+  std::thread creator([&]() {
+    ensure_context(device);
+    set_cpu_affinity_for_gpu(device);
+
+    CUmemAllocationProp prop = {};
+    prop.type = CU_MEM_ALLOCATION_TYPE_PINNED;
+    prop.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+    prop.location.id = device;
+    prop.allocFlags.compressionType = CU_MEM_ALLOCATION_COMP_NONE;
+
+    for (size_t i = 0; i < num_chunks && !map_failed.load(std::memory_order_relaxed); ++i) {
+      CUresult result = admitted_mem_create(p_memHandle[i], chunk_sizes[i], &prop);
+      if (result != CUDA_SUCCESS) {
+        const char* error_string;
+        cuGetErrorString(result, &error_string);
+        std::cerr << "CUDA Error in cuMemCreate for chunk " << i << ": " << error_string << std::endl;
+#ifdef ENABLE_DEBUG_CUMEM
+        std::cout << "cuMemCreate failed: " << i << std::endl;
+#endif
+        break;
+      }
+      num_created.store(i + 1, std::memory_order_relaxed);
+      // The mapping thread stops popping once it fails, so don't block on it.
+      while (!created.try_push(i)) {
+        if (map_failed.load(std::memory_order_relaxed)) {
+          break;
+        }
+        std::this_thread::yield();
+      }
+    }
+    created.close();
+  });
+
+  // Map each chunk as soon as its handle exists
   unsigned long long allocated_size = 0;
-  for (auto i = 0; i < num_chunks; ++i) {
+  unsigned long long accessible_size = 0;
+  size_t num_mapped = 0;
+  size_t i;
+  while (created.pop(&i)) {
+    void* map_addr = (void*)((uintptr_t)d_mem + allocated_size);
+    CUresult result = cuMemMap(map_addr, chunk_sizes[i], 0, *(p_memHandle[i]), 0);
+    if (result != CUDA_SUCCESS) {
+      const char* error_string;
+      cuGetErrorString(result, &error_string);
+      std::cerr << "CUDA Error in cuMemMap for chunk " << i << ": " << error_string << std::endl;
+#ifdef ENABLE_DEBUG_CUMEM
+      std::cout << "cuMemMap failed: " << i << std::endl;
+#endif
+      map_failed.store(true, std::memory_order_relaxed);
+      break;
+    }
+    allocated_size += chunk_sizes[i];
+    ++num_mapped;
+
+    // Grant access to the newly mapped window
+    if (access_window != 0 &&
+        (allocated_size - accessible_size >= access_window || num_mapped == num_chunks)) {
+      void* window_addr = (void*)((uintptr_t)d_mem + accessible_size);
+      ++num_set_access_calls;
+      if (!set_device_access(device, window_addr, allocated_size - accessible_size)) {
+        map_failed.store(true, std::memory_order_relaxed);
+        break;
+      }
+      accessible_size = allocated_size;
+      if (p_usable_bytes) {
+        p_usable_bytes->store(accessible_size, std::memory_order_release);
+      }
+    }
+  }
+  creator.join();
+
+  // Set memory access permissions
+  bool ok = num_mapped == num_chunks && !map_failed.load();
+  if (ok && access_window == 0) {
+    ++num_set_access_calls;
+    ok = set_device_access(device, d_mem, size);
+    if (ok && p_usable_bytes) {
+      p_usable_bytes->store(allocated_size, std::memory_order_release);
+    }
+  }
+
+  if (p_set_access_calls) {
+    *p_set_access_calls = num_set_access_calls;
+  }
+
+  if (!ok) {
+    // Roll back so the caller is left with nothing to unmap or release
+    if (p_usable_bytes) {
+      p_usable_bytes->store(0, std::memory_order_release);
+    }
+    unsigned long long unmapped_size = 0;
+    for (size_t j = 0; j < num_mapped; ++j) {
+      cuMemUnmap((void*)((uintptr_t)d_mem + unmapped_size), chunk_sizes[j]);
+      unmapped_size += chunk_sizes[j];
+    }
+    for (size_t j = 0; j < num_created.load(); ++j) {
+      cuMemRelease(*(p_memHandle[j]));
+    }
+    return false;
+  }
+
+#ifdef ENABLE_DEBUG_CUMEM
+  std::cout << "create_and_map_pipelined: device=" << device << ", size=" << size
+            << ", d_mem=" << d_mem << ", p_memHandle=" << p_memHandle << std::endl;
+#endif
+  return true;
+}
+
+// Set once the backend reports that it cannot unmap across allocation
+// boundaries at all; other bulk failures only affect the current call.
+static std::atomic<bool> g_bulk_unmap_unsupported(false);
+
+// Unmap every chunk of a region that was mapped contiguously from d_mem.
+// The whole range is first handed to the driver in a single cuMemUnmap. If
+// that fails we fall back to one call per chunk, and if the failure was
+// CUDA_ERROR_NOT_SUPPORTED later calls skip the futile bulk attempt.
+// Returns the number of cuMemUnmap calls issued, or 0 on failure.
+static size_t unmap_chunks(CUdeviceptr d_mem, unsigned long long* chunk_sizes,
+                           size_t num_chunks) {
+  if (num_chunks > 1 && !g_bulk_unmap_unsupported.load(std::memory_order_relaxed)) {
+    unsigned long long total_size = 0;
+    for (size_t i = 0; i < num_chunks; ++i) {
+      total_size += chunk_sizes[i];
+    }
+    CUresult result = cuMemUnmap(d_mem, total_size);
+    if (result == CUDA_SUCCESS) {
+      return 1;
+    }
+#ifdef ENABLE_DEBUG_CUMEM
+    const char* error_string;
+    cuGetErrorString(result, &error_string);
+    std::cout << "bulk cuMemUnmap failed, unmapping per chunk: "
+              << error_string << std::endl;
+#endif
+    if (result == CUDA_ERROR_NOT_SUPPORTED) {
+      g_bulk_unmap_unsupported.store(true, std::memory_order_relaxed);
+    }
+  }
+
+  size_t num_calls = 0;
+  unsigned long long allocated_size = 0;
+  for (size_t i = 0; i < num_chunks; ++i) {
     void* map_addr = (void*)((uintptr_t)d_mem + allocated_size);
     CUresult result = cuMemUnmap(map_addr, chunk_sizes[i]);
+    ++num_calls;
     if (result != CUDA_SUCCESS) {
       const char* error_string;
       cuGetErrorString(result, &error_string);
@@ -173,10 +529,43 @@ void unmap_and_release(unsigned long long device, ssize_t size,
 #ifdef ENABLE_DEBUG_CUMEM
       std::cout << "cuMemUnmap failed" << std::endl;
 #endif
-      return;
+      return 0;
     }
     allocated_size += chunk_sizes[i];
   }
+  return num_calls;
+}
+
+// Implementation of unmap_and_release
+// If p_saved_calls is non-null it receives the number of cuMemUnmap calls
+// saved compared to unmapping every chunk individually.
+void unmap_and_release(unsigned long long device, ssize_t size,
+                       CUdeviceptr d_mem,
+                       CUmemGenericAllocationHandle** p_memHandle,
+                       unsigned long long* chunk_sizes, size_t num_chunks,
+                       size_t* p_saved_calls) {
+#ifdef ENABLE_DEBUG_CUMEM
+  std::cout << "unmap_and_release: device=" << device << ", size=" << size 
+            << ", d_mem=" << d_mem << ", p_memHandle=" << p_memHandle << std::endl;
+#endif
+  ensure_context(device);
+
+  if (p_saved_calls) {
+    *p_saved_calls = 0;
+  }
+
+  // Unmap all chunks, in one call where the backend allows it
+  size_t num_unmap_calls = unmap_chunks(d_mem, chunk_sizes, num_chunks);
+  if (num_chunks > 0 && num_unmap_calls == 0) {
+    return;
+  }
+  if (p_saved_calls && num_unmap_calls < num_chunks) {
+    *p_saved_calls = num_chunks - num_unmap_calls;
+  }
+#ifdef ENABLE_DEBUG_CUMEM
+  std::cout << "unmap_and_release: " << num_unmap_calls << " cuMemUnmap call(s) for "
+            << num_chunks << " chunks" << std::endl;
+#endif
 
   // Release each memory handle
   for (auto i = 0; i < num_chunks; ++i) {
@@ -191,4 +580,316 @@ void unmap_and_release(unsigned long long device, ssize_t size,
       return;
     }
   }
-} 
\ No newline at end of file
+}
+
+// Pipelined variant of unmap_and_release. The calling thread unmaps chunks one
+// by one and hands each unmapped chunk to a release thread through a lock-free
+// SPSC queue, so cuMemRelease of chunk i overlaps with cuMemUnmap of chunk i+1
+// instead of waiting for the whole region to be unmapped first.
+void unmap_and_release_pipelined(unsigned long long device, ssize_t size,
+                                 CUdeviceptr d_mem,
+                                 CUmemGenericAllocationHandle** p_memHandle,
+                                 unsigned long long* chunk_sizes, size_t num_chunks) {
+#ifdef ENABLE_DEBUG_CUMEM
+  std::cout << "unmap_and_release_pipelined: device=" << device << ", size=" << size
+            << ", d_mem=" << d_mem << ", p_memHandle=" << p_memHandle << std::endl;
+#endif
+  ensure_context(device);
+
+  const size_t kQueueDepth = 64;
+  SpscQueue<size_t> unmapped(kQueueDepth);
+
+  // Release each handle as soon as its chunk has been unmapped
+  std::thread releaser([&]() {
+    ensure_context(device);
+    size_t i;
+    while (unmapped.pop(&i)) {
+      CUresult result = cuMemRelease(*(p_memHandle[i]));
+      if (result != CUDA_SUCCESS) {
+        // Keep draining so the unmapping thread never blocks on a full queue.
+        const char* error_string;
+        cuGetErrorString(result, &error_string);
+        std::cerr << "CUDA Error in cuMemRelease for chunk " << i << ": " << error_string << std::endl;
+      }
+    }
+  });
+
+  // Unmap each chunk
+  unsigned long long allocated_size = 0;
+  for (size_t i = 0; i < num_chunks; ++i) {
+    void* map_addr = (void*)((uintptr_t)d_mem + allocated_size);
+    CUresult result = cuMemUnmap(map_addr, chunk_sizes[i]);
+    if (result != CUDA_SUCCESS) {
+      const char* error_string;
+      cuGetErrorString(result, &error_string);
+      std::cerr << "CUDA Error in cuMemUnmap for chunk " << i << ": " << error_string << std::endl;
+#ifdef ENABLE_DEBUG_CUMEM
+      std::cout << "cuMemUnmap failed" << std::endl;
+#endif
+      break;
+    }
+    unmapped.push(i);
+    allocated_size += chunk_sizes[i];
+  }
+
+  unmapped.close();
+  releaser.join();
+}
+
+bool create_and_map_chunks(unsigned long long device, CUdeviceptr base,
+                                  CUmemGenericAllocationHandle** p_memHandle,
+                                  unsigned long long* chunk_sizes, size_t num_chunks) {
+  CUmemAllocationProp prop = {};
+  prop.type = CU_MEM_ALLOCATION_TYPE_PINNED;
+  prop.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+  prop.location.id = device;
+  prop.allocFlags.compressionType = CU_MEM_ALLOCATION_COMP_NONE;
+
+  size_t num_created = 0;
+  size_t num_mapped = 0;
+  unsigned long long allocated_size = 0;
+  bool ok = true;
+  for (size_t i = 0; i < num_chunks; ++i) {
+    CUresult result = admitted_mem_create(p_memHandle[i], chunk_sizes[i], &prop);
+    if (result != CUDA_SUCCESS) {
+      const char* error_string;
+      cuGetErrorString(result, &error_string);
+      std::cerr << "CUDA Error in cuMemCreate for chunk " << i << ": " << error_string << std::endl;
+      ok = false;
+      break;
+    }
+    ++num_created;
+    result = cuMemMap((void*)((uintptr_t)base + allocated_size), chunk_sizes[i], 0, *(p_memHandle[i]), 0);
+    if (result != CUDA_SUCCESS) {
+      const char* error_string;
+      cuGetErrorString(result, &error_string);
+      std::cerr << "CUDA Error in cuMemMap for chunk " << i << ": " << error_string << std::endl;
+      ok = false;
+      break;
+    }
+    ++num_mapped;
+    allocated_size += chunk_sizes[i];
+  }
+  if (ok && allocated_size > 0) {
+    ok = set_device_access(device, base, allocated_size);
+  }
+
+  if (!ok) {
+    unsigned long long unmapped_size = 0;
+    for (size_t j = 0; j < num_mapped; ++j) {
+      cuMemUnmap((void*)((uintptr_t)base + unmapped_size), chunk_sizes[j]);
+      unmapped_size += chunk_sizes[j];
+    }
+    for (size_t j = 0; j < num_created; ++j) {
+      cuMemRelease(*(p_memHandle[j]));
+    }
+  }
+  return ok;
+}
+
+// Map existing handles back to back from base and grant the device access,
+// without creating or copying anything
+static bool map_existing_chunks(unsigned long long device, CUdeviceptr base,
+                                CUmemGenericAllocationHandle** p_memHandle,
+                                unsigned long long* chunk_sizes, size_t num_chunks) {
+  unsigned long long allocated_size = 0;
+  for (size_t i = 0; i < num_chunks; ++i) {
+    CUresult result = cuMemMap((void*)((uintptr_t)base + allocated_size), chunk_sizes[i], 0,
+                               *(p_memHandle[i]), 0);
+    if (result != CUDA_SUCCESS) {
+      const char* error_string;
+      cuGetErrorString(result, &error_string);
+      std::cerr << "CUDA Error in cuMemMap while remapping chunk " << i << ": " << error_string << std::endl;
+      return false;
+    }
+    allocated_size += chunk_sizes[i];
+  }
+  return allocated_size == 0 || set_device_access(device, base, allocated_size);
+}
+
+bool remap_chunks(unsigned long long device, CUdeviceptr old_base, CUdeviceptr new_base,
+                  CUmemGenericAllocationHandle** p_memHandle,
+                  unsigned long long* chunk_sizes, size_t num_chunks) {
+  if (num_chunks == 0) {
+    return true;
+  }
+  ensure_context(device);
+  if (unmap_chunks(old_base, chunk_sizes, num_chunks) == 0) {
+    return false;
+  }
+  if (!map_existing_chunks(device, new_base, p_memHandle, chunk_sizes, num_chunks)) {
+    // The handles are still alive; put them back where they were
+    map_existing_chunks(device, old_base, p_memHandle, chunk_sizes, num_chunks);
+    return false;
+  }
+  return true;
+}
+
+// Whether chunks first .. last - 1, mapped back to back from offset first_offset
+// of base, each lie within a single reservation. A mapping may not span two
+// reservations even when they are adjacent.
+static bool chunks_fit_reservations(CUdeviceptr base, const std::vector<RegionReservation>& reservations,
+                                    unsigned long long* chunk_sizes, size_t first, size_t last,
+                                    unsigned long long first_offset) {
+  uintptr_t start = (uintptr_t)base + first_offset;
+  for (size_t i = first; i < last; ++i) {
+    uintptr_t end = start + chunk_sizes[i];
+    bool fits = false;
+    for (const RegionReservation& reservation : reservations) {
+      uintptr_t begin = (uintptr_t)reservation.ptr;
+      fits = fits || (start >= begin && end <= begin + reservation.size);
+    }
+    if (!fits) {
+      return false;
+    }
+    start = end;
+  }
+  return true;
+}
+
+static void free_reservations(const std::vector<RegionReservation>& reservations) {
+  for (const RegionReservation& reservation : reservations) {
+    CUresult result = cuMemAddressFree(reservation.ptr, reservation.size);
+    if (result != CUDA_SUCCESS) {
+      const char* error_string;
+      cuGetErrorString(result, &error_string);
+      std::cerr << "CUDA Error in cuMemAddressFree: " << error_string << std::endl;
+    }
+  }
+}
+
+bool grow_region(unsigned long long device, CUdeviceptr* p_d_mem,
+                 std::vector<RegionReservation>* reservations, size_t granularity,
+                 CUmemGenericAllocationHandle** p_memHandle,
+                 unsigned long long* chunk_sizes, size_t old_num_chunks,
+                 size_t new_num_chunks, bool* p_moved) {
+  ensure_context(device);
+  if (p_moved) {
+    *p_moved = false;
+  }
+  if (new_num_chunks < old_num_chunks) {
+    return false;
+  }
+
+  unsigned long long old_size = 0;
+  for (size_t i = 0; i < old_num_chunks; ++i) {
+    old_size += chunk_sizes[i];
+  }
+  unsigned long long new_size = old_size;
+  for (size_t i = old_num_chunks; i < new_num_chunks; ++i) {
+    new_size += chunk_sizes[i];
+  }
+  unsigned long long reserved_size = 0;
+  for (const RegionReservation& reservation : *reservations) {
+    reserved_size += reservation.size;
+  }
+
+  // Extend the reservation in place if the adjacent VA is free. After a
+  // shrink the reservations can end past old_size, and a new chunk that
+  // would straddle the old end and the extension cannot be mapped there.
+  bool fits = reserved_size >= new_size &&
+              chunks_fit_reservations(*p_d_mem, *reservations, chunk_sizes, old_num_chunks, new_num_chunks, old_size);
+  if (!fits && reserved_size < new_size) {
+    size_t extra = ((new_size - reserved_size + granularity - 1) / granularity) * granularity;
+    CUdeviceptr hint = (void*)((uintptr_t)*p_d_mem + reserved_size);
+    CUdeviceptr extension = 0;
+    CUresult result = cuMemAddressReserve(&extension, extra, granularity, hint, 0);
+    if (result == CUDA_SUCCESS && extension == hint) {
+      reservations->push_back({extension, extra});
+      fits = chunks_fit_reservations(*p_d_mem, *reservations, chunk_sizes, old_num_chunks, new_num_chunks,
+                                     old_size);
+      if (!fits) {
+        reservations->pop_back();
+        cuMemAddressFree(extension, extra);
+      }
+    } else if (result == CUDA_SUCCESS) {
+      cuMemAddressFree(extension, extra);
+    }
+  }
+
+  // Otherwise move the region: remap its handles into a larger range
+  if (!fits) {
+    size_t new_reserved = ((new_size + granularity - 1) / granularity) * granularity;
+    CUdeviceptr new_mem = 0;
+    CUresult result = cuMemAddressReserve(&new_mem, new_reserved, granularity, 0, 0);
+    if (result != CUDA_SUCCESS) {
+      const char* error_string;
+      cuGetErrorString(result, &error_string);
+      std::cerr << "CUDA Error in cuMemAddressReserve while growing region: " << error_string << std::endl;
+      return false;
+    }
+    if (!remap_chunks(device, *p_d_mem, new_mem, p_memHandle, chunk_sizes, old_num_chunks)) {
+      cuMemAddressFree(new_mem, new_reserved);
+      return false;
+    }
+    free_reservations(*reservations);
+    reservations->assign(1, RegionReservation{new_mem, new_reserved});
+    *p_d_mem = new_mem;
+    if (p_moved) {
+      *p_moved = true;
+    }
+  }
+
+  // Back the new tail with fresh chunks. If this fails after a move, the
+  // region stays valid at its new address with its old size.
+  CUdeviceptr tail = (void*)((uintptr_t)*p_d_mem + old_size);
+  if (!create_and_map_chunks(device, tail, p_memHandle + old_num_chunks, chunk_sizes + old_num_chunks,
+                             new_num_chunks - old_num_chunks)) {
+    return false;
+  }
+
+#ifdef ENABLE_DEBUG_CUMEM
+  std::cout << "grow_region: device=" << device << ", " << old_size << " -> " << new_size
+            << " bytes, d_mem=" << *p_d_mem << (p_moved && *p_moved ? " (moved)" : " (in place)") << std::endl;
+#endif
+  return true;
+}
+
+bool shrink_region(unsigned long long device, CUdeviceptr d_mem,
+                   std::vector<RegionReservation>* reservations,
+                   CUmemGenericAllocationHandle** p_memHandle,
+                   unsigned long long* chunk_sizes, size_t old_num_chunks,
+                   size_t new_num_chunks) {
+  if (new_num_chunks > old_num_chunks) {
+    return false;
+  }
+
+  unsigned long long new_size = 0;
+  for (size_t i = 0; i < new_num_chunks; ++i) {
+    new_size += chunk_sizes[i];
+  }
+  unsigned long long tail_size = 0;
+  for (size_t i = new_num_chunks; i < old_num_chunks; ++i) {
+    tail_size += chunk_sizes[i];
+  }
+
+  ensure_context(device);
+  CUdeviceptr tail = (void*)((uintptr_t)d_mem + new_size);
+  size_t num_tail_chunks = old_num_chunks - new_num_chunks;
+  if (num_tail_chunks > 0 && unmap_chunks(tail, chunk_sizes + new_num_chunks, num_tail_chunks) == 0) {
+    return false;
+  }
+  bool ok = true;
+  for (size_t i = new_num_chunks; i < old_num_chunks; ++i) {
+    CUresult result = cuMemRelease(*(p_memHandle[i]));
+    if (result != CUDA_SUCCESS) {
+      const char* error_string;
+      cuGetErrorString(result, &error_string);
+      std::cerr << "CUDA Error in cuMemRelease for chunk " << i << ": " << error_string << std::endl;
+      ok = false;
+    }
+  }
+
+  // Give back extension reservations that no longer hold any chunk
+  uintptr_t new_end = (uintptr_t)d_mem + new_size;
+  while (reservations->size() > 1 && (uintptr_t)reservations->back().ptr >= new_end) {
+    free_reservations(std::vector<RegionReservation>(1, reservations->back()));
+    reservations->pop_back();
+  }
+
+#ifdef ENABLE_DEBUG_CUMEM
+  std::cout << "shrink_region: device=" << device << ", released " << tail_size
+            << " bytes, d_mem=" << d_mem << std::endl;
+#endif
+  return ok;
+}
@@ -0,0 +1,113 @@
+// Host-side scans over offloaded chunks
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "cumem_host_scan.h"
+
+// Sixteen independent 32-bit multiply-xor lanes have no dependency between
+// them, so the main loop compiles to packed multiplies (vpmulld) at -O2.
+uint64_t chunk_fingerprint(const void* data, size_t size) {
+  const size_t kLanes = 16;
+  const uint32_t kPrime = 0x9E3779B1u;
+  uint32_t lanes[kLanes];
+  for (size_t j = 0; j < kLanes; ++j) {
+    lanes[j] = (uint32_t)j + 1;
+  }
+
+  const unsigned char* bytes = static_cast<const unsigned char*>(data);
+  size_t num_blocks = size / sizeof(lanes);
+  for (size_t i = 0; i < num_blocks; ++i) {
+    uint32_t words[kLanes];
+    memcpy(words, bytes + i * sizeof(lanes), sizeof(words));
+    for (size_t j = 0; j < kLanes; ++j) {
+      lanes[j] = (lanes[j] ^ words[j]) * kPrime;
+    }
+  }
+
+  uint64_t hash = size;
+  for (size_t j = 0; j < kLanes; ++j) {
+    hash = (hash ^ lanes[j]) * 0x100000001B3ULL;
+  }
+  for (size_t i = num_blocks * sizeof(lanes); i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+// Each variant ORs a block of words together and checks the block before
+// moving on, so non-zero data is rejected within the first block. The tail
+// that does not fill a block is left to is_zero_scalar.
+
+static bool is_zero_scalar(const unsigned char* bytes, size_t size) {
+  size_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    uint64_t words[8];
+    memcpy(words, bytes + i, sizeof(words));
+    uint64_t acc = 0;
+    for (size_t j = 0; j < 8; ++j) {
+      acc |= words[j];
+    }
+    if (acc != 0) {
+      return false;
+    }
+  }
+  for (; i < size; ++i) {
+    if (bytes[i] != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) static bool is_zero_avx2(const unsigned char* bytes, size_t size) {
+  size_t i = 0;
+  for (; i + 128 <= size; i += 128) {
+    __m256i acc = _mm256_or_si256(
+        _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(bytes + i)),
+                        _mm256_loadu_si256((const __m256i*)(bytes + i + 32))),
+        _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(bytes + i + 64)),
+                        _mm256_loadu_si256((const __m256i*)(bytes + i + 96))));
+    if (!_mm256_testz_si256(acc, acc)) {
+      return false;
+    }
+  }
+  return is_zero_scalar(bytes + i, size - i);
+}
+
+__attribute__((target("avx512f"))) static bool is_zero_avx512(const unsigned char* bytes, size_t size) {
+  size_t i = 0;
+  for (; i + 256 <= size; i += 256) {
+    __m512i acc = _mm512_or_si512(
+        _mm512_or_si512(_mm512_loadu_si512(bytes + i), _mm512_loadu_si512(bytes + i + 64)),
+        _mm512_or_si512(_mm512_loadu_si512(bytes + i + 128), _mm512_loadu_si512(bytes + i + 192)));
+    if (_mm512_test_epi64_mask(acc, acc) != 0) {
+      return false;
+    }
+  }
+  return is_zero_scalar(bytes + i, size - i);
+}
+#endif
+
+typedef bool (*ZeroScanFn)(const unsigned char*, size_t);
+
+static ZeroScanFn select_zero_scan() {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return is_zero_avx512;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return is_zero_avx2;
+  }
+#endif
+  return is_zero_scalar;
+}
+
+bool is_zero_buffer(const void* data, size_t size) {
+  static const ZeroScanFn scan = select_zero_scan();
+  return scan(static_cast<const unsigned char*>(data), size);
+}
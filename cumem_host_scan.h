@@ -0,0 +1,15 @@
+#pragma once
+
+// Host-side scans over offloaded chunks. These run right after a chunk has
+// been copied to host memory, so they have to keep up with the copy.
+
+#include <cstddef>
+#include <cstdint>
+
+// Content hash of a buffer, used to tell whether a chunk changed between
+// offloads. Not cryptographic.
+uint64_t chunk_fingerprint(const void* data, size_t size);
+
+// True if every byte of the buffer is zero. Uses AVX-512 or AVX2 when the CPU
+// has them (picked once at first call) and stops at the first non-zero block.
+bool is_zero_buffer(const void* data, size_t size);
@@ -0,0 +1,461 @@
+// File I/O engines for region checkpoints
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+
+#include "cumem_io_engine.h"
+#include "cumem_worker_pool.h"
+
+bool parse_io_engine(const char* name, IoEngineKind* kind) {
+  if (strcmp(name, "auto") == 0) {
+    *kind = IoEngineKind::kAuto;
+  } else if (strcmp(name, "io_uring") == 0) {
+    *kind = IoEngineKind::kIoUring;
+  } else if (strcmp(name, "threads") == 0) {
+    *kind = IoEngineKind::kThreadPool;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool pwrite_all(int fd, const void* buffer, size_t length, uint64_t offset) {
+  const char* p = static_cast<const char*>(buffer);
+  while (length > 0) {
+    ssize_t n = pwrite(fd, p, length, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      if (n == 0) {
+        errno = EIO;
+      }
+      return false;
+    }
+    p += n;
+    length -= n;
+    offset += n;
+  }
+  return true;
+}
+
+bool pread_all(int fd, void* buffer, size_t length, uint64_t offset) {
+  char* p = static_cast<char*>(buffer);
+  while (length > 0) {
+    ssize_t n = pread(fd, p, length, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      if (n == 0) {
+        errno = EIO;
+      }
+      return false;
+    }
+    p += n;
+    length -= n;
+    offset += n;
+  }
+  return true;
+}
+
+namespace {
+
+// One io_size piece of a request
+struct Segment {
+  size_t buffer;  // Request it belongs to, by buffer
+  uint64_t file_offset;
+  char* data;
+  size_t length;
+  size_t done;  // Bytes transferred so far; short transfers are resubmitted
+};
+
+// A submitted request and how many of its segments are still outstanding
+struct PendingRequest {
+  IoRequest request;
+  size_t segments_left;
+};
+
+void split_request(const IoRequest& request, char* data, size_t io_size, std::deque<Segment>* segments) {
+  for (size_t offset = 0; offset < request.length; offset += io_size) {
+    size_t length = std::min(io_size, request.length - offset);
+    segments->push_back(Segment{request.buffer, request.file_offset + offset, data + offset, length, 0});
+  }
+}
+
+size_t count_segments(size_t length, size_t io_size) {
+  return (length + io_size - 1) / io_size;
+}
+
+class IoUringEngine : public IoEngine {
+ public:
+  IoUringEngine(int fd, bool write, const std::vector<void*>& buffers, size_t queue_depth, size_t io_size)
+      : fd_(fd),
+        write_(write),
+        buffers_(buffers),
+        queue_depth_(queue_depth),
+        io_size_(io_size),
+        ring_fd_(-1),
+        sq_ring_(MAP_FAILED),
+        cq_ring_(MAP_FAILED),
+        sqes_(MAP_FAILED),
+        registered_(false),
+        unsubmitted_(0),
+        pending_(buffers.size()) {}
+
+  ~IoUringEngine() override {
+    if (ring_fd_ >= 0) {
+      // Closing the ring cancels or waits for anything still in flight
+      close(ring_fd_);
+    }
+    if (sqes_ != MAP_FAILED) {
+      munmap(sqes_, sqes_size_);
+    }
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+      munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sq_ring_ != MAP_FAILED) {
+      munmap(sq_ring_, sq_ring_size_);
+    }
+  }
+
+  // Set up the ring and register the buffers. Fails where io_uring is
+  // missing, forbidden or older than IORING_OP_READ/WRITE (5.6).
+  bool init(size_t buffer_size) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CLAMP;
+    ring_fd_ = (int)syscall(__NR_io_uring_setup, (unsigned)queue_depth_, &params);
+    if (ring_fd_ < 0) {
+      return false;
+    }
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+      errno = EOPNOTSUPP;
+      return false;
+    }
+    queue_depth_ = std::min<size_t>(queue_depth_, params.sq_entries);
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      sq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+      cq_ring_size_ = sq_ring_size_;
+    }
+    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+                    IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) {
+      return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      cq_ring_ = sq_ring_;
+    } else {
+      cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+                      IORING_OFF_CQ_RING);
+      if (cq_ring_ == MAP_FAILED) {
+        return false;
+      }
+    }
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+                 IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED) {
+      return false;
+    }
+
+    char* sq = static_cast<char*>(sq_ring_);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    char* cq = static_cast<char*>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    std::vector<iovec> iovecs(buffers_.size());
+    for (size_t i = 0; i < buffers_.size(); ++i) {
+      iovecs[i].iov_base = buffers_[i];
+      iovecs[i].iov_len = buffer_size;
+    }
+    registered_ = syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_BUFFERS, iovecs.data(),
+                          (unsigned)iovecs.size()) == 0;
+
+    slots_.resize(queue_depth_);
+    for (size_t i = 0; i < queue_depth_; ++i) {
+      free_slots_.push_back(i);
+    }
+    return true;
+  }
+
+  const char* name() const override { return "io_uring"; }
+  bool registered_buffers() const override { return registered_; }
+
+  void submit(const IoRequest& request) override {
+    pending_[request.buffer].request = request;
+    pending_[request.buffer].request.error = 0;
+    pending_[request.buffer].segments_left = count_segments(request.length, io_size_);
+    if (request.length == 0) {
+      completed_.push_back(pending_[request.buffer].request);
+      return;
+    }
+    split_request(request, static_cast<char*>(buffers_[request.buffer]), io_size_, &backlog_);
+    // All of the request's segments that fit go to the kernel in one call
+    fill_submission_queue();
+    enter(0);
+  }
+
+  IoRequest wait() override {
+    auto start_time = std::chrono::high_resolution_clock::now();
+    while (completed_.empty()) {
+      fill_submission_queue();
+      enter(1);
+      reap_completions();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+    wait_seconds_ += elapsed.count();
+    IoRequest request = completed_.front();
+    completed_.pop_front();
+    return request;
+  }
+
+ private:
+  // Move segments from the backlog into free SQ entries
+  void fill_submission_queue() {
+    unsigned tail = *sq_tail_;
+    while (!backlog_.empty() && !free_slots_.empty()) {
+      size_t slot = free_slots_.back();
+      free_slots_.pop_back();
+      Segment& segment = slots_[slot];
+      segment = backlog_.front();
+      backlog_.pop_front();
+
+      unsigned index = tail & sq_mask_;
+      io_uring_sqe* sqe = static_cast<io_uring_sqe*>(sqes_) + index;
+      memset(sqe, 0, sizeof(*sqe));
+      if (registered_) {
+        sqe->opcode = write_ ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = (uint16_t)segment.buffer;
+      } else {
+        sqe->opcode = write_ ? IORING_OP_WRITE : IORING_OP_READ;
+      }
+      sqe->fd = fd_;
+      sqe->off = segment.file_offset + segment.done;
+      sqe->addr = (uint64_t)(uintptr_t)(segment.data + segment.done);
+      sqe->len = (uint32_t)(segment.length - segment.done);
+      sqe->user_data = slot;
+      sq_array_[index] = index;
+      ++tail;
+      ++unsubmitted_;
+    }
+    __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+  }
+
+  // Submit everything queued and optionally wait for min_complete events
+  void enter(unsigned min_complete) {
+    for (;;) {
+      unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+      if (unsubmitted_ == 0 && min_complete == 0) {
+        return;
+      }
+      int submitted = (int)syscall(__NR_io_uring_enter, ring_fd_, unsubmitted_, min_complete, flags, nullptr, 0);
+      if (submitted >= 0) {
+        unsubmitted_ -= submitted;
+        return;
+      }
+      if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        std::cerr << "io_uring_enter failed: " << strerror(errno) << std::endl;
+        fail_all(errno);
+        return;
+      }
+      if (errno != EINTR) {
+        // Out of kernel resources: let completions drain first
+        reap_completions();
+        if (!completed_.empty()) {
+          return;
+        }
+      }
+    }
+  }
+
+  void reap_completions() {
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+      size_t slot = (size_t)cqe.user_data;
+      Segment& segment = slots_[slot];
+      if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+        backlog_.push_front(segment);
+      } else if (cqe.res <= 0) {
+        finish_segment(segment, cqe.res == 0 ? EIO : -cqe.res);
+      } else {
+        segment.done += cqe.res;
+        if (segment.done < segment.length) {
+          backlog_.push_front(segment);
+        } else {
+          finish_segment(segment, 0);
+        }
+      }
+      free_slots_.push_back(slot);
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+
+  void finish_segment(const Segment& segment, int error) {
+    PendingRequest& pending = pending_[segment.buffer];
+    if (error && !pending.request.error) {
+      pending.request.error = error;
+    }
+    if (--pending.segments_left == 0) {
+      completed_.push_back(pending.request);
+    }
+  }
+
+  // The ring is unusable: fail every request that has not completed yet
+  void fail_all(int error) {
+    backlog_.clear();
+    for (PendingRequest& pending : pending_) {
+      if (pending.segments_left > 0) {
+        pending.segments_left = 0;
+        pending.request.error = error;
+        completed_.push_back(pending.request);
+      }
+    }
+    unsubmitted_ = 0;
+  }
+
+  int fd_;
+  bool write_;
+  std::vector<void*> buffers_;
+  size_t queue_depth_;
+  size_t io_size_;
+
+  int ring_fd_;
+  void* sq_ring_;
+  size_t sq_ring_size_;
+  void* cq_ring_;
+  size_t cq_ring_size_;
+  void* sqes_;
+  size_t sqes_size_;
+  unsigned* sq_tail_;
+  unsigned sq_mask_;
+  unsigned* sq_array_;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned cq_mask_;
+  io_uring_cqe* cqes_;
+  bool registered_;
+  size_t unsubmitted_;  // SQ entries written but not yet passed to io_uring_enter
+
+  std::vector<PendingRequest> pending_;  // By buffer
+  std::deque<Segment> backlog_;  // Segments waiting for an SQ entry
+  std::vector<Segment> slots_;  // In-flight segments, by user_data
+  std::vector<size_t> free_slots_;
+  std::deque<IoRequest> completed_;
+};
+
+class ThreadPoolEngine : public IoEngine {
+ public:
+  ThreadPoolEngine(int fd, bool write, const std::vector<void*>& buffers, size_t queue_depth, size_t io_size,
+                   int numa_node)
+      : fd_(fd),
+        write_(write),
+        buffers_(buffers),
+        io_size_(io_size),
+        pending_(buffers.size()),
+        pool_(queue_depth, numa_node) {}
+
+  const char* name() const override { return "threads"; }
+
+  void submit(const IoRequest& request) override {
+    std::deque<Segment> segments;
+    split_request(request, static_cast<char*>(buffers_[request.buffer]), io_size_, &segments);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_[request.buffer].request = request;
+      pending_[request.buffer].request.error = 0;
+      pending_[request.buffer].segments_left = segments.size();
+      if (segments.empty()) {
+        completed_.push_back(pending_[request.buffer].request);
+        cv_.notify_one();
+        return;
+      }
+    }
+    for (const Segment& segment : segments) {
+      pool_.submit([this, segment]() {
+        bool ok = write_ ? pwrite_all(fd_, segment.data, segment.length, segment.file_offset)
+                         : pread_all(fd_, segment.data, segment.length, segment.file_offset);
+        finish_segment(segment, ok ? 0 : errno);
+        return ok;
+      });
+    }
+  }
+
+  IoRequest wait() override {
+    auto start_time = std::chrono::high_resolution_clock::now();
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]() { return !completed_.empty(); });
+    IoRequest request = completed_.front();
+    completed_.pop_front();
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+    wait_seconds_ += elapsed.count();
+    return request;
+  }
+
+ private:
+  void finish_segment(const Segment& segment, int error) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    PendingRequest& pending = pending_[segment.buffer];
+    if (error && !pending.request.error) {
+      pending.request.error = error;
+    }
+    if (--pending.segments_left == 0) {
+      completed_.push_back(pending.request);
+      cv_.notify_one();
+    }
+  }
+
+  int fd_;
+  bool write_;
+  std::vector<void*> buffers_;
+  size_t io_size_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<PendingRequest> pending_;  // By buffer
+  std::deque<IoRequest> completed_;
+  // Last, so that the workers are joined before the state they report to
+  // goes away
+  WorkerPool pool_;
+};
+
+}  // namespace
+
+std::unique_ptr<IoEngine> create_io_engine(IoEngineKind kind, int fd, bool write,
+                                           const std::vector<void*>& buffers, size_t buffer_size,
+                                           size_t queue_depth, size_t io_size, int numa_node) {
+  if (queue_depth == 0 || io_size == 0) {
+    return nullptr;
+  }
+  if (kind != IoEngineKind::kThreadPool) {
+    std::unique_ptr<IoUringEngine> engine(new IoUringEngine(fd, write, buffers, queue_depth, io_size));
+    if (engine->init(buffer_size)) {
+      return std::unique_ptr<IoEngine>(engine.release());
+    }
+    if (kind == IoEngineKind::kIoUring) {
+      std::cerr << "io_uring is not available: " << strerror(errno) << std::endl;
+      return nullptr;
+    }
+  }
+  return std::unique_ptr<IoEngine>(new ThreadPoolEngine(fd, write, buffers, queue_depth, io_size, numa_node));
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+// File I/O engines for region checkpoints.
+//
+// A caller owns a fixed set of equally sized buffers and issues at most one
+// request per buffer at a time; each request transfers a whole buffer (or a
+// prefix of it) to or from one file offset. Engines split requests into
+// io_size segments, keep up to queue_depth segments in flight and hand
+// requests back as they complete, in any order.
+//  - kIoUring drives an io_uring instance through raw syscalls (no liburing).
+//    The buffers are registered with the ring so the kernel does not pin and
+//    map them per request, and every segment queued since the last wait()
+//    goes to the kernel in one io_uring_enter call. Where buffers cannot be
+//    registered (e.g. RLIMIT_MEMLOCK) it falls back to unregistered reads
+//    and writes on the same ring.
+//  - kThreadPool issues blocking pwrite/pread calls from queue_depth
+//    threads pinned to a NUMA node.
+//  - kAuto is kIoUring where the kernel allows it (it may be missing or
+//    blocked by seccomp), kThreadPool otherwise.
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+enum class IoEngineKind { kAuto, kIoUring, kThreadPool };
+
+// Parse "auto" / "io_uring" / "threads"; returns false for anything else
+bool parse_io_engine(const char* name, IoEngineKind* kind);
+
+struct IoRequest {
+  size_t buffer;  // Index into the engine's buffers
+  uint64_t file_offset;
+  size_t length;  // Bytes of file I/O; a multiple of 4KB for O_DIRECT files
+  uintptr_t device_offset;  // Caller's bookkeeping, passed through
+  size_t copy_length;  // Caller's bookkeeping, passed through
+  int error;  // Set on completion: errno of a failed transfer, 0 on success
+};
+
+class IoEngine {
+ public:
+  virtual ~IoEngine() {}
+
+  virtual const char* name() const = 0;
+  // Whether the buffers are registered with the kernel
+  virtual bool registered_buffers() const { return false; }
+
+  // Queue a request on a buffer that has no request in flight. It may not
+  // reach the kernel until the next wait().
+  virtual void submit(const IoRequest& request) = 0;
+  // Block until some request completes and return it. Must only be called
+  // while requests are outstanding.
+  virtual IoRequest wait() = 0;
+
+  // Time the caller has spent blocked in wait()
+  double wait_seconds() const { return wait_seconds_; }
+
+ protected:
+  IoEngine() : wait_seconds_(0) {}
+
+  double wait_seconds_;
+};
+
+// pwrite/pread the whole range, retrying short transfers and EINTR. On
+// failure errno is set; a read past the end of the file fails with EIO.
+bool pwrite_all(int fd, const void* buffer, size_t length, uint64_t offset);
+bool pread_all(int fd, void* buffer, size_t length, uint64_t offset);
+
+// Create an engine for fd over buffers, each buffer_size bytes. Segments are
+// io_size bytes; threads of kThreadPool are pinned to numa_node (< 0 leaves
+// them unpinned). Returns null if the requested kind is unavailable.
+std::unique_ptr<IoEngine> create_io_engine(IoEngineKind kind, int fd, bool write,
+                                           const std::vector<void*>& buffers, size_t buffer_size,
+                                           size_t queue_depth, size_t io_size, int numa_node);
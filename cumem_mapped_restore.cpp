@@ -0,0 +1,239 @@
+// Restore regions from memory-mapped weight files
+#define USE_ROCM
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <hip/hip_runtime.h>
+
+#include "cumem_mapped_restore.h"
+
+void ensure_context(unsigned long long device);
+
+// DeviceCopyTarget
+
+DeviceCopyTarget::DeviceCopyTarget(unsigned long long device, CUdeviceptr d_mem, size_t num_slots)
+    : device_(device), d_mem_(d_mem), stream_(nullptr), events_(num_slots, nullptr), recorded_(num_slots, 0) {
+  ensure_context(device_);
+  hipStreamCreateWithFlags(&stream_, hipStreamNonBlocking);
+  for (CUevent& event : events_) {
+    hipEventCreateWithFlags(&event, hipEventDisableTiming);
+  }
+}
+
+DeviceCopyTarget::~DeviceCopyTarget() {
+  if (stream_) {
+    hipStreamSynchronize(stream_);
+  }
+  for (CUevent event : events_) {
+    if (event) {
+      hipEventDestroy(event);
+    }
+  }
+  if (stream_) {
+    hipStreamDestroy(stream_);
+  }
+}
+
+bool DeviceCopyTarget::pin(void* host, size_t size) {
+  // File pages are mapped read-only
+  return hipHostRegister(host, size, hipHostRegisterReadOnly) == hipSuccess;
+}
+
+void DeviceCopyTarget::unpin(void* host) {
+  hipHostUnregister(host);
+}
+
+bool DeviceCopyTarget::copy_async(size_t slot, uintptr_t offset, const void* host, size_t size) {
+  hipError_t hip_result = hipMemcpyAsync((void*)((uintptr_t)d_mem_ + offset), host, size,
+                                         hipMemcpyHostToDevice, stream_);
+  if (hip_result == hipSuccess) {
+    hip_result = hipEventRecord(events_[slot], stream_);
+  }
+  if (hip_result != hipSuccess) {
+    std::cerr << "Error restoring from mapped file: " << hipGetErrorString(hip_result) << std::endl;
+    return false;
+  }
+  recorded_[slot] = 1;
+  return true;
+}
+
+bool DeviceCopyTarget::wait(size_t slot) {
+  if (!recorded_[slot]) {
+    return true;
+  }
+  recorded_[slot] = 0;
+  return hipEventSynchronize(events_[slot]) == hipSuccess;
+}
+
+// HostCopyTarget
+
+HostCopyTarget::HostCopyTarget(void* base, size_t num_slots)
+    : base_(static_cast<char*>(base)), pending_(num_slots), pool_(1, -1) {}
+
+HostCopyTarget::~HostCopyTarget() {
+  for (size_t slot = 0; slot < pending_.size(); ++slot) {
+    wait(slot);
+  }
+  for (const auto& entry : pinned_) {
+    munlock(entry.first, entry.second);
+  }
+}
+
+bool HostCopyTarget::pin(void* host, size_t size) {
+  // Like hipHostRegister, mlock faults the range in before returning
+  if (mlock(host, size) != 0) {
+    return false;
+  }
+  pinned_[host] = size;
+  return true;
+}
+
+void HostCopyTarget::unpin(void* host) {
+  auto it = pinned_.find(host);
+  if (it != pinned_.end()) {
+    munlock(it->first, it->second);
+    pinned_.erase(it);
+  }
+}
+
+bool HostCopyTarget::copy_async(size_t slot, uintptr_t offset, const void* host, size_t size) {
+  char* dst = base_ + offset;
+  pending_[slot] = pool_.submit([dst, host, size]() {
+    memcpy(dst, host, size);
+    return true;
+  });
+  return true;
+}
+
+bool HostCopyTarget::wait(size_t slot) {
+  return !pending_[slot].valid() || pending_[slot].get();
+}
+
+// restore_from_mapped_file
+
+namespace {
+
+double seconds_since(std::chrono::high_resolution_clock::time_point start_time) {
+  std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+  return elapsed.count();
+}
+
+}  // namespace
+
+bool restore_from_mapped_file(const std::string& path, uint64_t file_offset, size_t size, CopyTarget* target,
+                              const MappedRestoreOptions& options, MappedRestoreStats* stats) {
+  auto start_time = std::chrono::high_resolution_clock::now();
+  MappedRestoreStats local = {};
+  if (size == 0 || options.num_windows == 0 || options.window_size == 0) {
+    return size == 0;
+  }
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+  const size_t window_size = (options.window_size + page_size - 1) / page_size * page_size;
+
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "Error opening " << path << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+  // The mapping starts on the page holding file_offset; windows are
+  // page-aligned in the file, so neighbouring windows never share a page
+  uint64_t map_offset = file_offset / page_size * page_size;
+  size_t lead = file_offset - map_offset;
+  size_t map_size = lead + size;
+  void* mapping = mmap(nullptr, map_size, PROT_READ, MAP_SHARED, fd, map_offset);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    std::cerr << "Error mapping " << path << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+  madvise(mapping, map_size, MADV_SEQUENTIAL);
+  char* base = static_cast<char*>(mapping);
+
+  std::vector<void*> pinned_windows(options.num_windows, nullptr);  // By slot
+  std::vector<void*> bounce(options.num_windows, nullptr);
+  std::vector<char> bounce_pinned(options.num_windows, 0);
+  bool ok = true;
+  size_t num_windows = (map_size + window_size - 1) / window_size;
+  for (size_t k = 0; k < num_windows && ok; ++k) {
+    size_t slot = k % options.num_windows;
+    auto wait_start = std::chrono::high_resolution_clock::now();
+    ok = target->wait(slot);
+    local.wait_seconds += seconds_since(wait_start);
+    if (pinned_windows[slot]) {
+      target->unpin(pinned_windows[slot]);
+      pinned_windows[slot] = nullptr;
+    }
+    if (!ok) {
+      break;
+    }
+
+    // Bytes of the window that belong to the requested range
+    size_t window_begin = k * window_size;
+    size_t window_end = std::min(window_begin + window_size, map_size);
+    size_t copy_begin = std::max(window_begin, lead);
+    size_t copy_size = window_end - copy_begin;
+    uintptr_t target_offset = copy_begin - lead;
+
+    auto pin_start = std::chrono::high_resolution_clock::now();
+    bool pinned = target->pin(base + window_begin, window_end - window_begin);
+    local.pin_seconds += seconds_since(pin_start);
+    if (pinned) {
+      pinned_windows[slot] = base + window_begin;
+      ok = target->copy_async(slot, target_offset, base + copy_begin, copy_size);
+      local.bytes_pinned += copy_size;
+    } else {
+      // Read the window through a pinned bounce buffer; the buffer of this
+      // slot is free again since its last copy has been waited for
+      if (!bounce[slot]) {
+        if (posix_memalign(&bounce[slot], page_size, window_size) != 0) {
+          bounce[slot] = nullptr;
+          ok = false;
+          break;
+        }
+        bounce_pinned[slot] = target->pin(bounce[slot], window_size);
+      }
+      memcpy(bounce[slot], base + copy_begin, copy_size);
+      ok = target->copy_async(slot, target_offset, bounce[slot], copy_size);
+      local.bytes_bounced += copy_size;
+    }
+    local.bytes += copy_size;
+
+    // Start reading the next window while this one is being copied
+    if (k + 1 < num_windows) {
+      size_t next_end = std::min((k + 2) * window_size, map_size);
+      madvise(base + (k + 1) * window_size, next_end - (k + 1) * window_size, MADV_WILLNEED);
+    }
+  }
+
+  for (size_t slot = 0; slot < options.num_windows; ++slot) {
+    auto wait_start = std::chrono::high_resolution_clock::now();
+    ok = target->wait(slot) && ok;
+    local.wait_seconds += seconds_since(wait_start);
+    if (pinned_windows[slot]) {
+      target->unpin(pinned_windows[slot]);
+    }
+    if (bounce[slot]) {
+      if (bounce_pinned[slot]) {
+        target->unpin(bounce[slot]);
+      }
+      free(bounce[slot]);
+    }
+  }
+  munmap(mapping, map_size);
+  if (!ok) {
+    std::cerr << "Error restoring " << path << " from its mapping" << std::endl;
+  }
+
+  local.seconds = seconds_since(start_time);
+  if (stats) {
+    *stats = local;
+  }
+  return ok;
+}
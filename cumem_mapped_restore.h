@@ -0,0 +1,96 @@
+#pragma once
+
+// Restore a region straight from a memory-mapped weight file.
+//
+// The file range is mmap'd read-only and walked in page-aligned windows
+// (one chunk each by default). Each window is pinned in place and copied
+// asynchronously into the region; while that copy runs, the next window is
+// paged in (readahead is requested one window ahead) and pinned. A window is
+// unpinned once its copy has completed, so only num_windows windows are
+// pinned at any time and the data never passes through an intermediate host
+// buffer. Where a window cannot be pinned (some filesystems refuse to pin
+// file pages) it is copied through a pinned bounce buffer instead.
+//
+// The destination is a CopyTarget: DeviceCopyTarget copies into a region
+// created by create_and_map; HostCopyTarget copies into host memory on a
+// worker thread, so the path can be exercised without a device.
+
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "cumem_allocator_compat.h"
+#include "cumem_worker_pool.h"
+
+// Where restored bytes go. Copies are issued on a fixed number of slots; a
+// slot has at most one copy in flight.
+class CopyTarget {
+ public:
+  virtual ~CopyTarget() {}
+  // Pin [host, host + size) for asynchronous copies; false if it cannot be
+  virtual bool pin(void* host, size_t size) = 0;
+  virtual void unpin(void* host) = 0;
+  // Start copying size bytes from host to offset bytes into the target
+  virtual bool copy_async(size_t slot, uintptr_t offset, const void* host, size_t size) = 0;
+  // Wait for the copy on slot, if any
+  virtual bool wait(size_t slot) = 0;
+};
+
+// Copies into device memory at d_mem with hipMemcpyAsync on one stream,
+// pinning with hipHostRegister
+class DeviceCopyTarget : public CopyTarget {
+ public:
+  DeviceCopyTarget(unsigned long long device, CUdeviceptr d_mem, size_t num_slots);
+  ~DeviceCopyTarget();
+  bool pin(void* host, size_t size) override;
+  void unpin(void* host) override;
+  bool copy_async(size_t slot, uintptr_t offset, const void* host, size_t size) override;
+  bool wait(size_t slot) override;
+
+ private:
+  unsigned long long device_;
+  CUdeviceptr d_mem_;
+  CUstream stream_;
+  std::vector<CUevent> events_;
+  std::vector<char> recorded_;
+};
+
+// Copies into host memory at base on a worker thread, pinning with mlock
+class HostCopyTarget : public CopyTarget {
+ public:
+  HostCopyTarget(void* base, size_t num_slots);
+  ~HostCopyTarget();
+  bool pin(void* host, size_t size) override;
+  void unpin(void* host) override;
+  bool copy_async(size_t slot, uintptr_t offset, const void* host, size_t size) override;
+  bool wait(size_t slot) override;
+
+ private:
+  char* base_;
+  std::vector<std::future<bool>> pending_;
+  std::map<void*, size_t> pinned_;  // mlock'd ranges by start
+  WorkerPool pool_;
+};
+
+struct MappedRestoreOptions {
+  size_t window_size = 128 * 1024 * 1024;  // Rounded up to whole pages
+  size_t num_windows = 2;  // Pinned at once; also the number of copy slots
+};
+
+struct MappedRestoreStats {
+  size_t bytes;
+  size_t bytes_pinned;  // Copied straight from pinned file pages
+  size_t bytes_bounced;  // Copied through a bounce buffer
+  double seconds;
+  double pin_seconds;  // Paging in and pinning windows
+  double wait_seconds;  // Waiting for copies to complete
+};
+
+// Copy size bytes of path, starting at file_offset (any alignment), to the
+// start of target. target must have been created with options.num_windows
+// slots.
+bool restore_from_mapped_file(const std::string& path, uint64_t file_offset, size_t size, CopyTarget* target,
+                              const MappedRestoreOptions& options, MappedRestoreStats* stats);
@@ -0,0 +1,562 @@
+// Tagged regions and selective sleep/wake
+#define USE_ROCM
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <sstream>
+#include <unistd.h>
+#include <hip/hip_runtime.h>
+
+#include "cumem_host_scan.h"
+#include "cumem_offload.h"
+#include "cumem_region.h"
+
+void ensure_context(unsigned long long device);
+int get_numa_node_for_gpu(unsigned long long device);
+
+void unmap_and_release(unsigned long long device, ssize_t size, CUdeviceptr d_mem,
+                       CUmemGenericAllocationHandle** p_memHandle,
+                       unsigned long long* chunk_sizes, size_t num_chunks,
+                       size_t* p_saved_calls);
+
+SleepManager::SleepManager()
+    : codec_(CompressionCodec::kNone), compression_threads_(0), staging_size_(0), spill_staging_pool_(nullptr) {}
+
+SleepManager::~SleepManager() {
+  for (auto& entry : regions_) {
+    free_host_chunks(entry.second);
+  }
+  // Stop the workers before their staging buffers go away
+  pools_.clear();
+  for (void* buffer : staging_) {
+    hipHostFree(buffer);
+  }
+}
+
+bool SleepManager::add_region(const std::string& tag, unsigned long long device, CUdeviceptr d_mem,
+                              size_t size, CUmemGenericAllocationHandle** p_memHandle,
+                              unsigned long long* chunk_sizes, size_t num_chunks) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Region region;
+  region.tag = tag;
+  region.device = device;
+  region.d_mem = d_mem;
+  region.size = size;
+  region.p_memHandle = p_memHandle;
+  region.chunk_sizes = chunk_sizes;
+  region.num_chunks = num_chunks;
+  region.asleep = false;
+  region.retain_host_copy = false;
+  return regions_.emplace((uintptr_t)d_mem, std::move(region)).second;
+}
+
+bool SleepManager::remove_region(CUdeviceptr d_mem) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = regions_.find((uintptr_t)d_mem);
+  if (it == regions_.end() || it->second.asleep) {
+    return false;
+  }
+  regions_.erase(it);
+  return true;
+}
+
+bool SleepManager::is_asleep(CUdeviceptr d_mem) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = regions_.find((uintptr_t)d_mem);
+  return it != regions_.end() && it->second.asleep;
+}
+
+void SleepManager::set_compression(CompressionCodec codec, size_t num_threads) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  codec_ = codec;
+  if (num_threads != compression_threads_) {
+    pools_.clear();
+    compression_threads_ = num_threads;
+  }
+}
+
+void SleepManager::set_spill_directory(const std::string& directory) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  spill_directory_ = directory;
+}
+
+void SleepManager::set_staging_pool(StagingPool* pool) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  spill_staging_pool_ = pool;
+}
+
+WorkerPool& SleepManager::pool_for(unsigned long long device) {
+  int node = get_numa_node_for_gpu(device);
+  std::unique_ptr<WorkerPool>& pool = pools_[node];
+  if (!pool) {
+    pool.reset(new WorkerPool(compression_threads_, node));
+  }
+  return *pool;
+}
+
+bool SleepManager::ensure_staging(size_t count, size_t size) {
+  if (size > staging_size_) {
+    for (void* buffer : staging_) {
+      hipHostFree(buffer);
+    }
+    staging_.clear();
+    staging_size_ = size;
+  }
+  while (staging_.size() < count) {
+    void* buffer = nullptr;
+    hipError_t hip_result = hipHostMalloc(&buffer, staging_size_);
+    if (hip_result != hipSuccess) {
+      std::cerr << "Error allocating staging buffer: " << hipGetErrorString(hip_result) << std::endl;
+      return false;
+    }
+    staging_.push_back(buffer);
+  }
+  return true;
+}
+
+void SleepManager::release_copy(ChunkCopy& chunk) {
+  if (chunk.host) {
+    if (chunk.pinned) {
+      hipHostFree(chunk.host);
+    } else {
+      free(chunk.host);
+    }
+  }
+  chunk.host = nullptr;
+  chunk.stored_size = 0;
+  chunk.pinned = false;
+  chunk.codec = CompressionCodec::kNone;
+}
+
+void SleepManager::free_host_chunks(Region& region) {
+  for (ChunkCopy& chunk : region.chunks) {
+    release_copy(chunk);
+  }
+  region.chunks.clear();
+}
+
+bool SleepManager::mark_dirty(CUdeviceptr ptr, size_t size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = regions_.upper_bound((uintptr_t)ptr);
+  if (it == regions_.begin()) {
+    return false;
+  }
+  --it;
+  Region& region = it->second;
+  uintptr_t begin = (uintptr_t)ptr - (uintptr_t)region.d_mem;
+  if (begin >= region.size || region.asleep) {
+    return false;
+  }
+  uintptr_t end = std::min<uintptr_t>(begin + size, region.size);
+  uintptr_t offset = 0;
+  for (size_t i = 0; i < region.chunks.size() && offset < end; ++i) {
+    if (offset + region.chunk_sizes[i] > begin) {
+      region.chunks[i].dirty = true;
+    }
+    offset += region.chunk_sizes[i];
+  }
+  return true;
+}
+
+// Record a chunk whose raw contents are at data. Zero chunks drop their
+// buffer. Without a codec data is the chunk's own pinned copy; with one, data
+// is a staging buffer and the chunk is compressed (or, if that does not
+// help, copied) into pageable memory.
+bool SleepManager::store_chunk(ChunkCopy& chunk, const void* data, size_t size, bool incremental,
+                               CompressionCodec codec) {
+  chunk.zero = is_zero_buffer(data, size);
+  chunk.fingerprint = 0;
+  if (chunk.zero) {
+    release_copy(chunk);
+  } else {
+    if (incremental) {
+      chunk.fingerprint = chunk_fingerprint(data, size);
+    }
+    if (codec != CompressionCodec::kNone) {
+      release_copy(chunk);
+      void* out = malloc(size);
+      if (!out) {
+        return false;
+      }
+      size_t compressed = compress_chunk(codec, data, size, out);
+      if (compressed) {
+        void* shrunk = realloc(out, compressed);
+        chunk.host = shrunk ? shrunk : out;
+        chunk.stored_size = compressed;
+        chunk.codec = codec;
+      } else {
+        memcpy(out, data, size);
+        chunk.host = out;
+        chunk.stored_size = size;
+      }
+    } else {
+      chunk.stored_size = size;
+    }
+  }
+  chunk.dirty = false;
+  return true;
+}
+
+// Copy the region into pinned host buffers, one per chunk. An incremental
+// offload reuses the host copy kept from the previous cycle and only copies
+// the chunks marked dirty since.
+bool SleepManager::offload_region(Region& region, bool incremental, SleepStats* stats) {
+  if (!incremental || region.chunks.size() != region.num_chunks) {
+    free_host_chunks(region);
+    ChunkCopy empty = {nullptr, 0, false, CompressionCodec::kNone, true, false, 0};
+    region.chunks.assign(region.num_chunks, empty);
+  }
+  if (region.num_chunks == 0) {
+    return true;
+  }
+  if (codec_ != CompressionCodec::kNone) {
+    return offload_region_compressed(region, incremental, stats);
+  }
+
+  uintptr_t offset = 0;
+  for (size_t i = 0; i < region.num_chunks; ++i) {
+    ChunkCopy& chunk = region.chunks[i];
+    size_t chunk_size = region.chunk_sizes[i];
+    if (!chunk.dirty) {
+      stats->bytes_skipped += chunk_size;
+      offset += chunk_size;
+      continue;
+    }
+    uint64_t old_fingerprint = chunk.fingerprint;
+    bool had_copy = chunk.host != nullptr || chunk.zero;
+    // A copy left by a compressed offload is not pinned and cannot take a
+    // DMA directly
+    if (chunk.host && !chunk.pinned) {
+      release_copy(chunk);
+    }
+    hipError_t hip_result = hipSuccess;
+    if (!chunk.host) {
+      hip_result = hipHostMalloc(&chunk.host, chunk_size);
+      chunk.pinned = hip_result == hipSuccess;
+    }
+    if (hip_result == hipSuccess) {
+      hip_result = hipMemcpy(chunk.host, (void*)((uintptr_t)region.d_mem + offset), chunk_size,
+                             hipMemcpyDeviceToHost);
+    }
+    if (hip_result != hipSuccess) {
+      std::cerr << "Error offloading chunk " << i << " of region tagged " << region.tag << ": "
+                << hipGetErrorString(hip_result) << std::endl;
+      free_host_chunks(region);
+      return false;
+    }
+    stats->bytes_copied += chunk_size;
+
+    store_chunk(chunk, chunk.host, chunk_size, incremental, CompressionCodec::kNone);
+    if (chunk.zero) {
+      stats->bytes_zero += chunk_size;
+    } else {
+      stats->bytes_stored += chunk.stored_size;
+    }
+    if (incremental && had_copy && chunk.fingerprint == old_fingerprint) {
+      ++stats->chunks_unchanged;
+    }
+    offset += chunk_size;
+  }
+  region.retain_host_copy = incremental;
+  return true;
+}
+
+// Offload through the staging buffers: the calling thread copies chunk after
+// chunk into the next free staging buffer and hands it to a worker, which
+// scans and compresses it while the following copies are in flight
+bool SleepManager::offload_region_compressed(Region& region, bool incremental, SleepStats* stats) {
+  size_t max_chunk_size = *std::max_element(region.chunk_sizes, region.chunk_sizes + region.num_chunks);
+  WorkerPool& pool = pool_for(region.device);
+  size_t num_slots = std::min(pool.size() + 2, region.num_chunks);
+  if (!ensure_staging(num_slots, max_chunk_size)) {
+    free_host_chunks(region);
+    return false;
+  }
+
+  std::vector<std::future<bool>> pending(num_slots);
+  std::vector<char> processed(region.num_chunks, 0);
+  std::vector<char> had_copy(region.num_chunks, 0);
+  std::vector<uint64_t> old_fingerprints(region.num_chunks, 0);
+  CompressionCodec codec = codec_;
+  bool ok = true;
+  size_t slot = 0;
+  uintptr_t offset = 0;
+  for (size_t i = 0; i < region.num_chunks && ok; ++i) {
+    size_t chunk_size = region.chunk_sizes[i];
+    if (!region.chunks[i].dirty) {
+      stats->bytes_skipped += chunk_size;
+      offset += chunk_size;
+      continue;
+    }
+    if (pending[slot].valid() && !pending[slot].get()) {
+      ok = false;
+      break;
+    }
+    void* staging = staging_[slot];
+    hipError_t hip_result = hipMemcpy(staging, (void*)((uintptr_t)region.d_mem + offset), chunk_size,
+                                      hipMemcpyDeviceToHost);
+    if (hip_result != hipSuccess) {
+      std::cerr << "Error offloading chunk " << i << " of region tagged " << region.tag << ": "
+                << hipGetErrorString(hip_result) << std::endl;
+      ok = false;
+      break;
+    }
+    stats->bytes_copied += chunk_size;
+    ChunkCopy* chunk = &region.chunks[i];
+    processed[i] = 1;
+    had_copy[i] = chunk->host != nullptr || chunk->zero;
+    old_fingerprints[i] = chunk->fingerprint;
+    pending[slot] = pool.submit([chunk, staging, chunk_size, incremental, codec]() {
+      return store_chunk(*chunk, staging, chunk_size, incremental, codec);
+    });
+    slot = (slot + 1) % num_slots;
+    offset += chunk_size;
+  }
+  for (std::future<bool>& result : pending) {
+    if (result.valid() && !result.get()) {
+      ok = false;
+    }
+  }
+  if (!ok) {
+    std::cerr << "Error compressing region tagged " << region.tag << std::endl;
+    free_host_chunks(region);
+    return false;
+  }
+
+  for (size_t i = 0; i < region.num_chunks; ++i) {
+    if (!processed[i]) {
+      continue;
+    }
+    if (region.chunks[i].zero) {
+      stats->bytes_zero += region.chunk_sizes[i];
+    } else {
+      stats->bytes_stored += region.chunks[i].stored_size;
+    }
+    if (incremental && had_copy[i] && region.chunks[i].fingerprint == old_fingerprints[i]) {
+      ++stats->chunks_unchanged;
+    }
+  }
+  region.retain_host_copy = incremental;
+  return true;
+}
+
+// Zero chunks are memset and raw pinned copies go straight to the device;
+// everything else is decoded by the workers into staging buffers, which the
+// calling thread copies to the device in order as they become ready
+bool SleepManager::restore_region(Region& region, SleepStats* stats) {
+  std::vector<size_t> staged;
+  std::vector<uintptr_t> offsets(region.num_chunks);
+  uintptr_t offset = 0;
+  bool ok = true;
+  for (size_t i = 0; i < region.num_chunks && ok; ++i) {
+    offsets[i] = offset;
+    offset += region.chunk_sizes[i];
+    const ChunkCopy& chunk = region.chunks[i];
+    void* d_chunk = (void*)((uintptr_t)region.d_mem + offsets[i]);
+    hipError_t hip_result = hipSuccess;
+    if (chunk.zero) {
+      hip_result = hipMemset(d_chunk, 0, region.chunk_sizes[i]);
+      stats->bytes_zero += region.chunk_sizes[i];
+    } else if (chunk.pinned) {
+      hip_result = hipMemcpy(d_chunk, chunk.host, region.chunk_sizes[i], hipMemcpyHostToDevice);
+      stats->bytes_copied += region.chunk_sizes[i];
+    } else {
+      staged.push_back(i);
+    }
+    if (hip_result != hipSuccess) {
+      std::cerr << "Error restoring chunk " << i << " of region tagged " << region.tag << ": "
+                << hipGetErrorString(hip_result) << std::endl;
+      ok = false;
+    }
+  }
+
+  if (ok && !staged.empty()) {
+    size_t max_chunk_size = *std::max_element(region.chunk_sizes, region.chunk_sizes + region.num_chunks);
+    WorkerPool& pool = pool_for(region.device);
+    size_t num_slots = std::min(pool.size() + 2, staged.size());
+    ok = ensure_staging(num_slots, max_chunk_size);
+
+    std::vector<std::future<bool>> pending(num_slots);
+    auto submit = [&](size_t k) {
+      const ChunkCopy* chunk = &region.chunks[staged[k]];
+      void* staging = staging_[k % num_slots];
+      size_t chunk_size = region.chunk_sizes[staged[k]];
+      pending[k % num_slots] = pool.submit([chunk, staging, chunk_size]() {
+        if (chunk->codec == CompressionCodec::kNone) {
+          memcpy(staging, chunk->host, chunk_size);
+          return true;
+        }
+        return decompress_chunk(chunk->codec, chunk->host, chunk->stored_size, staging, chunk_size);
+      });
+    };
+    for (size_t k = 0; k < num_slots && ok; ++k) {
+      submit(k);
+    }
+    for (size_t k = 0; k < staged.size() && ok; ++k) {
+      size_t i = staged[k];
+      if (!pending[k % num_slots].get()) {
+        std::cerr << "Error decompressing chunk " << i << " of region tagged " << region.tag << std::endl;
+        ok = false;
+        break;
+      }
+      hipError_t hip_result = hipMemcpy((void*)((uintptr_t)region.d_mem + offsets[i]), staging_[k % num_slots],
+                                        region.chunk_sizes[i], hipMemcpyHostToDevice);
+      if (hip_result != hipSuccess) {
+        std::cerr << "Error restoring chunk " << i << " of region tagged " << region.tag << ": "
+                  << hipGetErrorString(hip_result) << std::endl;
+        ok = false;
+        break;
+      }
+      stats->bytes_copied += region.chunk_sizes[i];
+      if (k + num_slots < staged.size()) {
+        submit(k + num_slots);
+      }
+    }
+    // Do not free buffers that workers may still be reading
+    for (std::future<bool>& result : pending) {
+      if (result.valid()) {
+        result.wait();
+      }
+    }
+  }
+
+  // A retained copy now matches the device again, chunk for chunk
+  if (!ok || !region.retain_host_copy) {
+    free_host_chunks(region);
+  }
+  return ok;
+}
+
+// Stream the region to its own file under the spill directory; the file name
+// carries the region's address so that regions sharing a tag do not collide
+bool SleepManager::spill_region(Region& region, SleepStats* stats) {
+  if (spill_directory_.empty()) {
+    std::cerr << "No spill directory set for region tagged " << region.tag << std::endl;
+    return false;
+  }
+  std::ostringstream path;
+  path << spill_directory_ << "/cumem-" << getpid() << "-" << std::hex << (uintptr_t)region.d_mem << ".ckpt";
+  CheckpointOptions options;
+  options.staging_pool = spill_staging_pool_;
+  CheckpointStats checkpoint_stats;
+  if (!save_region_checkpoint(path.str(), region.device, region.d_mem, region.chunk_sizes, region.num_chunks,
+                              options, &checkpoint_stats)) {
+    std::cerr << "Error spilling region tagged " << region.tag << std::endl;
+    return false;
+  }
+  free_host_chunks(region);
+  region.spill_path = path.str();
+  stats->bytes_spilled += checkpoint_stats.bytes;
+  return true;
+}
+
+bool SleepManager::unspill_region(Region& region, SleepStats* stats) {
+  CheckpointOptions options;
+  options.staging_pool = spill_staging_pool_;
+  CheckpointStats checkpoint_stats;
+  if (!load_region_checkpoint(region.spill_path, region.device, region.d_mem, region.chunk_sizes,
+                              region.num_chunks, 0, region.num_chunks, options, &checkpoint_stats)) {
+    // Keep the file; it is the only copy of the data
+    std::cerr << "Error reading back region tagged " << region.tag << " from " << region.spill_path
+              << std::endl;
+    return false;
+  }
+  unlink(region.spill_path.c_str());
+  region.spill_path.clear();
+  stats->bytes_spilled += checkpoint_stats.bytes;
+  return true;
+}
+
+bool SleepManager::sleep(const std::map<std::string, SleepAction>& actions, SleepAction default_action,
+                         SleepStats* stats) {
+  auto start_time = std::chrono::high_resolution_clock::now();
+  SleepStats local = {};
+  bool ok = true;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto& entry : regions_) {
+    Region& region = entry.second;
+    if (region.asleep) {
+      continue;
+    }
+    auto action_it = actions.find(region.tag);
+    SleepAction action = action_it == actions.end() ? default_action : action_it->second;
+    if (action == SleepAction::kKeep) {
+      ++local.regions_kept;
+      continue;
+    }
+
+    ensure_context(region.device);
+    if (action == SleepAction::kOffload || action == SleepAction::kOffloadIncremental) {
+      if (!offload_region(region, action == SleepAction::kOffloadIncremental, &local)) {
+        ok = false;
+        continue;
+      }
+      ++local.regions_offloaded;
+    } else if (action == SleepAction::kSpill) {
+      if (!spill_region(region, &local)) {
+        ok = false;
+        continue;
+      }
+      ++local.regions_spilled;
+    } else {
+      free_host_chunks(region);
+      ++local.regions_discarded;
+    }
+    unmap_and_release(region.device, region.size, region.d_mem, region.p_memHandle,
+                      region.chunk_sizes, region.num_chunks, nullptr);
+    region.asleep = true;
+  }
+
+  std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+  local.seconds = elapsed.count();
+  if (stats) {
+    *stats = local;
+  }
+  return ok;
+}
+
+bool SleepManager::wake_up(SleepStats* stats) {
+  auto start_time = std::chrono::high_resolution_clock::now();
+  SleepStats local = {};
+  bool ok = true;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto& entry : regions_) {
+    Region& region = entry.second;
+    if (!region.asleep) {
+      continue;
+    }
+    if (!create_and_map_chunks(region.device, region.d_mem, region.p_memHandle, region.chunk_sizes,
+                               region.num_chunks)) {
+      std::cerr << "Error remapping region tagged " << region.tag << " on wake up" << std::endl;
+      ok = false;
+      continue;
+    }
+    region.asleep = false;
+    if (!region.spill_path.empty()) {
+      if (unspill_region(region, &local)) {
+        ++local.regions_spilled;
+      } else {
+        ok = false;
+      }
+    } else if (region.chunks.empty()) {
+      ++local.regions_discarded;
+    } else if (restore_region(region, &local)) {
+      ++local.regions_offloaded;
+    } else {
+      ok = false;
+    }
+  }
+
+  std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+  local.seconds = elapsed.count();
+  if (stats) {
+    *stats = local;
+  }
+  return ok;
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+// Tagged regions and selective sleep. Every region is registered under a tag
+// chosen by the caller when it allocates (e.g. "weights", "kv_cache"), and
+// sleep() takes an action per tag:
+//  - kOffload: copy the region to pinned host memory chunk by chunk, then
+//    unmap and release its physical memory; wake_up() maps it again at the
+//    same address and copies the data back;
+//  - kDiscard: release the physical memory without copying; after wake_up()
+//    the region is mapped at the same address but its contents are undefined;
+//  - kOffloadIncremental: like kOffload, but the host copy is kept after
+//    wake_up() and each chunk carries a dirty mark. Chunks are clean once
+//    restored, and the caller marks what it writes with mark_dirty(); the
+//    next sleep copies only dirty chunks. The price is a host copy that
+//    lives as long as the region, so this suits weights, which do not
+//    change between sleep cycles;
+//  - kSpill: write the region to a checkpoint file in the directory given to
+//    set_spill_directory() and release it; wake_up() reads the file back and
+//    deletes it. For regions too large to keep in host memory;
+//  - kKeep: leave the region mapped.
+// Offloaded chunks that are entirely zero (typical of fresh KV cache) are
+// detected on the host copy, kept as a flag instead of a buffer and restored
+// with a device memset instead of a copy.
+// With set_compression() the other chunks are compressed on worker threads
+// pinned to the GPU's NUMA node: each chunk is copied into one of a few
+// pinned staging buffers, compressed into pageable memory while the next
+// chunk is being copied, and decompressed back through the staging buffers
+// in parallel on wake_up().
+// Only offloaded regions pay for a copy. The VA reservation is never freed,
+// so pointers into a region stay valid across sleep and wake.
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "cumem_allocator_compat.h"
+#include "cumem_checkpoint.h"
+#include "cumem_compress.h"
+#include "cumem_worker_pool.h"
+
+enum class SleepAction { kKeep, kOffload, kOffloadIncremental, kDiscard, kSpill };
+
+struct SleepStats {
+  size_t regions_offloaded;
+  size_t regions_discarded;
+  size_t regions_kept;
+  size_t regions_spilled;
+  size_t bytes_copied;  // Device to host in sleep(), host to device in wake_up()
+  size_t bytes_skipped;  // Clean chunks whose retained host copy was reused
+  size_t bytes_zero;  // Zero chunks found in sleep(), memset instead of copied in wake_up()
+  // Host bytes holding the non-zero chunks copied in sleep(); below
+  // bytes_copied - bytes_zero when compression is on
+  size_t bytes_stored;
+  // Dirty chunks whose fingerprint matched the old host copy, i.e. chunks
+  // that were marked dirty but had not actually changed
+  size_t chunks_unchanged;
+  size_t bytes_spilled;  // Written to spill files in sleep(), read back in wake_up()
+  double seconds;
+};
+
+class SleepManager {
+ public:
+  SleepManager();
+  // Releases host copies; regions that are still asleep stay unmapped
+  ~SleepManager();
+
+  SleepManager(const SleepManager&) = delete;
+  SleepManager& operator=(const SleepManager&) = delete;
+
+  // Register a mapped region. The handle and chunk size arrays stay owned by
+  // the caller and must outlive the registration.
+  bool add_region(const std::string& tag, unsigned long long device, CUdeviceptr d_mem, size_t size,
+                  CUmemGenericAllocationHandle** p_memHandle, unsigned long long* chunk_sizes,
+                  size_t num_chunks);
+  // Forget a region; fails while the region is asleep
+  bool remove_region(CUdeviceptr d_mem);
+
+  // Apply actions[tag] to every awake region, default_action to tags that
+  // are not listed. Returns false if any region failed; the regions that did
+  // go to sleep can still be woken.
+  bool sleep(const std::map<std::string, SleepAction>& actions, SleepAction default_action,
+             SleepStats* stats);
+  // Map every sleeping region again and restore the offloaded ones
+  bool wake_up(SleepStats* stats);
+
+  bool is_asleep(CUdeviceptr d_mem) const;
+
+  // Compress offloaded chunks with codec on num_threads workers per NUMA
+  // node (kNone turns compression off). Staging takes num_threads + 2 pinned
+  // buffers of one chunk each. Chunks already offloaded keep their codec.
+  void set_compression(CompressionCodec codec, size_t num_threads);
+
+  // Directory for kSpill files, ideally on local NVMe
+  void set_spill_directory(const std::string& directory);
+  // Pinned slabs to stream spill files through instead of allocating
+  // buffers for every spill and read-back; null (the default) allocates.
+  // The pool must outlive the manager.
+  void set_staging_pool(StagingPool* pool);
+
+  // Mark the chunks overlapping [ptr, ptr + size) of an awake region as
+  // modified so that the next incremental offload copies them again
+  bool mark_dirty(CUdeviceptr ptr, size_t size);
+
+ private:
+  // Host copy of one chunk
+  struct ChunkCopy {
+    void* host;  // Null if there is no copy or the chunk is all zeros
+    size_t stored_size;  // Bytes at host
+    bool pinned;  // host is a raw hipHostMalloc copy, otherwise malloc'd
+    CompressionCodec codec;  // How host is encoded
+    bool dirty;  // Host copy is stale
+    bool zero;  // All zeros, no host buffer
+    uint64_t fingerprint;  // Hash of the raw chunk, for incremental offloads
+  };
+
+  struct Region {
+    std::string tag;
+    unsigned long long device;
+    CUdeviceptr d_mem;
+    size_t size;
+    CUmemGenericAllocationHandle** p_memHandle;
+    unsigned long long* chunk_sizes;
+    size_t num_chunks;
+    bool asleep;
+    bool retain_host_copy;  // Offloaded with kOffloadIncremental
+    std::vector<ChunkCopy> chunks;  // Empty if there is no host copy
+    std::string spill_path;  // Set while the region is spilled
+  };
+
+  bool offload_region(Region& region, bool incremental, SleepStats* stats);
+  bool offload_region_compressed(Region& region, bool incremental, SleepStats* stats);
+  bool restore_region(Region& region, SleepStats* stats);
+  bool spill_region(Region& region, SleepStats* stats);
+  bool unspill_region(Region& region, SleepStats* stats);
+  static bool store_chunk(ChunkCopy& chunk, const void* data, size_t size, bool incremental,
+                          CompressionCodec codec);
+  static void release_copy(ChunkCopy& chunk);
+  static void free_host_chunks(Region& region);
+  WorkerPool& pool_for(unsigned long long device);
+  bool ensure_staging(size_t count, size_t size);
+
+  mutable std::mutex mutex_;
+  std::map<uintptr_t, Region> regions_;
+
+  CompressionCodec codec_;
+  size_t compression_threads_;
+  std::map<int, std::unique_ptr<WorkerPool>> pools_;  // By NUMA node
+  std::vector<void*> staging_;  // Pinned, staging_size_ bytes each
+  size_t staging_size_;
+
+  std::string spill_directory_;
+  StagingPool* spill_staging_pool_;
+};
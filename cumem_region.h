@@ -0,0 +1,55 @@
+#pragma once
+
+// Resizing of regions built by create_and_map. A region is a run of chunks
+// mapped back to back from d_mem; its VA may be backed by several adjacent
+// reservations once it has been grown in place, so the reservations are
+// tracked alongside the chunk table and every one of them must be freed.
+
+#include <vector>
+
+#include "cumem_allocator_compat.h"
+
+struct RegionReservation {
+  CUdeviceptr ptr;
+  size_t size;
+};
+
+// Grow a mapped region from old_num_chunks to new_num_chunks chunks without
+// copying any data. The caller has already grown p_memHandle and chunk_sizes
+// to new_num_chunks entries and filled in the new chunk sizes. If the VA right
+// after the region is free it is reserved and the new chunks are mapped there;
+// otherwise a larger range is reserved, the existing physical handles are
+// remapped into it at the same offsets and the old range is freed. *p_d_mem
+// and reservations are updated, and *p_moved (if non-null) tells the caller
+// whether pointers into the region must be rebased. Extensions are only made
+// where every new chunk lies within one reservation; the region moves instead.
+// On failure the region keeps its old chunks, but *p_moved is still set if it
+// was moved before the new chunks failed, and *p_d_mem is then its new address.
+bool grow_region(unsigned long long device, CUdeviceptr* p_d_mem,
+                 std::vector<RegionReservation>* reservations, size_t granularity,
+                 CUmemGenericAllocationHandle** p_memHandle,
+                 unsigned long long* chunk_sizes, size_t old_num_chunks,
+                 size_t new_num_chunks, bool* p_moved);
+
+// Shrink a mapped region to its first new_num_chunks chunks, unmapping and
+// releasing the tail. Reservations that lie entirely past the new end are
+// freed; the rest of the VA stays reserved so a later grow can reuse it.
+bool shrink_region(unsigned long long device, CUdeviceptr d_mem,
+                   std::vector<RegionReservation>* reservations,
+                   CUmemGenericAllocationHandle** p_memHandle,
+                   unsigned long long* chunk_sizes, size_t old_num_chunks,
+                   size_t new_num_chunks);
+
+// Create num_chunks handles on device and map them back to back from base,
+// then grant the device access to the new range. Undoes its own work and
+// returns false on failure.
+bool create_and_map_chunks(unsigned long long device, CUdeviceptr base,
+                           CUmemGenericAllocationHandle** p_memHandle,
+                           unsigned long long* chunk_sizes, size_t num_chunks);
+
+// Move mapped chunks from old_base to new_base by unmapping them and mapping
+// the same physical handles again; no device data is copied. The two ranges
+// may overlap. On failure the chunks are mapped back at old_base.
+bool remap_chunks(unsigned long long device, CUdeviceptr old_base, CUdeviceptr new_base,
+                  CUmemGenericAllocationHandle** p_memHandle,
+                  unsigned long long* chunk_sizes, size_t num_chunks);
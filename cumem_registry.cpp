@@ -0,0 +1,106 @@
+// Sharded pointer-to-allocation registry
+#include "cumem_registry.h"
+
+bool AllocationRegistry::insert(uintptr_t base, size_t size, void* data) {
+  if (size == 0) {
+    return false;
+  }
+  Entry entry = {base, size, data};
+  {
+    ExactShard& shard = exact_[shard_of(base)];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (!shard.entries.emplace(base, entry).second) {
+      return false;
+    }
+  }
+  if (!interior_lookups_) {
+    return true;
+  }
+
+  uintptr_t last_bucket = (base + size - 1) >> kBucketShift;
+  for (uintptr_t bucket = base >> kBucketShift; bucket <= last_bucket; ++bucket) {
+    IntervalShard& shard = intervals_[shard_of(bucket)];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.buckets[bucket][base] = entry;
+  }
+  return true;
+}
+
+bool AllocationRegistry::erase(uintptr_t base, Entry* entry) {
+  Entry erased;
+  {
+    ExactShard& shard = exact_[shard_of(base)];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.entries.find(base);
+    if (it == shard.entries.end()) {
+      return false;
+    }
+    erased = it->second;
+    shard.entries.erase(it);
+  }
+  if (entry) {
+    *entry = erased;
+  }
+  if (!interior_lookups_) {
+    return true;
+  }
+
+  uintptr_t last_bucket = (base + erased.size - 1) >> kBucketShift;
+  for (uintptr_t bucket = base >> kBucketShift; bucket <= last_bucket; ++bucket) {
+    IntervalShard& shard = intervals_[shard_of(bucket)];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.buckets.find(bucket);
+    if (it != shard.buckets.end()) {
+      it->second.erase(base);
+      if (it->second.empty()) {
+        shard.buckets.erase(it);
+      }
+    }
+  }
+  return true;
+}
+
+bool AllocationRegistry::find(uintptr_t base, Entry* entry) const {
+  const ExactShard& shard = exact_[shard_of(base)];
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto it = shard.entries.find(base);
+  if (it == shard.entries.end()) {
+    return false;
+  }
+  *entry = it->second;
+  return true;
+}
+
+bool AllocationRegistry::find_containing(uintptr_t ptr, Entry* entry) const {
+  if (!interior_lookups_) {
+    return false;
+  }
+  uintptr_t bucket = ptr >> kBucketShift;
+  const IntervalShard& shard = intervals_[shard_of(bucket)];
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto bucket_it = shard.buckets.find(bucket);
+  if (bucket_it == shard.buckets.end()) {
+    return false;
+  }
+  // Allocations never overlap, so only the last one starting at or before
+  // ptr can contain it
+  auto it = bucket_it->second.upper_bound(ptr);
+  if (it == bucket_it->second.begin()) {
+    return false;
+  }
+  --it;
+  if (ptr - it->second.base >= it->second.size) {
+    return false;
+  }
+  *entry = it->second;
+  return true;
+}
+
+size_t AllocationRegistry::size() const {
+  size_t count = 0;
+  for (const ExactShard& shard : exact_) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    count += shard.entries.size();
+  }
+  return count;
+}
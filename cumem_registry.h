@@ -0,0 +1,69 @@
+#pragma once
+
+// Concurrent pointer-to-allocation registry. A pluggable allocator's free
+// call only gets a pointer, so something has to map it back to the region's
+// metadata (DeviceMemory, chunk table, size) without a global lock.
+//
+// Two sharded indexes, each shard with its own lock:
+//  - an exact index keyed by base address, so the common free(base) lookup is
+//    a single hash probe in one shard;
+//  - an interval index for interior pointers. The address space is cut into
+//    1GB buckets and every allocation is listed in each bucket it overlaps
+//    (120 buckets for a 120GB region), ordered by base, so a lookup is one
+//    bucket probe plus one ordered search among that bucket's allocations.
+// Threads touching different allocations almost never share a shard.
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+class AllocationRegistry {
+ public:
+  struct Entry {
+    uintptr_t base;
+    size_t size;
+    void* data;  // Caller's metadata, e.g. the DeviceMemory
+  };
+
+  static const size_t kNumShards = 64;
+  static const unsigned kBucketShift = 30;
+
+  // Without interior_lookups only the exact index is kept, and
+  // find_containing() always fails
+  explicit AllocationRegistry(bool interior_lookups = true) : interior_lookups_(interior_lookups) {}
+  AllocationRegistry(const AllocationRegistry&) = delete;
+  AllocationRegistry& operator=(const AllocationRegistry&) = delete;
+
+  // Returns false if base is already registered or size is 0
+  bool insert(uintptr_t base, size_t size, void* data);
+  // Removes the allocation starting at base, copying it to *entry if non-null
+  bool erase(uintptr_t base, Entry* entry = nullptr);
+  // Lookup by base address
+  bool find(uintptr_t base, Entry* entry) const;
+  // Lookup of any pointer inside [base, base + size)
+  bool find_containing(uintptr_t ptr, Entry* entry) const;
+  size_t size() const;
+
+ private:
+  struct alignas(64) ExactShard {
+    mutable std::mutex mutex;
+    std::unordered_map<uintptr_t, Entry> entries;
+  };
+
+  struct alignas(64) IntervalShard {
+    mutable std::mutex mutex;
+    // bucket -> allocations overlapping it, by base
+    std::unordered_map<uintptr_t, std::map<uintptr_t, Entry>> buckets;
+  };
+
+  static size_t shard_of(uintptr_t key) {
+    // Fibonacci hashing; the low bits of bases are mostly zero
+    return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 58) % kNumShards;
+  }
+
+  bool interior_lookups_;
+  ExactShard exact_[kNumShards];
+  IntervalShard intervals_[kNumShards];
+};
@@ -0,0 +1,82 @@
+#pragma once
+
+// Bounded lock-free single-producer/single-consumer ring buffer used to hand
+// chunk indices between the stages of the pipelined create/release paths.
+// Exactly one thread may call push()/close() and exactly one thread may call
+// pop(); neither side ever takes a lock.
+
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+template <typename T>
+class SpscQueue {
+ public:
+  // Capacity is rounded up to a power of two.
+  explicit SpscQueue(size_t capacity) : head_(0), tail_(0), closed_(false) {
+    size_t rounded = 1;
+    while (rounded < capacity) {
+      rounded <<= 1;
+    }
+    buffer_.resize(rounded);
+    mask_ = rounded - 1;
+  }
+
+  SpscQueue(const SpscQueue&) = delete;
+  SpscQueue& operator=(const SpscQueue&) = delete;
+
+  // Producer side. Returns false if the queue is full.
+  bool try_push(const T& value) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) > mask_) {
+      return false;
+    }
+    buffer_[tail & mask_] = value;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Producer side. Spins (yielding) until there is room.
+  void push(const T& value) {
+    while (!try_push(value)) {
+      std::this_thread::yield();
+    }
+  }
+
+  // Producer side. Signals that no more values will be pushed.
+  void close() { closed_.store(true, std::memory_order_release); }
+
+  // Consumer side. Returns false if the queue is currently empty.
+  bool try_pop(T* value) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    *value = buffer_[head & mask_];
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side. Spins (yielding) until a value is available; returns false
+  // once the producer has closed the queue and it has been drained.
+  bool pop(T* value) {
+    while (!try_pop(value)) {
+      if (closed_.load(std::memory_order_acquire)) {
+        // Re-check: the producer may have pushed right before closing.
+        return try_pop(value);
+      }
+      std::this_thread::yield();
+    }
+    return true;
+  }
+
+ private:
+  static constexpr size_t kCacheLine = 64;
+
+  std::vector<T> buffer_;
+  size_t mask_;
+  alignas(kCacheLine) std::atomic<size_t> head_;
+  alignas(kCacheLine) std::atomic<size_t> tail_;
+  alignas(kCacheLine) std::atomic<bool> closed_;
+};
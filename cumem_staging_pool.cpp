@@ -0,0 +1,179 @@
+// NUMA-local pinned staging buffers
+#define USE_ROCM
+
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <hip/hip_runtime.h>
+
+#include "cumem_staging_pool.h"
+
+bool set_cpu_affinity_for_node(int node);
+
+static const size_t kHugePageSize = 2 * 1024 * 1024;
+static const uint64_t kIndexMask = 0xFFFFFFFFull;
+
+StagingPool::StagingPool(size_t slab_size, size_t slabs_per_node, const std::vector<int>& nodes)
+    : slab_size_((slab_size + kHugePageSize - 1) / kHugePageSize * kHugePageSize) {
+  for (int node : nodes) {
+    std::unique_ptr<Arena> arena(new Arena());
+    arena->node = node;
+    arena->slabs = slabs_per_node;
+    arena->bytes = slab_size_ * slabs_per_node;
+    if (slabs_per_node == 0 || !map_arena(arena.get())) {
+      continue;
+    }
+    // Thread every slab onto the free list, lowest address on top
+    arena->next.reset(new std::atomic<uint32_t>[arena->slabs]);
+    for (size_t i = 0; i < arena->slabs; ++i) {
+      arena->next[i].store(i + 1 < arena->slabs ? (uint32_t)(i + 2) : 0, std::memory_order_relaxed);
+    }
+    arena->head.store(1, std::memory_order_relaxed);
+    arena->in_use.store(0, std::memory_order_relaxed);
+    arena->peak_in_use.store(0, std::memory_order_relaxed);
+    arena->acquires.store(0, std::memory_order_relaxed);
+    arena->failed_acquires.store(0, std::memory_order_relaxed);
+    arenas_.push_back(std::move(arena));
+  }
+}
+
+StagingPool::~StagingPool() {
+  for (const std::unique_ptr<Arena>& arena : arenas_) {
+    if (arena->pinned) {
+      hipHostUnregister(arena->base);
+    }
+    munmap(arena->base, arena->bytes);
+  }
+}
+
+bool StagingPool::map_arena(Arena* arena) {
+  void* base = mmap(nullptr, arena->bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                    -1, 0);
+  arena->huge_pages = base != MAP_FAILED;
+  if (base == MAP_FAILED) {
+    // No reserved huge pages: ask for transparent ones instead
+    base = mmap(nullptr, arena->bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+      std::cerr << "Error mapping staging arena for NUMA node " << arena->node << ": " << strerror(errno)
+                << std::endl;
+      return false;
+    }
+    madvise(base, arena->bytes, MADV_HUGEPAGE);
+  }
+  arena->base = static_cast<char*>(base);
+
+  // First touch from the node's CPUs places the pages on that node
+  std::thread toucher([arena]() {
+    set_cpu_affinity_for_node(arena->node);
+    memset(arena->base, 0, arena->bytes);
+  });
+  toucher.join();
+
+  // Where first touch actually put the pages; a mismatch means the node's
+  // memory was full or the thread could not be pinned there
+  int resident_node = -1;
+  if (syscall(SYS_get_mempolicy, &resident_node, nullptr, 0, arena->base, MPOL_F_NODE | MPOL_F_ADDR) != 0) {
+    resident_node = -1;
+  }
+  arena->resident_node = resident_node;
+
+  hipError_t hip_result = hipHostRegister(arena->base, arena->bytes, hipHostRegisterPortable);
+  arena->pinned = hip_result == hipSuccess;
+  if (!arena->pinned) {
+    std::cerr << "Staging arena for NUMA node " << arena->node
+              << " could not be pinned: " << hipGetErrorString(hip_result) << std::endl;
+  }
+  return true;
+}
+
+void* StagingPool::acquire(int node) {
+  Arena* arena = nullptr;
+  for (const std::unique_ptr<Arena>& candidate : arenas_) {
+    if (candidate->node == node) {
+      arena = candidate.get();
+      break;
+    }
+  }
+  if (!arena) {
+    return nullptr;
+  }
+
+  uint64_t head = arena->head.load(std::memory_order_acquire);
+  uint32_t index;
+  for (;;) {
+    index = (uint32_t)(head & kIndexMask);
+    if (index == 0) {
+      arena->failed_acquires.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    // The link may be stale if another thread popped this slab meanwhile;
+    // the tag then makes the exchange fail
+    uint64_t next = arena->next[index - 1].load(std::memory_order_relaxed);
+    uint64_t new_head = (((head >> 32) + 1) << 32) | next;
+    if (arena->head.compare_exchange_weak(head, new_head, std::memory_order_acq_rel,
+                                          std::memory_order_acquire)) {
+      break;
+    }
+  }
+
+  arena->acquires.fetch_add(1, std::memory_order_relaxed);
+  size_t in_use = arena->in_use.fetch_add(1, std::memory_order_relaxed) + 1;
+  size_t peak = arena->peak_in_use.load(std::memory_order_relaxed);
+  while (in_use > peak &&
+         !arena->peak_in_use.compare_exchange_weak(peak, in_use, std::memory_order_relaxed)) {
+  }
+  return arena->base + (size_t)(index - 1) * slab_size_;
+}
+
+void StagingPool::release(void* slab) {
+  char* p = static_cast<char*>(slab);
+  for (const std::unique_ptr<Arena>& arena : arenas_) {
+    if (p < arena->base || p >= arena->base + arena->bytes) {
+      continue;
+    }
+    uint32_t index = (uint32_t)((p - arena->base) / slab_size_) + 1;
+    uint64_t head = arena->head.load(std::memory_order_relaxed);
+    uint64_t new_head;
+    do {
+      arena->next[index - 1].store((uint32_t)(head & kIndexMask), std::memory_order_relaxed);
+      new_head = (((head >> 32) + 1) << 32) | index;
+    } while (!arena->head.compare_exchange_weak(head, new_head, std::memory_order_release,
+                                                std::memory_order_relaxed));
+    arena->in_use.fetch_sub(1, std::memory_order_relaxed);
+    return;
+  }
+  std::cerr << "Released a slab that does not belong to the staging pool" << std::endl;
+}
+
+bool StagingPool::owns(const void* p) const {
+  const char* c = static_cast<const char*>(p);
+  for (const std::unique_ptr<Arena>& arena : arenas_) {
+    if (c >= arena->base && c < arena->base + arena->bytes) {
+      return true;
+    }
+  }
+  return false;
+}
+
+std::vector<StagingPoolStats> StagingPool::stats() const {
+  std::vector<StagingPoolStats> result;
+  for (const std::unique_ptr<Arena>& arena : arenas_) {
+    StagingPoolStats stats;
+    stats.node = arena->node;
+    stats.slabs = arena->slabs;
+    stats.in_use = arena->in_use.load(std::memory_order_relaxed);
+    stats.peak_in_use = arena->peak_in_use.load(std::memory_order_relaxed);
+    stats.acquires = arena->acquires.load(std::memory_order_relaxed);
+    stats.failed_acquires = arena->failed_acquires.load(std::memory_order_relaxed);
+    stats.huge_pages = arena->huge_pages;
+    stats.pinned = arena->pinned;
+    stats.resident_node = arena->resident_node;
+    result.push_back(stats);
+  }
+  return result;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+// NUMA-local pinned staging buffers.
+//
+// At construction the pool maps one arena per NUMA node, preferably from
+// 2MB huge pages (MAP_HUGETLB, else transparent huge pages), faults it in
+// from a thread pinned to that node so the pages are node-local, and
+// registers it with hipHostRegister. Arenas are cut into fixed-size slabs
+// handed out through a lock-free free list per node (a Treiber stack of
+// slab indices with an ABA tag), so acquire() and release() never allocate
+// or lock; a node whose slabs are all in use makes acquire() return null
+// rather than grow.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+struct StagingPoolStats {
+  int node;
+  size_t slabs;
+  size_t in_use;
+  size_t peak_in_use;
+  size_t acquires;
+  size_t failed_acquires;  // acquire() found no free slab
+  bool huge_pages;  // Backed by MAP_HUGETLB pages rather than THP or 4KB pages
+  bool pinned;  // Registered for DMA
+  int resident_node;  // Node the arena's first page landed on, -1 if unknown
+};
+
+class StagingPool {
+ public:
+  // slab_size is rounded up to a multiple of 2MB
+  StagingPool(size_t slab_size, size_t slabs_per_node, const std::vector<int>& nodes);
+  ~StagingPool();
+
+  StagingPool(const StagingPool&) = delete;
+  StagingPool& operator=(const StagingPool&) = delete;
+
+  // A free slab on node, or null if there is none (or no arena for node)
+  void* acquire(int node);
+  // Return a slab obtained from acquire()
+  void release(void* slab);
+  // Whether p lies in one of the pool's arenas
+  bool owns(const void* p) const;
+
+  size_t slab_size() const { return slab_size_; }
+  std::vector<StagingPoolStats> stats() const;
+
+ private:
+  struct Arena {
+    int node;
+    char* base;
+    size_t bytes;
+    size_t slabs;
+    bool huge_pages;
+    bool pinned;
+    int resident_node;
+    std::unique_ptr<std::atomic<uint32_t>[]> next;  // Free list link per slab, index + 1
+    // Free list top: ABA tag in the high 32 bits, slab index + 1 in the low
+    // 32 bits (0 when empty)
+    std::atomic<uint64_t> head;
+    // Keeps the counters off the free list's cache line. Arenas are heap
+    // allocated, where C++14 does not honour alignas beyond 16 bytes.
+    char head_padding[64];
+    std::atomic<size_t> in_use;
+    std::atomic<size_t> peak_in_use;
+    std::atomic<size_t> acquires;
+    std::atomic<size_t> failed_acquires;
+  };
+
+  bool map_arena(Arena* arena);
+
+  size_t slab_size_;
+  std::vector<std::unique_ptr<Arena>> arenas_;
+};
@@ -4,23 +4,69 @@
 #include <iostream>
 #include <hip/hip_runtime.h>
 #include <unistd.h>
+#include <sys/wait.h>
+#include <fcntl.h>
 #include <vector>
 #include <string>
 #include <chrono>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <random>
+#include <map>
+#include <mutex>
+#include <cstring>
+#include <memory>
 
 // Include the compatibility header from local directory
 #include "cumem_allocator_compat.h"
+#include "cumem_region.h"
+#include "cumem_device_pool.h"
+#include "cumem_caching_allocator.h"
+#include "cumem_registry.h"
+#include "cumem_offload.h"
+#include "cumem_checkpoint.h"
+#include "cumem_io_engine.h"
+#include "cumem_mapped_restore.h"
+#include "cumem_broadcast.h"
+#include "cumem_staging_pool.h"
+#include "cumem_copy_engine.h"
+#include "cumem_admission.h"
+#include "cumem_alloc_planner.h"
 
 // Function prototypes from cumem_allocator.cpp
 void create_and_map(unsigned long long device, ssize_t size, CUdeviceptr d_mem,
                     CUmemGenericAllocationHandle** p_memHandle,
                     unsigned long long* chunk_sizes, size_t num_chunks);
 
+bool create_and_map_pipelined(unsigned long long device, ssize_t size, CUdeviceptr d_mem,
+                              CUmemGenericAllocationHandle** p_memHandle,
+                              unsigned long long* chunk_sizes, size_t num_chunks,
+                              std::atomic<unsigned long long>* p_usable_bytes,
+                              unsigned long long access_window,
+                              size_t* p_set_access_calls = nullptr);
+
+bool create_and_map_striped(const unsigned long long* devices, const unsigned int* weights,
+                            size_t num_devices, ssize_t size, CUdeviceptr d_mem,
+                            CUmemGenericAllocationHandle** p_memHandle,
+                            unsigned long long* chunk_sizes, size_t num_chunks,
+                            unsigned long long* chunk_devices);
+
 void unmap_and_release(unsigned long long device, ssize_t size, CUdeviceptr d_mem,
                        CUmemGenericAllocationHandle** p_memHandle,
-                       unsigned long long* chunk_sizes, size_t num_chunks);
+                       unsigned long long* chunk_sizes, size_t num_chunks,
+                       size_t* p_saved_calls = nullptr);
+
+void unmap_and_release_pipelined(unsigned long long device, ssize_t size, CUdeviceptr d_mem,
+                                 CUmemGenericAllocationHandle** p_memHandle,
+                                 unsigned long long* chunk_sizes, size_t num_chunks);
+
+bool set_peer_access(unsigned long long device, ssize_t size, CUdeviceptr d_mem,
+                     const unsigned long long* peer_devices, size_t num_peers,
+                     bool read_only);
 
 void ensure_context(unsigned long long device);
+int get_numa_node_for_gpu(unsigned long long device);
 
 // Helper function to get memory allocation granularity
 size_t get_memory_granularity(unsigned long long device) {
@@ -70,10 +116,13 @@ struct DeviceMemory {
     CUdeviceptr d_mem;
     CUmemGenericAllocationHandle** p_memHandle;
     unsigned long long* chunk_sizes;
+    unsigned long long* chunk_devices;  // Owning device per chunk, null unless striped
     size_t num_chunks;
+    std::vector<RegionReservation> reservations;  // VA reservations backing d_mem
     bool allocated;
 
-    DeviceMemory() : allocated(false) {}
+    DeviceMemory()
+        : p_memHandle(nullptr), chunk_sizes(nullptr), chunk_devices(nullptr), num_chunks(0), allocated(false) {}
 
     ~DeviceMemory() {
         if (p_memHandle) {
@@ -87,11 +136,21 @@ struct DeviceMemory {
         if (chunk_sizes) {
             free(chunk_sizes);
         }
+        if (chunk_devices) {
+            free(chunk_devices);
+        }
     }
 };
 
-// Allocate memory on a specific device
-bool allocate_device_memory(DeviceMemory& mem, size_t size, size_t granularity, bool verify = true) {
+// Live regions by address, so a bare pointer can be mapped back to its
+// DeviceMemory
+AllocationRegistry g_allocations;
+
+// NUMA-local pinned buffers for verifying new regions, set up by main
+StagingPool* g_staging_pool = nullptr;
+
+// Reserve the address range for a device and lay out its chunk table
+bool reserve_device_memory(DeviceMemory& mem, size_t size, size_t granularity) {
     // Align the size
     mem.size = size;
     mem.alignedSize = ((size + granularity - 1) / granularity) * granularity;
@@ -105,6 +164,7 @@ bool allocate_device_memory(DeviceMemory& mem, size_t size, size_t granularity,
                   << ": " << error_str << std::endl;
         return false;
     }
+    mem.reservations.assign(1, RegionReservation{mem.d_mem, mem.alignedSize});
     
     // Define chunk sizes for ROCM (AMD) implementation
     // Use 128MB chunks for better management of large memory
@@ -122,167 +182,2317 @@ bool allocate_device_memory(DeviceMemory& mem, size_t size, size_t granularity,
         mem.chunk_sizes[i] = (i == mem.num_chunks - 1) ? 
             (mem.alignedSize - (mem.num_chunks - 1) * aligned_chunk_size) : aligned_chunk_size;
     }
+    return true;
+}
+
+// Create and map a reserved region with create_and_map_pipelined on a worker
+// thread, watching the usable-bytes watermark to time how early the low part
+// of the region becomes usable. Returns false if the region could not be
+// built; create_and_map_pipelined has already rolled it back in that case.
+bool create_and_map_timed(DeviceMemory& mem, unsigned long long access_window,
+                          double* first_usable_seconds, double* total_seconds,
+                          size_t* set_access_calls = nullptr) {
+    std::atomic<unsigned long long> usable_bytes(0);
+    std::atomic<bool> done(false);
+    bool ok = false;
+    auto start_time = std::chrono::high_resolution_clock::now();
+    std::thread worker([&]() {
+        ok = create_and_map_pipelined(mem.device, mem.alignedSize, mem.d_mem, mem.p_memHandle,
+                                      mem.chunk_sizes, mem.num_chunks, &usable_bytes, access_window,
+                                      set_access_calls);
+        done.store(true, std::memory_order_release);
+    });
+    while (usable_bytes.load(std::memory_order_acquire) == 0 && !done.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+    }
+    std::chrono::duration<double> first_usable_time = std::chrono::high_resolution_clock::now() - start_time;
+    worker.join();
+    std::chrono::duration<double> total_time = std::chrono::high_resolution_clock::now() - start_time;
     
-    // Call create_and_map
-    create_and_map(mem.device, mem.alignedSize, mem.d_mem, mem.p_memHandle, mem.chunk_sizes, mem.num_chunks);
-    
-    // Verify memory is accessible (optional)
-    if (verify) {
-        // Test with a small amount of data (1MB)
-        const size_t test_size = 1 * 1024 * 1024;
-        int* h_data = new int[test_size / sizeof(int)];
-        for (size_t i = 0; i < test_size / sizeof(int); i++) {
-            h_data[i] = i & 0xFF;
+    *first_usable_seconds = first_usable_time.count();
+    *total_seconds = total_time.count();
+    return ok && usable_bytes.load() == mem.alignedSize;
+}
+
+// Write a 1MB pattern at the start of the region and read it back, staged
+// through two slabs on the device's NUMA node
+bool verify_region_head(const DeviceMemory& mem) {
+    const size_t test_size = 1 * 1024 * 1024;
+    int node = get_numa_node_for_gpu(mem.device);
+    int* h_data = g_staging_pool ? (int*)g_staging_pool->acquire(node) : nullptr;
+    int* h_result = g_staging_pool ? (int*)g_staging_pool->acquire(node) : nullptr;
+    auto release_staging = [&]() {
+        if (h_data) {
+            g_staging_pool->release(h_data);
         }
-        
-        hipError_t hip_result = hipMemcpy((void*)mem.d_mem, h_data, test_size, hipMemcpyHostToDevice);
-        if (hip_result != hipSuccess) {
-            std::cerr << "Error copying to device " << mem.device 
-                      << " memory: " << hipGetErrorString(hip_result) << std::endl;
-            delete[] h_data;
-            return false;
+        if (h_result) {
+            g_staging_pool->release(h_result);
         }
-        
-        int* h_result = new int[test_size / sizeof(int)];
-        hip_result = hipMemcpy(h_result, (void*)mem.d_mem, test_size, hipMemcpyDeviceToHost);
-        if (hip_result != hipSuccess) {
-            std::cerr << "Error copying from device " << mem.device 
-                      << " memory: " << hipGetErrorString(hip_result) << std::endl;
-            delete[] h_data;
-            delete[] h_result;
-            return false;
+    };
+    if (!h_data || !h_result || g_staging_pool->slab_size() < test_size) {
+        std::cerr << "No staging slabs free on NUMA node " << node << " to verify device " << mem.device
+                  << std::endl;
+        release_staging();
+        return false;
+    }
+    for (size_t i = 0; i < test_size / sizeof(int); i++) {
+        h_data[i] = i & 0xFF;
+    }
+    
+    hipError_t hip_result = hipMemcpy((void*)mem.d_mem, h_data, test_size, hipMemcpyHostToDevice);
+    if (hip_result != hipSuccess) {
+        std::cerr << "Error copying to device " << mem.device 
+                  << " memory: " << hipGetErrorString(hip_result) << std::endl;
+        release_staging();
+        return false;
+    }
+    
+    hip_result = hipMemcpy(h_result, (void*)mem.d_mem, test_size, hipMemcpyDeviceToHost);
+    if (hip_result != hipSuccess) {
+        std::cerr << "Error copying from device " << mem.device 
+                  << " memory: " << hipGetErrorString(hip_result) << std::endl;
+        release_staging();
+        return false;
+    }
+    
+    bool data_correct = true;
+    for (size_t i = 0; i < test_size / sizeof(int); i++) {
+        if (h_data[i] != h_result[i]) {
+            std::cerr << "Device " << mem.device << " data verification failed at index " 
+                      << i << ": expected " << h_data[i] << ", got " << h_result[i] << std::endl;
+            data_correct = false;
+            break;
         }
-        
-        bool data_correct = true;
-        for (size_t i = 0; i < test_size / sizeof(int); i++) {
-            if (h_data[i] != h_result[i]) {
-                std::cerr << "Device " << mem.device << " data verification failed at index " 
-                          << i << ": expected " << h_data[i] << ", got " << h_result[i] << std::endl;
-                data_correct = false;
+    }
+    
+    release_staging();
+    return data_correct;
+}
+
+// Bytes written and read back per sample by verify_region_sampled
+const size_t kVerifySampleSize = 4096;
+
+// Contents of one verification sample. Every sample of every chunk gets its
+// own tag, so two chunks mapped onto the same memory overwrite each other's
+// samples and fail the check.
+void fill_verify_sample(uint64_t* words, size_t chunk, size_t sample) {
+    uint64_t tag = ((uint64_t)chunk << 32) | sample;
+    for (size_t i = 0; i < kVerifySampleSize / sizeof(uint64_t); i++) {
+        words[i] = tag ^ (i * 0x9E3779B97F4A7C15ULL);
+    }
+}
+
+// Check samples_per_chunk pages of every chunk: each chunk is cut into
+// samples_per_chunk equal strata and one page-aligned sample is drawn at a
+// random offset in each. All samples are written first and read back
+// afterwards, in batches of async copies that fill a staging slab, with one
+// stream synchronization per batch.
+bool verify_region_sampled(const DeviceMemory& mem, size_t samples_per_chunk) {
+    auto start_time = std::chrono::high_resolution_clock::now();
+    int node = get_numa_node_for_gpu(mem.device);
+    char* slab = g_staging_pool ? (char*)g_staging_pool->acquire(node) : nullptr;
+    if (!slab) {
+        std::cerr << "No staging slab free on NUMA node " << node << " to verify device " << mem.device
+                  << std::endl;
+        return false;
+    }
+    const size_t batch_samples = g_staging_pool->slab_size() / kVerifySampleSize;
+    
+    // Sample offsets in the region, with the chunk and index that tag them
+    struct Sample {
+        uintptr_t offset;
+        size_t chunk;
+        size_t index;
+    };
+    std::vector<Sample> samples;
+    std::mt19937_64 rng(mem.device);
+    uintptr_t chunk_offset = 0;
+    for (size_t c = 0; c < mem.num_chunks; c++) {
+        size_t pages = mem.chunk_sizes[c] / kVerifySampleSize;
+        size_t n = std::min(samples_per_chunk, pages);
+        for (size_t s = 0; s < n; s++) {
+            size_t first_page = pages * s / n;
+            size_t stratum_pages = pages * (s + 1) / n - first_page;
+            size_t page = first_page + rng() % stratum_pages;
+            samples.push_back(Sample{chunk_offset + page * kVerifySampleSize, c, s});
+        }
+        chunk_offset += mem.chunk_sizes[c];
+    }
+    
+    hipSetDevice(mem.device);
+    hipStream_t stream = nullptr;
+    hipError_t hip_result = hipStreamCreateWithFlags(&stream, hipStreamNonBlocking);
+    bool ok = hip_result == hipSuccess;
+    for (int pass = 0; pass < 2 && ok; pass++) {
+        bool write = pass == 0;
+        for (size_t first = 0; first < samples.size() && ok; first += batch_samples) {
+            size_t count = std::min(batch_samples, samples.size() - first);
+            for (size_t j = 0; j < count && hip_result == hipSuccess; j++) {
+                const Sample& sample = samples[first + j];
+                char* host = slab + j * kVerifySampleSize;
+                void* device = (void*)((uintptr_t)mem.d_mem + sample.offset);
+                if (write) {
+                    fill_verify_sample((uint64_t*)host, sample.chunk, sample.index);
+                    hip_result = hipMemcpyAsync(device, host, kVerifySampleSize, hipMemcpyHostToDevice, stream);
+                } else {
+                    hip_result = hipMemcpyAsync(host, device, kVerifySampleSize, hipMemcpyDeviceToHost, stream);
+                }
+            }
+            // The slab is refilled by the next batch, so its copies must be done
+            if (hip_result == hipSuccess) {
+                hip_result = hipStreamSynchronize(stream);
+            }
+            if (hip_result != hipSuccess) {
+                std::cerr << "Error " << (write ? "writing" : "reading") << " verification samples on device "
+                          << mem.device << ": " << hipGetErrorString(hip_result) << std::endl;
+                ok = false;
                 break;
             }
+            if (write) {
+                continue;
+            }
+            uint64_t expected[kVerifySampleSize / sizeof(uint64_t)];
+            for (size_t j = 0; j < count; j++) {
+                const Sample& sample = samples[first + j];
+                fill_verify_sample(expected, sample.chunk, sample.index);
+                if (memcmp(slab + j * kVerifySampleSize, expected, kVerifySampleSize) != 0) {
+                    std::cerr << "Device " << mem.device << " verification failed in chunk " << sample.chunk
+                              << " at offset " << sample.offset << std::endl;
+                    ok = false;
+                    break;
+                }
+            }
         }
-        
-        delete[] h_data;
-        delete[] h_result;
-        
+    }
+    if (stream) {
+        hipStreamDestroy(stream);
+    }
+    g_staging_pool->release(slab);
+    
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+    if (ok) {
+        std::cout << "Device " << mem.device << ": verified " << samples.size() << " samples of "
+                  << format_size(kVerifySampleSize) << " across " << mem.num_chunks << " chunks ("
+                  << format_size(samples.size() * kVerifySampleSize) << ") in " << elapsed.count() << " s"
+                  << std::endl;
+    }
+    return ok;
+}
+
+// Allocate memory on a specific device. verify_samples selects how a
+// verified region is checked: 0 writes and reads back its first 1MB,
+// otherwise verify_region_sampled checks that many samples in every chunk.
+bool allocate_device_memory(DeviceMemory& mem, size_t size, size_t granularity, bool verify = true,
+                            bool pipelined = false, unsigned long long access_window = 0,
+                            size_t verify_samples = 0) {
+    if (!reserve_device_memory(mem, size, granularity)) {
+        return false;
+    }
+    
+    if (pipelined) {
+        double first_usable_seconds, total_seconds;
+        if (!create_and_map_timed(mem, access_window, &first_usable_seconds, &total_seconds)) {
+            std::cerr << "Pipelined create failed on device " << mem.device << std::endl;
+            cuMemAddressFree(mem.d_mem, mem.alignedSize);
+            return false;
+        }
+        std::cout << "Device " << mem.device << ": first bytes usable after " << first_usable_seconds
+                  << " s, " << format_size(mem.alignedSize) << " usable after "
+                  << total_seconds << " s" << std::endl;
+    } else {
+        // Call create_and_map
+        create_and_map(mem.device, mem.alignedSize, mem.d_mem, mem.p_memHandle, mem.chunk_sizes, mem.num_chunks);
+    }
+    
+    // Verify memory is accessible (optional)
+    if (verify) {
+        bool data_correct = verify_samples != 0 ? verify_region_sampled(mem, verify_samples)
+                                                : verify_region_head(mem);
         if (!data_correct) {
             return false;
         }
     }
     
     mem.allocated = true;
+    g_allocations.insert((uintptr_t)mem.d_mem, mem.alignedSize, &mem);
     return true;
 }
 
 // Free memory on a specific device
-bool free_device_memory(DeviceMemory& mem) {
+bool free_device_memory(DeviceMemory& mem, bool pipelined = false) {
     if (!mem.allocated) {
         return true;
     }
+    g_allocations.erase((uintptr_t)mem.d_mem);
     
-    unmap_and_release(mem.device, mem.alignedSize, mem.d_mem, mem.p_memHandle, mem.chunk_sizes, mem.num_chunks);
+    if (pipelined) {
+        unmap_and_release_pipelined(mem.device, mem.alignedSize, mem.d_mem, mem.p_memHandle,
+                                    mem.chunk_sizes, mem.num_chunks);
+    } else {
+        size_t saved_calls = 0;
+        unmap_and_release(mem.device, mem.alignedSize, mem.d_mem, mem.p_memHandle, mem.chunk_sizes, mem.num_chunks,
+                          &saved_calls);
+        std::cout << "Device " << mem.device << ": bulk unmap saved " << saved_calls
+                  << " of " << mem.num_chunks << " cuMemUnmap calls" << std::endl;
+    }
     
-    // Free the address
-    CUresult result = cuMemAddressFree(mem.d_mem, mem.alignedSize);
-    if (result != CUDA_SUCCESS) {
-        const char* error_str;
-        cuGetErrorString(result, &error_str);
-        std::cerr << "Error freeing memory address for device " << mem.device 
-                  << ": " << error_str << std::endl;
-        return false;
+    // Free the address, which may span several reservations after a resize
+    for (const RegionReservation& reservation : mem.reservations) {
+        CUresult result = cuMemAddressFree(reservation.ptr, reservation.size);
+        if (result != CUDA_SUCCESS) {
+            const char* error_str;
+            cuGetErrorString(result, &error_str);
+            std::cerr << "Error freeing memory address for device " << mem.device 
+                      << ": " << error_str << std::endl;
+            return false;
+        }
     }
+    mem.reservations.clear();
     
     mem.allocated = false;
     return true;
 }
 
-int main() {
-    std::cout << "ROCM Memory Mapping Test - Simultaneous Allocation of 120GB on All Devices" << std::endl;
+// Grow or shrink an allocated region to new_size (rounded up to whole
+// granules) by remapping its physical handles; no device data is copied.
+// Growth appends 128MB chunks, shrinking drops whole chunks from the tail.
+bool resize_device_memory(DeviceMemory& mem, size_t new_size, size_t granularity, bool* moved) {
+    *moved = false;
+    size_t new_aligned = ((new_size + granularity - 1) / granularity) * granularity;
+    size_t chunk_size = ((128ULL * 1024 * 1024 + granularity - 1) / granularity) * granularity;
     
-    // Initialize HIP
-    hipError_t hip_result = hipInit(0);
+    if (new_aligned < mem.alignedSize) {
+        size_t keep_chunks = 0;
+        size_t kept_size = 0;
+        while (kept_size < new_aligned) {
+            kept_size += mem.chunk_sizes[keep_chunks++];
+        }
+        if (!shrink_region(mem.device, mem.d_mem, &mem.reservations, mem.p_memHandle, mem.chunk_sizes,
+                           mem.num_chunks, keep_chunks)) {
+            return false;
+        }
+        for (size_t i = keep_chunks; i < mem.num_chunks; i++) {
+            free(mem.p_memHandle[i]);
+            mem.p_memHandle[i] = nullptr;
+        }
+        mem.num_chunks = keep_chunks;
+        mem.size = new_size;
+        mem.alignedSize = kept_size;
+        g_allocations.erase((uintptr_t)mem.d_mem);
+        g_allocations.insert((uintptr_t)mem.d_mem, mem.alignedSize, &mem);
+        return true;
+    }
+    
+    size_t extra = new_aligned - mem.alignedSize;
+    size_t new_num_chunks = mem.num_chunks + (extra + chunk_size - 1) / chunk_size;
+    mem.p_memHandle = (CUmemGenericAllocationHandle**)realloc(
+        mem.p_memHandle, new_num_chunks * sizeof(CUmemGenericAllocationHandle*));
+    mem.chunk_sizes = (unsigned long long*)realloc(mem.chunk_sizes, new_num_chunks * sizeof(unsigned long long));
+    for (size_t i = mem.num_chunks; i < new_num_chunks; i++) {
+        mem.p_memHandle[i] = (CUmemGenericAllocationHandle*)malloc(sizeof(CUmemGenericAllocationHandle));
+        mem.chunk_sizes[i] = std::min(chunk_size, extra);
+        extra -= mem.chunk_sizes[i];
+    }
+    
+    CUdeviceptr old_d_mem = mem.d_mem;
+    bool ok = grow_region(mem.device, &mem.d_mem, &mem.reservations, granularity, mem.p_memHandle,
+                          mem.chunk_sizes, mem.num_chunks, new_num_chunks, moved);
+    if (ok) {
+        mem.num_chunks = new_num_chunks;
+        mem.size = new_size;
+        mem.alignedSize = new_aligned;
+    } else {
+        // The region keeps its old chunks, though it may have moved
+        for (size_t i = mem.num_chunks; i < new_num_chunks; i++) {
+            free(mem.p_memHandle[i]);
+        }
+        mem.p_memHandle = (CUmemGenericAllocationHandle**)realloc(
+            mem.p_memHandle, mem.num_chunks * sizeof(CUmemGenericAllocationHandle*));
+        mem.chunk_sizes = (unsigned long long*)realloc(mem.chunk_sizes, mem.num_chunks * sizeof(unsigned long long));
+    }
+    g_allocations.erase((uintptr_t)old_d_mem);
+    g_allocations.insert((uintptr_t)mem.d_mem, mem.alignedSize, &mem);
+    return ok;
+}
+
+// Sweep the access window of create_and_map_pipelined on one device and report
+// the trade-off between cuMemSetAccess calls and time to first usable byte.
+// A window of 0 grants access to the whole region once everything is mapped.
+void run_access_window_benchmark(unsigned long long device, size_t size, size_t granularity) {
+    const size_t window_chunks[] = {0, 1, 4, 16, 64, 256};
+    
+    std::cout << "\nAccess window benchmark on device " << device << " (" << format_size(size) << ")" << std::endl;
+    std::vector<std::string> rows;
+    for (size_t window : window_chunks) {
+        DeviceMemory mem;
+        mem.device = device;
+        if (!reserve_device_memory(mem, size, granularity)) {
+            return;
+        }
+        unsigned long long access_window = window * mem.chunk_sizes[0];
+        double first_usable_seconds, total_seconds;
+        size_t set_access_calls = 0;
+        char row[200];
+        if (!create_and_map_timed(mem, access_window, &first_usable_seconds, &total_seconds,
+                                  &set_access_calls)) {
+            cuMemAddressFree(mem.d_mem, mem.alignedSize);
+            snprintf(row, sizeof(row), "%12s %16s", window == 0 ? "whole" : format_size(access_window).c_str(),
+                     "failed");
+            rows.push_back(row);
+            continue;
+        }
+        mem.allocated = true;
+        free_device_memory(mem);
+        
+        snprintf(row, sizeof(row), "%12s %16zu %18.6f %12.6f",
+                 window == 0 ? "whole" : format_size(access_window).c_str(), set_access_calls,
+                 first_usable_seconds, total_seconds);
+        rows.push_back(row);
+    }
+    
+    printf("\n%12s %16s %18s %12s\n", "window", "setaccess calls", "first usable (s)", "total (s)");
+    for (const std::string& row : rows) {
+        printf("%s\n", row.c_str());
+    }
+}
+
+// Compare copying a region from one device to another directly over P2P
+// (after set_peer_access) against staging the copy through pinned host memory
+void run_peer_copy_benchmark(unsigned long long src_device, unsigned long long dst_device,
+                             size_t size, size_t src_granularity, size_t dst_granularity) {
+    std::cout << "\nPeer copy benchmark: device " << src_device << " -> device " << dst_device
+              << " (" << format_size(size) << ")" << std::endl;
+    
+    DeviceMemory src, dst;
+    src.device = src_device;
+    dst.device = dst_device;
+    if (!allocate_device_memory(src, size, src_granularity, false)) {
+        std::cerr << "Failed to allocate peer copy source region" << std::endl;
+        return;
+    }
+    if (!allocate_device_memory(dst, size, dst_granularity, false)) {
+        std::cerr << "Failed to allocate peer copy destination region" << std::endl;
+        free_device_memory(src);
+        return;
+    }
+    
+    // Let the destination device read the source region directly
+    if (!set_peer_access(src_device, src.alignedSize, src.d_mem, &dst_device, 1, true)) {
+        free_device_memory(src);
+        free_device_memory(dst);
+        return;
+    }
+    
+    void* h_staging = nullptr;
+    hipError_t hip_result = hipHostMalloc(&h_staging, size, hipHostMallocDefault);
     if (hip_result != hipSuccess) {
-        std::cerr << "Failed to initialize HIP runtime: " << hipGetErrorString(hip_result) << std::endl;
-        return 1;
+        std::cerr << "Failed to allocate pinned staging buffer: " << hipGetErrorString(hip_result) << std::endl;
+        free_device_memory(src);
+        free_device_memory(dst);
+        return;
     }
     
-    // Get device count
-    int deviceCount;
-    hip_result = hipGetDeviceCount(&deviceCount);
+    hipSetDevice(dst_device);
+    
+    double gib = static_cast<double>(size) / (1024.0 * 1024.0 * 1024.0);
+    
+    auto p2p_start = std::chrono::high_resolution_clock::now();
+    hip_result = hipMemcpy((void*)dst.d_mem, (void*)src.d_mem, size, hipMemcpyDeviceToDevice);
+    if (hip_result == hipSuccess) {
+        hip_result = hipDeviceSynchronize();
+    }
+    std::chrono::duration<double> p2p_time = std::chrono::high_resolution_clock::now() - p2p_start;
     if (hip_result != hipSuccess) {
-        std::cerr << "Failed to get device count: " << hipGetErrorString(hip_result) << std::endl;
-        return 1;
+        std::cerr << "P2P copy failed: " << hipGetErrorString(hip_result) << std::endl;
+    } else {
+        std::cout << "P2P copy:         " << p2p_time.count() << " s ("
+                  << gib / p2p_time.count() << " GiB/s)" << std::endl;
     }
     
-    if (deviceCount == 0) {
-        std::cerr << "No HIP devices found" << std::endl;
-        return 1;
+    auto staged_start = std::chrono::high_resolution_clock::now();
+    hip_result = hipMemcpy(h_staging, (void*)src.d_mem, size, hipMemcpyDeviceToHost);
+    if (hip_result == hipSuccess) {
+        hip_result = hipMemcpy((void*)dst.d_mem, h_staging, size, hipMemcpyHostToDevice);
+    }
+    if (hip_result == hipSuccess) {
+        hip_result = hipDeviceSynchronize();
+    }
+    std::chrono::duration<double> staged_time = std::chrono::high_resolution_clock::now() - staged_start;
+    if (hip_result != hipSuccess) {
+        std::cerr << "Host-staged copy failed: " << hipGetErrorString(hip_result) << std::endl;
+    } else {
+        std::cout << "Host-staged copy: " << staged_time.count() << " s ("
+                  << gib / staged_time.count() << " GiB/s)" << std::endl;
     }
     
-    std::cout << "Found " << deviceCount << " HIP device(s)" << std::endl;
+    hipHostFree(h_staging);
+    free_device_memory(src);
+    free_device_memory(dst);
+}
+
+// Allocate one region striped across several devices, check that every chunk
+// is reachable, and report how many chunks each device owns
+bool run_striped_test(const std::vector<unsigned long long>& devices, const std::vector<unsigned int>& weights,
+                      size_t size, size_t granularity) {
+    std::cout << "\nStriping " << format_size(size) << " across " << devices.size() << " device(s)" << std::endl;
     
-    // Limit to 8 devices maximum (0-7)
-    int max_devices = std::min(deviceCount, 8);
+    DeviceMemory mem;
+    mem.device = devices[0];
+    if (!reserve_device_memory(mem, size, granularity)) {
+        return false;
+    }
+    mem.chunk_devices = (unsigned long long*)malloc(mem.num_chunks * sizeof(unsigned long long));
     
-    // Set allocation size to 120GB
-    size_t allocation_size = 120ULL * 1024 * 1024 * 1024;
+    auto start_time = std::chrono::high_resolution_clock::now();
+    if (!create_and_map_striped(devices.data(), weights.empty() ? nullptr : weights.data(), devices.size(),
+                                mem.alignedSize, mem.d_mem, mem.p_memHandle, mem.chunk_sizes,
+                                mem.num_chunks, mem.chunk_devices)) {
+        std::cerr << "Striped allocation failed" << std::endl;
+        cuMemAddressFree(mem.d_mem, mem.alignedSize);
+        return false;
+    }
+    std::chrono::duration<double> alloc_time = std::chrono::high_resolution_clock::now() - start_time;
+    mem.allocated = true;
     
-    // Array to store device memory information
-    std::vector<DeviceMemory> device_memories(max_devices);
+    // Tag the first page of every chunk with its index and read it back
+    const size_t probe_words = 4096 / sizeof(unsigned int);
+    std::vector<unsigned int> h_probe(probe_words), h_check(probe_words);
+    bool data_correct = true;
+    unsigned long long offset = 0;
+    for (size_t i = 0; i < mem.num_chunks && data_correct; i++) {
+        std::fill(h_probe.begin(), h_probe.end(), (unsigned int)i);
+        void* chunk_addr = (void*)((uintptr_t)mem.d_mem + offset);
+        if (hipMemcpy(chunk_addr, h_probe.data(), 4096, hipMemcpyHostToDevice) != hipSuccess ||
+            hipMemcpy(h_check.data(), chunk_addr, 4096, hipMemcpyDeviceToHost) != hipSuccess ||
+            h_probe != h_check) {
+            std::cerr << "Striped chunk " << i << " on device " << mem.chunk_devices[i]
+                      << " failed verification" << std::endl;
+            data_correct = false;
+        }
+        offset += mem.chunk_sizes[i];
+    }
     
-    // First pass: initialize contexts and get granularity for all devices
-    std::vector<size_t> granularities(max_devices);
-    for (int i = 0; i < max_devices; i++) {
-        hipDeviceProp_t deviceProp;
-        hip_result = hipGetDeviceProperties(&deviceProp, i);
-        if (hip_result != hipSuccess) {
-            std::cerr << "Failed to get device properties for device " << i 
-                     << ": " << hipGetErrorString(hip_result) << std::endl;
-            continue;
+    for (unsigned long long device : devices) {
+        size_t owned = std::count(mem.chunk_devices, mem.chunk_devices + mem.num_chunks, device);
+        std::cout << "Device " << device << " owns " << owned << " of " << mem.num_chunks << " chunks" << std::endl;
+    }
+    std::cout << "Striped allocation time: " << alloc_time.count() << " seconds" << std::endl;
+    
+    free_device_memory(mem);
+    return data_correct;
+}
+
+// Compare growing a region by remapping its handles (in place, and with the
+// adjacent VA blocked so the region has to move) against the copy-based
+// approach of allocating a bigger region and copying the data over
+void run_resize_benchmark(unsigned long long device, size_t size, size_t granularity) {
+    std::cout << "\nResize benchmark on device " << device << ": " << format_size(size)
+              << " -> " << format_size(2 * size) << std::endl;
+    
+    for (int blocked = 0; blocked < 2; blocked++) {
+        DeviceMemory mem;
+        mem.device = device;
+        if (!allocate_device_memory(mem, size, granularity, false)) {
+            return;
         }
         
-        std::cout << "Device " << i << ": " << deviceProp.name 
-                  << " (Memory: " << format_size(deviceProp.totalGlobalMem) << ")" << std::endl;
+        // Occupy the VA right after the region to force the remap path
+        CUdeviceptr blocker = 0;
+        if (blocked) {
+            CUdeviceptr hint = (void*)((uintptr_t)mem.d_mem + mem.alignedSize);
+            if (cuMemAddressReserve(&blocker, granularity, granularity, hint, 0) != CUDA_SUCCESS) {
+                blocker = 0;
+            } else if (blocker != hint) {
+                std::cout << "Adjacent VA is already taken; no blocker needed" << std::endl;
+            }
+        }
         
-        // Initialize context
-        ensure_context(i);
+        bool moved = false;
+        bool shrink_moved = false;
+        auto start_time = std::chrono::high_resolution_clock::now();
+        bool ok = resize_device_memory(mem, 2 * size, granularity, &moved);
+        std::chrono::duration<double> grow_time = std::chrono::high_resolution_clock::now() - start_time;
         
-        // Get granularity
-        granularities[i] = get_memory_granularity(i);
-        if (granularities[i] == 0) {
-            std::cerr << "Failed to get memory granularity for device " << i << std::endl;
-            continue;
-        }
+        start_time = std::chrono::high_resolution_clock::now();
+        ok = ok && resize_device_memory(mem, size, granularity, &shrink_moved);
+        std::chrono::duration<double> shrink_time = std::chrono::high_resolution_clock::now() - start_time;
         
-        // Initialize device memory structure
-        device_memories[i].device = i;
+        if (ok) {
+            std::cout << "Remap grow (" << (moved ? "moved to a new range" : "extended in place") << "): "
+                      << grow_time.count() << " s, shrink back: " << shrink_time.count() << " s" << std::endl;
+        } else {
+            std::cerr << "Remap resize failed" << std::endl;
+        }
+        if (blocker) {
+            cuMemAddressFree(blocker, granularity);
+        }
+        free_device_memory(mem);
     }
     
-    std::cout << "\nSimultaneously allocating " << format_size(allocation_size) 
-              << " on each device..." << std::endl;
+    // Grow after a shrink that left VA reserved past the end of the region:
+    // the first new chunk would straddle that reservation and an extension
+    {
+        const size_t gb = 1024ULL * 1024 * 1024;
+        DeviceMemory mem;
+        mem.device = device;
+        if (!allocate_device_memory(mem, gb + 64ULL * 1024 * 1024, granularity, false)) {
+            return;
+        }
+        bool shrink_moved = false;
+        bool moved = false;
+        bool ok = resize_device_memory(mem, gb, granularity, &shrink_moved);
+        auto start_time = std::chrono::high_resolution_clock::now();
+        ok = ok && resize_device_memory(mem, gb + gb / 2, granularity, &moved);
+        std::chrono::duration<double> grow_time = std::chrono::high_resolution_clock::now() - start_time;
+        // Touch every byte so a chunk left unmapped would fault
+        ok = ok && hipMemset((void*)mem.d_mem, 0, mem.alignedSize) == hipSuccess &&
+             hipDeviceSynchronize() == hipSuccess;
+        if (ok) {
+            std::cout << "Grow after shrink (" << format_size(gb + 64ULL * 1024 * 1024) << " -> " << format_size(gb)
+                      << " -> " << format_size(gb + gb / 2) << ", "
+                      << (moved ? "moved to a new range" : "extended in place") << "): " << grow_time.count()
+                      << " s" << std::endl;
+        } else {
+            std::cerr << "Grow after shrink failed" << std::endl;
+        }
+        free_device_memory(mem);
+    }
     
-    // Start timing
-    auto alloc_start_time = std::chrono::high_resolution_clock::now();
+    // Copy-based growth: new region, copy, free the old one
+    DeviceMemory old_mem, new_mem;
+    old_mem.device = device;
+    new_mem.device = device;
+    if (!allocate_device_memory(old_mem, size, granularity, false)) {
+        return;
+    }
+    auto start_time = std::chrono::high_resolution_clock::now();
+    bool ok = allocate_device_memory(new_mem, 2 * size, granularity, false);
+    hipError_t hip_result = hipErrorInvalidValue;
+    if (ok) {
+        hip_result = hipMemcpy((void*)new_mem.d_mem, (void*)old_mem.d_mem, old_mem.alignedSize,
+                               hipMemcpyDeviceToDevice);
+        if (hip_result == hipSuccess) {
+            hip_result = hipDeviceSynchronize();
+        }
+    }
+    free_device_memory(old_mem);
+    std::chrono::duration<double> copy_time = std::chrono::high_resolution_clock::now() - start_time;
+    if (hip_result == hipSuccess) {
+        std::cout << "Copy-based grow: " << copy_time.count() << " s" << std::endl;
+    } else {
+        std::cerr << "Copy-based grow failed" << std::endl;
+    }
+    free_device_memory(new_mem);
+}
+
+// Fragment a device pool with a mix of region sizes, then compact it with
+// time-bounded defrag steps and check that no region's contents changed
+bool run_defrag_benchmark(unsigned long long device, size_t arena_size, size_t granularity) {
+    std::cout << "\nDefrag benchmark on device " << device << " (arena " << format_size(arena_size) << ")" << std::endl;
     
-    // Second pass: allocate memory on all devices
-    for (int i = 0; i < max_devices; i++) {
-        if (granularities[i] == 0) {
-            continue;  // Skip devices with granularity errors
+    DevicePool pool(device, arena_size, granularity, 128ULL * 1024 * 1024);
+    if (!pool.valid()) {
+        return false;
+    }
+    size_t relocations = 0;
+    pool.set_relocation_callback([&](DevicePool::RegionId, CUdeviceptr, CUdeviceptr, size_t) { relocations++; });
+    
+    // Fill the arena with 128MB..1GB regions, then free every other one
+    std::vector<DevicePool::RegionId> regions;
+    const size_t sizes[] = {128ULL << 20, 384ULL << 20, 1ULL << 30, 256ULL << 20};
+    for (size_t i = 0;; i++) {
+        DevicePool::RegionId id = pool.allocate(sizes[i % 4]);
+        if (id == 0) {
+            break;
         }
-        
-        std::cout << "Allocating on device " << i << " (" << format_size(allocation_size) << ")..." << std::endl;
-        if (!allocate_device_memory(device_memories[i], allocation_size, granularities[i], true)) {
-            std::cerr << "Failed to allocate memory on device " << i << std::endl;
+        regions.push_back(id);
+    }
+    std::vector<DevicePool::RegionId> live;
+    for (size_t i = 0; i < regions.size(); i++) {
+        if (i % 2 == 0) {
+            pool.free(regions[i]);
         } else {
-            std::cout << "Successfully allocated " << format_size(allocation_size) 
-                      << " on device " << i << std::endl;
+            live.push_back(regions[i]);
         }
     }
     
-    auto alloc_end_time = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double> alloc_time = alloc_end_time - alloc_start_time;
-    std::cout << "\nTotal allocation time for all devices: " << alloc_time.count() << " seconds" << std::endl;
+    // Tag the start of each live region so moves can be checked
+    for (DevicePool::RegionId id : live) {
+        unsigned long long tag = id;
+        hipMemcpy((void*)pool.address(id), &tag, sizeof(tag), hipMemcpyHostToDevice);
+    }
+    
+    std::cout << "Live regions: " << live.size() << ", used " << format_size(pool.used_bytes())
+              << ", largest free block " << format_size(pool.largest_free_block())
+              << ", fragmentation " << pool.fragmentation() << std::endl;
+    
+    // Compact with 1ms steps
+    size_t steps = 0;
+    size_t bytes_moved = 0;
+    auto start_time = std::chrono::high_resolution_clock::now();
+    while (pool.fragmentation() > 0.0 && steps < 100000) {
+        bytes_moved += pool.defrag_step(std::chrono::microseconds(1000));
+        steps++;
+    }
+    std::chrono::duration<double> defrag_time = std::chrono::high_resolution_clock::now() - start_time;
+    
+    std::cout << "Defragmented in " << steps << " step(s), " << defrag_time.count() << " s: moved "
+              << format_size(bytes_moved) << " in " << relocations << " relocation(s) without copying" << std::endl;
+    std::cout << "Largest free block " << format_size(pool.largest_free_block())
+              << ", fragmentation " << pool.fragmentation() << std::endl;
+    
+    bool data_correct = true;
+    for (DevicePool::RegionId id : live) {
+        unsigned long long tag = 0;
+        hipMemcpy(&tag, (void*)pool.address(id), sizeof(tag), hipMemcpyDeviceToHost);
+        if (tag != id) {
+            std::cerr << "Region " << id << " lost its contents after defragmentation" << std::endl;
+            data_correct = false;
+        }
+    }
+    
+    // Fragment again and let the background thread clean up
+    for (size_t i = 0; i < live.size(); i += 2) {
+        pool.free(live[i]);
+    }
+    pool.start_background_defrag(std::chrono::microseconds(1000), std::chrono::milliseconds(10));
+    auto wait_start = std::chrono::high_resolution_clock::now();
+    while (pool.fragmentation() > 0.0 &&
+           std::chrono::high_resolution_clock::now() - wait_start < std::chrono::seconds(60)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    pool.stop_background_defrag();
+    std::cout << "Background defrag: fragmentation " << pool.fragmentation() << std::endl;
+    
+    return data_correct;
+}
+
+// 128MB of bf16 values drawn from N(0, 0.02), roughly what trained weights
+// look like to a compressor
+std::vector<unsigned char> make_weight_pattern() {
+    std::vector<unsigned char> pattern(128ULL * 1024 * 1024);
+    std::mt19937 rng(42);
+    std::normal_distribution<float> dist(0.0f, 0.02f);
+    for (size_t i = 0; i + 1 < pattern.size(); i += 2) {
+        float value = dist(rng);
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        pattern[i] = (bits >> 16) & 0xFF;
+        pattern[i + 1] = bits >> 24;
+    }
+    return pattern;
+}
+
+// Fill a region with pattern, repeated every pattern.size() bytes, or check
+// that it still holds it
+bool fill_device_pattern(const DeviceMemory& mem, const std::vector<unsigned char>& pattern) {
+    for (size_t offset = 0; offset < mem.alignedSize; offset += pattern.size()) {
+        size_t n = std::min(pattern.size(), mem.alignedSize - offset);
+        if (hipMemcpy((void*)((uintptr_t)mem.d_mem + offset), pattern.data(), n, hipMemcpyHostToDevice) != hipSuccess) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool check_device_pattern(const DeviceMemory& mem, const std::vector<unsigned char>& pattern) {
+    std::vector<unsigned char> h_data(pattern.size());
+    for (size_t offset = 0; offset < mem.alignedSize; offset += pattern.size()) {
+        size_t n = std::min(pattern.size(), mem.alignedSize - offset);
+        if (hipMemcpy(h_data.data(), (void*)((uintptr_t)mem.d_mem + offset), n, hipMemcpyDeviceToHost) != hipSuccess ||
+            memcmp(h_data.data(), pattern.data(), n) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Put a "weights" and a "kv_cache" region of the given size to sleep and wake
+// them up again: offloading both, offloading only the weights while
+// discarding the KV cache, offloading the weights incrementally and, if a
+// codec is given, offloading both with compression
+bool run_sleep_benchmark(unsigned long long device, size_t size, size_t granularity, CompressionCodec codec) {
+    std::cout << "\nSleep benchmark on device " << device << ": " << format_size(size)
+              << " of weights and " << format_size(size) << " of KV cache" << std::endl;
+    
+    DeviceMemory weights, kv_cache;
+    weights.device = device;
+    kv_cache.device = device;
+    if (!allocate_device_memory(weights, size, granularity, false) ||
+        !allocate_device_memory(kv_cache, size, granularity, false)) {
+        free_device_memory(weights);
+        return false;
+    }
+    
+    SleepManager manager;
+    manager.add_region("weights", device, weights.d_mem, weights.alignedSize, weights.p_memHandle,
+                       weights.chunk_sizes, weights.num_chunks);
+    manager.add_region("kv_cache", device, kv_cache.d_mem, kv_cache.alignedSize, kv_cache.p_memHandle,
+                       kv_cache.chunk_sizes, kv_cache.num_chunks);
+    
+    std::vector<unsigned char> pattern = make_weight_pattern();
+    bool ok = fill_device_pattern(weights, pattern);
+    
+    // The incremental scenario runs twice: the first cycle fills the host
+    // copy, the second one only copies the chunk written in between
+    const char* names[] = {"offload all", "offload weights, discard KV cache",
+                           "incremental weights, first cycle", "incremental weights, 1 chunk dirty",
+                           "offload all, compressed"};
+    int num_scenarios = codec == CompressionCodec::kNone ? 4 : 5;
+    for (int scenario = 0; scenario < num_scenarios && ok; scenario++) {
+        std::map<std::string, SleepAction> actions;
+        actions["weights"] = scenario == 2 || scenario == 3 ? SleepAction::kOffloadIncremental : SleepAction::kOffload;
+        actions["kv_cache"] = scenario == 0 || scenario == 4 ? SleepAction::kOffload : SleepAction::kDiscard;
+        if (scenario == 3) {
+            ok = hipMemcpy((void*)weights.d_mem, pattern.data(), 4096, hipMemcpyHostToDevice) == hipSuccess &&
+                 manager.mark_dirty(weights.d_mem, 4096);
+        }
+        if (scenario == 4) {
+            manager.set_compression(codec, std::max(1u, std::thread::hardware_concurrency()));
+        }
+        
+        SleepStats sleep_stats, wake_stats;
+        ok = ok && manager.sleep(actions, SleepAction::kKeep, &sleep_stats);
+        ok = manager.wake_up(&wake_stats) && ok;
+        ok = ok && check_device_pattern(weights, pattern);
+        if (!ok) {
+            std::cerr << names[scenario] << ": sleep/wake failed or weights were not restored" << std::endl;
+            break;
+        }
+        std::cout << names[scenario] << ": sleep " << sleep_stats.seconds << " s ("
+                  << format_size(sleep_stats.bytes_copied) << " copied, "
+                  << format_size(sleep_stats.bytes_skipped) << " skipped";
+        if (sleep_stats.bytes_zero) {
+            std::cout << ", " << format_size(sleep_stats.bytes_zero) << " all zeros";
+        }
+        if (sleep_stats.chunks_unchanged) {
+            std::cout << ", " << sleep_stats.chunks_unchanged << " dirty chunk(s) unchanged";
+        }
+        if (scenario == 4 && sleep_stats.bytes_stored) {
+            std::cout << ", " << format_size(sleep_stats.bytes_stored) << " held, compression ratio "
+                      << (double)(sleep_stats.bytes_copied - sleep_stats.bytes_zero) / sleep_stats.bytes_stored;
+        }
+        std::cout << "), wake " << wake_stats.seconds << " s ("
+                  << format_size(wake_stats.bytes_copied) << " copied, "
+                  << format_size(wake_stats.bytes_zero) << " memset)" << std::endl;
+    }
+    
+    manager.remove_region(weights.d_mem);
+    manager.remove_region(kv_cache.d_mem);
+    free_device_memory(weights);
+    free_device_memory(kv_cache);
+    return ok;
+}
+
+// Stream a region to a checkpoint file in directory and back: a full save,
+// a full restore into the wiped region, a restore of the last chunk alone,
+// and a spill/wake cycle through the SleepManager
+bool run_spill_benchmark(unsigned long long device, size_t size, size_t granularity, const std::string& directory,
+                         IoEngineKind engine) {
+    std::cout << "\nSpill benchmark on device " << device << ": " << format_size(size)
+              << " to " << directory << std::endl;
+    
+    DeviceMemory weights;
+    weights.device = device;
+    if (!allocate_device_memory(weights, size, granularity, false)) {
+        return false;
+    }
+    std::vector<unsigned char> pattern = make_weight_pattern();
+    bool ok = fill_device_pattern(weights, pattern);
+    
+    std::string path = directory + "/cumem_test_spill.ckpt";
+    CheckpointOptions options;
+    options.engine = engine;
+    // Every save and load below streams through the same pinned slabs
+    StagingPool spill_pool(options.buffer_size, options.num_buffers,
+                           std::vector<int>(1, get_numa_node_for_gpu(device)));
+    options.staging_pool = &spill_pool;
+    CheckpointStats save_stats = {}, load_stats = {}, chunk_stats = {};
+    ok = ok && save_region_checkpoint(path, device, weights.d_mem, weights.chunk_sizes, weights.num_chunks,
+                                      options, &save_stats);
+    if (ok) {
+        std::cout << "Save: " << format_size(save_stats.bytes) << " in " << save_stats.seconds << " s, "
+                  << save_stats.bytes / save_stats.seconds / 1e9 << " GB/s (device copies "
+                  << save_stats.copy_seconds << " s, file I/O " << save_stats.io_seconds << " s, "
+                  << (save_stats.direct_io ? "O_DIRECT" : "buffered") << ", " << save_stats.engine
+                  << (save_stats.registered_buffers ? " with registered buffers" : "") << ")" << std::endl;
+        ok = hipMemset((void*)weights.d_mem, 0, weights.alignedSize) == hipSuccess;
+    }
+    ok = ok && load_region_checkpoint(path, device, weights.d_mem, weights.chunk_sizes, weights.num_chunks,
+                                      0, weights.num_chunks, options, &load_stats);
+    ok = ok && check_device_pattern(weights, pattern);
+    if (ok) {
+        std::cout << "Restore: " << format_size(load_stats.bytes) << " in " << load_stats.seconds << " s, "
+                  << load_stats.bytes / load_stats.seconds / 1e9 << " GB/s (device copies "
+                  << load_stats.copy_seconds << " s, file I/O " << load_stats.io_seconds << " s)" << std::endl;
+    }
+    ok = ok && load_region_checkpoint(path, device, weights.d_mem, weights.chunk_sizes, weights.num_chunks,
+                                      weights.num_chunks - 1, 1, options, &chunk_stats);
+    if (ok) {
+        std::cout << "Restore of the last chunk: " << format_size(chunk_stats.bytes) << " in "
+                  << chunk_stats.seconds << " s" << std::endl;
+    }
+    unlink(path.c_str());
+    
+    if (ok) {
+        SleepManager manager;
+        manager.set_spill_directory(directory);
+        manager.set_staging_pool(&spill_pool);
+        manager.add_region("weights", device, weights.d_mem, weights.alignedSize, weights.p_memHandle,
+                           weights.chunk_sizes, weights.num_chunks);
+        std::map<std::string, SleepAction> actions;
+        SleepStats sleep_stats, wake_stats;
+        ok = manager.sleep(actions, SleepAction::kSpill, &sleep_stats);
+        ok = manager.wake_up(&wake_stats) && ok;
+        ok = ok && check_device_pattern(weights, pattern);
+        if (ok) {
+            std::cout << "Spill cycle: sleep " << sleep_stats.seconds << " s, wake " << wake_stats.seconds
+                      << " s, " << format_size(sleep_stats.bytes_spilled) << " spilled" << std::endl;
+        }
+        manager.remove_region(weights.d_mem);
+    }
+    for (const StagingPoolStats& stats : spill_pool.stats()) {
+        std::cout << "Staging slabs on NUMA node " << stats.node << ": " << stats.acquires << " acquired, "
+                  << stats.failed_acquires << " allocated instead" << std::endl;
+    }
+    if (!ok) {
+        std::cerr << "Spill benchmark failed or the region was not restored" << std::endl;
+    }
+    
+    free_device_memory(weights);
+    return ok;
+}
+
+// Restore a weight file into a region twice: reading it into pinned
+// buffers and copying those (the usual path), then through
+// restore_from_mapped_file. The weights start at an unaligned offset, as
+// after a safetensors header. With host_backend the region is host memory
+// behind a HostCopyTarget and no device is needed.
+bool run_mapped_restore_benchmark(unsigned long long device, size_t size, size_t granularity,
+                                  const std::string& directory, bool host_backend) {
+    std::cout << "\nMapped restore benchmark: " << format_size(size) << " from " << directory << " into "
+              << (host_backend ? "host memory" : "device " + std::to_string(device)) << std::endl;
+    
+    // Write the weight file
+    const size_t header_size = 4096 + 123;
+    std::vector<unsigned char> pattern = make_weight_pattern();
+    std::string path = directory + "/cumem_test_weights.bin";
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        std::cerr << "Error creating " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    std::vector<unsigned char> header(header_size, 0x7B);
+    bool ok = pwrite_all(fd, header.data(), header.size(), 0);
+    for (size_t offset = 0; offset < size && ok; offset += pattern.size()) {
+        ok = pwrite_all(fd, pattern.data(), std::min(pattern.size(), size - offset), header_size + offset);
+    }
+    close(fd);
+    
+    DeviceMemory weights;
+    weights.device = device;
+    void* host_region = nullptr;
+    std::unique_ptr<CopyTarget> target;
+    MappedRestoreOptions options;
+    if (host_backend) {
+        ok = ok && posix_memalign(&host_region, 4096, size) == 0;
+        if (ok) {
+            target.reset(new HostCopyTarget(host_region, options.num_windows));
+        }
+    } else {
+        ok = ok && allocate_device_memory(weights, size, granularity, false);
+        if (ok) {
+            options.window_size = weights.chunk_sizes[0];
+            target.reset(new DeviceCopyTarget(device, weights.d_mem, options.num_windows));
+        }
+    }
+    auto clear_region = [&]() {
+        if (host_backend) {
+            memset(host_region, 0, size);
+            return true;
+        }
+        return hipMemset((void*)weights.d_mem, 0, weights.alignedSize) == hipSuccess;
+    };
+    auto check_region = [&]() {
+        if (!host_backend) {
+            return check_device_pattern(weights, pattern);
+        }
+        for (size_t offset = 0; offset < size; offset += pattern.size()) {
+            if (memcmp((char*)host_region + offset, pattern.data(), std::min(pattern.size(), size - offset)) != 0) {
+                return false;
+            }
+        }
+        return true;
+    };
+    
+    // Read into two pinned buffers and copy each one while the other fills
+    if (ok && clear_region()) {
+        std::vector<void*> buffers(options.num_windows, nullptr);
+        std::vector<char> pinned(options.num_windows, 0);
+        for (size_t i = 0; i < buffers.size() && ok; i++) {
+            ok = posix_memalign(&buffers[i], 4096, options.window_size) == 0;
+            pinned[i] = ok && target->pin(buffers[i], options.window_size);
+        }
+        fd = open(path.c_str(), O_RDONLY);
+        auto start_time = std::chrono::high_resolution_clock::now();
+        size_t k = 0;
+        for (size_t offset = 0; offset < size && ok && fd >= 0; offset += options.window_size, ++k) {
+            size_t slot = k % buffers.size();
+            size_t n = std::min(options.window_size, size - offset);
+            ok = target->wait(slot) && pread_all(fd, buffers[slot], n, header_size + offset) &&
+                 target->copy_async(slot, offset, buffers[slot], n);
+        }
+        for (size_t slot = 0; slot < buffers.size(); ++slot) {
+            ok = target->wait(slot) && ok;
+        }
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+        if (fd >= 0) {
+            close(fd);
+        }
+        for (size_t i = 0; i < buffers.size(); i++) {
+            if (pinned[i]) {
+                target->unpin(buffers[i]);
+            }
+            free(buffers[i]);
+        }
+        ok = ok && fd >= 0 && check_region();
+        if (ok) {
+            std::cout << "read + pinned copy: " << elapsed.count() << " s, " << size / elapsed.count() / 1e9
+                      << " GB/s" << std::endl;
+        }
+    }
+    
+    if (ok && clear_region()) {
+        MappedRestoreStats stats;
+        ok = restore_from_mapped_file(path, header_size, size, target.get(), options, &stats) && check_region();
+        if (ok) {
+            std::cout << "mapped restore: " << stats.seconds << " s, " << stats.bytes / stats.seconds / 1e9
+                      << " GB/s (" << format_size(stats.bytes_pinned) << " from pinned file pages, "
+                      << format_size(stats.bytes_bounced) << " bounced; pinning " << stats.pin_seconds
+                      << " s, waiting for copies " << stats.wait_seconds << " s)" << std::endl;
+        }
+    }
+    if (!ok) {
+        std::cerr << "Mapped restore benchmark failed or the region was not restored" << std::endl;
+    }
+    
+    target.reset();
+    unlink(path.c_str());
+    if (host_backend) {
+        free(host_region);
+    } else {
+        free_device_memory(weights);
+    }
+    return ok;
+}
+
+// Load the same weights into a region on every device: each device copying
+// from host on its own, then broadcast_restore as a ring and as a tree
+bool run_broadcast_benchmark(const std::vector<unsigned long long>& devices,
+                             const std::vector<size_t>& granularities, size_t size) {
+    std::cout << "\nBroadcast benchmark: " << format_size(size) << " to " << devices.size() << " device(s)"
+              << std::endl;
+    
+    std::vector<DeviceMemory> regions(devices.size());
+    std::vector<BroadcastReplica> replicas;
+    bool ok = true;
+    for (size_t i = 0; i < devices.size() && ok; i++) {
+        regions[i].device = devices[i];
+        ok = allocate_device_memory(regions[i], size, granularities[devices[i]], false);
+        if (ok) {
+            replicas.push_back(BroadcastReplica{devices[i], regions[i].d_mem, regions[i].alignedSize});
+        }
+    }
+    
+    std::vector<unsigned char> pattern = make_weight_pattern();
+    void* host = nullptr;
+    ok = ok && hipHostMalloc(&host, size, hipHostMallocPortable) == hipSuccess;
+    for (size_t offset = 0; offset < size && ok; offset += pattern.size()) {
+        memcpy((char*)host + offset, pattern.data(), std::min(pattern.size(), size - offset));
+    }
+    
+    auto clear_regions = [&]() {
+        for (const DeviceMemory& region : regions) {
+            if (hipMemset((void*)region.d_mem, 0, region.alignedSize) != hipSuccess) {
+                return false;
+            }
+        }
+        return true;
+    };
+    auto check_regions = [&]() {
+        for (const DeviceMemory& region : regions) {
+            if (!check_device_pattern(region, pattern)) {
+                std::cerr << "Device " << region.device << " does not hold the broadcast data" << std::endl;
+                return false;
+            }
+        }
+        return true;
+    };
+    
+    // Baseline: every device reads the whole buffer from host at once
+    if (ok && clear_regions()) {
+        std::vector<hipStream_t> streams(regions.size());
+        auto start_time = std::chrono::high_resolution_clock::now();
+        for (size_t i = 0; i < regions.size() && ok; i++) {
+            hipSetDevice(regions[i].device);
+            ok = hipStreamCreate(&streams[i]) == hipSuccess &&
+                 hipMemcpyAsync((void*)regions[i].d_mem, host, size, hipMemcpyHostToDevice, streams[i]) == hipSuccess;
+        }
+        for (size_t i = 0; i < regions.size(); i++) {
+            hipSetDevice(regions[i].device);
+            ok = hipStreamSynchronize(streams[i]) == hipSuccess && ok;
+            hipStreamDestroy(streams[i]);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+        ok = ok && check_regions();
+        if (ok) {
+            std::cout << "independent host copies: " << elapsed.count() << " s, "
+                      << format_size(size * regions.size()) << " read from host" << std::endl;
+        }
+    }
+    
+    const char* names[] = {"ring", "tree"};
+    BroadcastTopology topologies[] = {BroadcastTopology::kRing, BroadcastTopology::kTree};
+    for (int t = 0; t < 2 && ok; t++) {
+        BroadcastOptions options;
+        options.topology = topologies[t];
+        options.chunk_size = regions[0].chunk_sizes[0];
+        BroadcastStats stats;
+        ok = clear_regions() && broadcast_restore(host, size, replicas, options, &stats) && check_regions();
+        if (ok) {
+            std::cout << names[t] << " broadcast: " << stats.seconds << " s, " << format_size(stats.bytes_from_host)
+                      << " read from host by " << stats.num_roots << " root(s), " << format_size(stats.bytes_peer)
+                      << " device to device" << std::endl;
+        }
+    }
+    if (!ok) {
+        std::cerr << "Broadcast benchmark failed" << std::endl;
+    }
+    
+    if (host) {
+        hipHostFree(host);
+    }
+    for (DeviceMemory& region : regions) {
+        free_device_memory(region);
+    }
+    return ok;
+}
+
+// NUMA nodes with memory, from /sys/devices/system/node/online ("0-1,3");
+// just node 0 if that cannot be read
+std::vector<int> get_online_numa_nodes() {
+    std::vector<int> nodes;
+    int fd = open("/sys/devices/system/node/online", O_RDONLY);
+    if (fd >= 0) {
+        char text[256] = {};
+        ssize_t n = read(fd, text, sizeof(text) - 1);
+        close(fd);
+        const char* p = text;
+        while (n > 0 && *p >= '0' && *p <= '9') {
+            char* end;
+            int first = strtol(p, &end, 10);
+            int last = *end == '-' ? strtol(end + 1, &end, 10) : first;
+            for (int node = first; node <= last; node++) {
+                nodes.push_back(node);
+            }
+            p = *end == ',' ? end + 1 : end;
+        }
+    }
+    if (nodes.empty()) {
+        nodes.push_back(0);
+    }
+    return nodes;
+}
+
+// Local-node bandwidth must beat the best remote node by this factor
+const double kNumaLocalAdvantage = 1.1;
+
+// Time H2D and D2H copies between every allocated region and a pinned buffer
+// on each NUMA node, and flag a device whose own node is not clearly faster
+// than a remote one in either direction: its host buffers, or the device
+// itself, are then not where get_numa_node_for_gpu says. Returns false if
+// any device was flagged.
+bool probe_numa_bandwidth(const std::vector<DeviceMemory>& regions) {
+    const size_t probe_size = 64ULL * 1024 * 1024;
+    const int repeats = 4;
+    std::vector<int> nodes = get_online_numa_nodes();
+    StagingPool pool(probe_size, 1, nodes);
+    std::map<int, StagingPoolStats> node_stats;
+    for (const StagingPoolStats& stats : pool.stats()) {
+        node_stats[stats.node] = stats;
+    }
+    
+    std::cout << "\nNUMA bandwidth probe (" << format_size(probe_size) << " pinned buffer per node)" << std::endl;
+    printf("%8s %6s %10s %10s   %s\n", "device", "node", "H2D GB/s", "D2H GB/s", "placement");
+    bool all_ok = true;
+    for (const DeviceMemory& mem : regions) {
+        if (!mem.allocated || mem.alignedSize < probe_size) {
+            continue;
+        }
+        int local_node = get_numa_node_for_gpu(mem.device);
+        hipSetDevice(mem.device);
+        
+        // Bandwidth per node, -1 where the node has no usable buffer
+        std::map<int, std::pair<double, double>> bandwidth;
+        for (int node : nodes) {
+            void* host = pool.acquire(node);
+            if (!host || !node_stats[node].pinned) {
+                if (host) {
+                    pool.release(host);
+                }
+                continue;
+            }
+            double seconds[2];
+            bool ok = true;
+            for (int direction = 0; direction < 2 && ok; direction++) {
+                auto copy = [&]() {
+                    return direction == 0
+                               ? hipMemcpy((void*)mem.d_mem, host, probe_size, hipMemcpyHostToDevice) == hipSuccess
+                               : hipMemcpy(host, (void*)mem.d_mem, probe_size, hipMemcpyDeviceToHost) == hipSuccess;
+                };
+                // One untimed copy to warm up the path
+                ok = copy();
+                auto start_time = std::chrono::high_resolution_clock::now();
+                for (int r = 0; r < repeats && ok; r++) {
+                    ok = copy();
+                }
+                std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+                seconds[direction] = elapsed.count();
+            }
+            pool.release(host);
+            if (!ok) {
+                std::cerr << "Bandwidth probe copy failed on device " << mem.device << std::endl;
+                continue;
+            }
+            double gib = static_cast<double>(probe_size) * repeats / (1024.0 * 1024.0 * 1024.0);
+            bandwidth[node] = std::make_pair(gib / seconds[0], gib / seconds[1]);
+            const StagingPoolStats& stats = node_stats[node];
+            std::string note = node == local_node ? "local" : "remote";
+            if (stats.resident_node >= 0 && stats.resident_node != node) {
+                note += ", buffer landed on node " + std::to_string(stats.resident_node);
+            }
+            printf("%8llu %6d %10.2f %10.2f   %s\n", mem.device, node, bandwidth[node].first,
+                   bandwidth[node].second, note.c_str());
+        }
+        
+        auto local = bandwidth.find(local_node);
+        if (local == bandwidth.end()) {
+            continue;
+        }
+        for (const auto& remote : bandwidth) {
+            if (remote.first == local_node) {
+                continue;
+            }
+            const char* directions[] = {"H2D", "D2H"};
+            double local_values[] = {local->second.first, local->second.second};
+            double remote_values[] = {remote.second.first, remote.second.second};
+            for (int direction = 0; direction < 2; direction++) {
+                if (local_values[direction] < kNumaLocalAdvantage * remote_values[direction]) {
+                    std::cerr << "WARNING: device " << mem.device << " " << directions[direction]
+                              << " bandwidth from its local NUMA node " << local_node << " ("
+                              << local_values[direction] << " GB/s) is not clearly better than from node "
+                              << remote.first << " (" << remote_values[direction]
+                              << " GB/s); check the device's NUMA placement" << std::endl;
+                    all_ok = false;
+                }
+            }
+        }
+    }
+    return all_ok;
+}
+
+// Allocate a region of the given size on every device at once, from one
+// thread per device, with at most limit concurrent cuMemCreate calls per NUMA
+// node, for every limit from 1 to the most devices any node has (which no
+// longer limits anything). Reports the aggregate create throughput of each
+// node per limit and the limit that maximized it.
+bool run_admission_benchmark(const std::vector<unsigned long long>& devices,
+                             const std::vector<size_t>& granularities, size_t size) {
+    std::map<int, size_t> devices_per_node;
+    for (unsigned long long device : devices) {
+        devices_per_node[get_numa_node_for_gpu(device)]++;
+    }
+    size_t max_limit = 0;
+    for (const auto& entry : devices_per_node) {
+        max_limit = std::max(max_limit, entry.second);
+    }
+    std::cout << "\nAdmission benchmark: " << format_size(size) << " on each of " << devices.size()
+              << " device(s) at once, limits 1 to " << max_limit << " creates per NUMA node" << std::endl;
+    
+    // Best throughput per node, with the limit that reached it
+    std::map<int, std::pair<double, size_t>> best;
+    std::vector<std::string> rows;
+    bool ok = true;
+    for (size_t limit = 1; limit <= max_limit && ok; limit++) {
+        CreateAdmission admission(limit);
+        set_create_admission(&admission);
+        std::vector<DeviceMemory> regions(devices.size());
+        std::vector<double> seconds(devices.size(), 0.0);
+        std::vector<char> allocated(devices.size(), 0);
+        auto start_time = std::chrono::high_resolution_clock::now();
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < devices.size(); i++) {
+            threads.emplace_back([&, i]() {
+                regions[i].device = devices[i];
+                allocated[i] = allocate_device_memory(regions[i], size, granularities[devices[i]], false);
+                std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+                seconds[i] = elapsed.count();
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        set_create_admission(nullptr);
+        
+        // A node's creates are done when its slowest device is
+        std::map<int, double> node_seconds;
+        std::map<int, size_t> node_bytes;
+        for (size_t i = 0; i < devices.size(); i++) {
+            ok = ok && allocated[i];
+            int node = get_numa_node_for_gpu(devices[i]);
+            node_seconds[node] = std::max(node_seconds[node], seconds[i]);
+            node_bytes[node] += regions[i].alignedSize;
+            if (allocated[i]) {
+                free_device_memory(regions[i]);
+            }
+        }
+        if (!ok) {
+            std::cerr << "Allocation failed with " << limit << " creates per node" << std::endl;
+            break;
+        }
+        for (const AdmissionStats& stats : admission.stats()) {
+            double gib_per_second = node_bytes[stats.node] / (1024.0 * 1024.0 * 1024.0) / node_seconds[stats.node];
+            if (gib_per_second > best[stats.node].first) {
+                best[stats.node] = std::make_pair(gib_per_second, limit);
+            }
+            char row[200];
+            snprintf(row, sizeof(row), "%6zu %6d %8zu %12.2f %10zu %14.6f", limit, stats.node,
+                     devices_per_node[stats.node], gib_per_second, stats.waited, stats.max_wait_seconds);
+            rows.push_back(row);
+        }
+    }
+    
+    printf("\n%6s %6s %8s %12s %10s %14s\n", "limit", "node", "devices", "GB/s", "waited", "max wait (s)");
+    for (const std::string& row : rows) {
+        printf("%s\n", row.c_str());
+    }
+    for (const auto& entry : best) {
+        std::cout << "NUMA node " << entry.first << ": best aggregate throughput " << entry.second.first
+                  << " GB/s with " << entry.second.second << " concurrent create(s)"
+                  << (entry.second.second >= devices_per_node[entry.first] ? " (no limit)" : "") << std::endl;
+    }
+    return ok;
+}
+
+void print_allocation_plan(const AllocationPlan& plan) {
+    std::cout << "Planned allocation order:";
+    for (const AllocationStep& step : plan.steps) {
+        std::cout << " " << step.device << (step.deferred ? "*" : "");
+    }
+    std::cout << (plan.starved_nodes.empty() ? "" : "  (* deferred)") << std::endl;
+    std::map<int, size_t> node_free;
+    for (const AllocationStep& step : plan.steps) {
+        node_free[step.node] = step.node_free_bytes;
+    }
+    for (const auto& entry : node_free) {
+        std::cout << "  NUMA node " << entry.first << ": " << format_size(entry.second) << " free";
+        for (size_t i = 0; i < plan.starved_nodes.size(); i++) {
+            if (plan.starved_nodes[i] == entry.first) {
+                std::cout << ", " << format_size(plan.shortfall_bytes[i]) << " short, reclaiming";
+            }
+        }
+        std::cout << std::endl;
+    }
+}
+
+void print_allocation_run(const AllocationRun& run) {
+    std::cout << "Actual allocation order:";
+    for (size_t i = 0; i < run.order.size(); i++) {
+        std::cout << " " << run.order[i] << " (" << run.finish_seconds[i] << " s)";
+    }
+    std::cout << std::endl;
+    if (run.reclaims_started != 0) {
+        std::cout << "Reclaim started on " << run.reclaims_started << " node(s), " << run.deferred_wait_seconds
+                  << " s spent waiting for them" << std::endl;
+    }
+}
+
+// Allocate and free a region of the given size on every device, once in
+// device index order and once in the planner's order, and report the
+// end-to-end time the plan saves
+bool run_allocation_order_benchmark(const std::vector<unsigned long long>& devices,
+                                    const std::vector<size_t>& granularities, size_t size) {
+    std::cout << "\nAllocation order benchmark: " << format_size(size) << " on each of " << devices.size()
+              << " device(s)" << std::endl;
+    
+    AllocationPlan index_plan;
+    for (unsigned long long device : devices) {
+        index_plan.steps.push_back(AllocationStep{device, get_numa_node_for_gpu(device), 0, false});
+    }
+    AllocationPlan plan = plan_allocation_order(devices, size);
+    print_allocation_plan(plan);
+    
+    double seconds[2];
+    const AllocationPlan* plans[] = {&index_plan, &plan};
+    const char* names[] = {"index order", "planned order"};
+    bool ok = true;
+    for (int p = 0; p < 2 && ok; p++) {
+        std::map<unsigned long long, DeviceMemory> regions;
+        AllocationRun run;
+        ok = run_allocation_plan(*plans[p], size, [&](unsigned long long device) {
+            regions[device].device = device;
+            return allocate_device_memory(regions[device], size, granularities[device], false);
+        }, 30.0, &run);
+        for (auto& entry : regions) {
+            if (entry.second.allocated) {
+                free_device_memory(entry.second);
+            }
+        }
+        seconds[p] = run.seconds;
+        std::cout << names[p] << ": " << run.seconds << " s" << std::endl;
+        print_allocation_run(run);
+    }
+    if (!ok) {
+        std::cerr << "Allocation order benchmark failed" << std::endl;
+        return false;
+    }
+    std::cout << "Planned order saved " << seconds[0] - seconds[1] << " s ("
+              << 100.0 * (seconds[0] - seconds[1]) / seconds[0] << "%)" << std::endl;
+    return true;
+}
+
+// One rank of run_coordinator_test: join the coordinator, then allocate and
+// free a region on device rank % device count with every cuMemCreate
+// admitted through it
+bool run_coordinator_rank(const std::string& name, size_t rank, size_t size) {
+    std::unique_ptr<SharedAdmission> coordinator = SharedAdmission::join(name, SharedAdmissionOptions());
+    int device_count = 0;
+    if (!coordinator || hipInit(0) != hipSuccess || hipGetDeviceCount(&device_count) != hipSuccess ||
+        device_count == 0) {
+        return false;
+    }
+    unsigned long long device = rank % device_count;
+    size_t granularity = get_memory_granularity(device);
+    if (granularity == 0) {
+        return false;
+    }
+    set_create_admission(coordinator.get());
+    DeviceMemory mem;
+    mem.device = device;
+    bool ok = allocate_device_memory(mem, size, granularity, false);
+    set_create_admission(nullptr);
+    if (ok) {
+        free_device_memory(mem);
+    }
+    return ok;
+}
+
+// Multi-process check of SharedAdmission. A first child dies while holding
+// a slot on node 0, which must be given back; then ranks child processes,
+// like one process per GPU, allocate at once through a coordinator that
+// allows 2 creates in flight per node, staggered by 1 ms. Checks that every
+// rank succeeded and no node ever exceeded the limit. Runs before HIP is
+// initialized here, since forked children must set up their own runtime.
+bool run_coordinator_test(size_t ranks, size_t size) {
+    const size_t limit = 2;
+    std::cout << "\nCoordinator test: " << ranks << " rank processes allocating " << format_size(size)
+              << " each, at most " << limit << " creates per NUMA node" << std::endl;
+    
+    std::string name = "/cumem-test-" + std::to_string(getpid());
+    SharedAdmission::remove(name);
+    SharedAdmissionOptions options;
+    options.limit = limit;
+    options.stagger_seconds = 0.001;
+    std::unique_ptr<SharedAdmission> coordinator = SharedAdmission::join(name, options);
+    if (!coordinator) {
+        return false;
+    }
+    std::cout.flush();
+    std::cerr.flush();
+    
+    bool ok = true;
+    pid_t pid = fork();
+    if (pid == 0) {
+        std::unique_ptr<SharedAdmission> rank = SharedAdmission::join(name, options);
+        if (rank) {
+            rank->enter(0);
+        }
+        _exit(rank ? 0 : 1);
+    }
+    int status = 0;
+    ok = pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (ok) {
+        // Blocks forever unless the dead rank's slot is recovered
+        for (size_t i = 0; i < limit; i++) {
+            coordinator->enter(0);
+        }
+        for (size_t i = 0; i < limit; i++) {
+            coordinator->leave(0);
+        }
+        std::cout << "Slot of a dead rank recovered: " << (coordinator->recovered() != 0 ? "yes" : "no") << std::endl;
+        ok = coordinator->recovered() != 0;
+    }
+    
+    auto start_time = std::chrono::high_resolution_clock::now();
+    std::vector<pid_t> children;
+    for (size_t rank = 0; rank < ranks && ok; rank++) {
+        pid = fork();
+        if (pid == 0) {
+            _exit(run_coordinator_rank(name, rank, size) ? 0 : 1);
+        }
+        if (pid < 0) {
+            std::cerr << "Error forking rank " << rank << ": " << strerror(errno) << std::endl;
+            ok = false;
+            break;
+        }
+        children.push_back(pid);
+    }
+    for (size_t rank = 0; rank < children.size(); rank++) {
+        if (waitpid(children[rank], &status, 0) != children[rank] || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0) {
+            std::cerr << "Rank " << rank << " failed" << std::endl;
+            ok = false;
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+    
+    for (const AdmissionStats& stats : coordinator->stats()) {
+        std::cout << "NUMA node " << stats.node << ": " << stats.admitted << " creates admitted, "
+                  << stats.waited << " queued (max wait " << stats.max_wait_seconds << " s), peak "
+                  << stats.peak_active << " in flight" << std::endl;
+        if (stats.peak_active > limit) {
+            std::cerr << "NUMA node " << stats.node << " exceeded the limit of " << limit << std::endl;
+            ok = false;
+        }
+    }
+    std::cout << "All ranks done in " << elapsed.count() << " s" << std::endl;
+    SharedAdmission::remove(name);
+    if (!ok) {
+        std::cerr << "Coordinator test failed" << std::endl;
+    }
+    return ok;
+}
+
+// Copy ranges from 1MB up to max_size between pageable host memory and a
+// region on device, with synchronous hipMemcpy and with the double-buffered
+// CopyEngine, checking that the data survives the round trip
+bool run_copy_engine_benchmark(unsigned long long device, size_t max_size, size_t granularity) {
+    std::cout << "\nCopy engine benchmark on device " << device << ": 1 MB to " << format_size(max_size)
+              << std::endl;
+
+    DeviceMemory mem;
+    mem.device = device;
+    if (!allocate_device_memory(mem, max_size, granularity, false)) {
+        std::cerr << "Failed to allocate copy benchmark region" << std::endl;
+        return false;
+    }
+    std::vector<unsigned char> pattern = make_weight_pattern();
+    unsigned char* host = static_cast<unsigned char*>(malloc(max_size));
+    if (!host) {
+        std::cerr << "Failed to allocate " << format_size(max_size) << " of host memory" << std::endl;
+        free_device_memory(mem);
+        return false;
+    }
+
+    CopyEngineOptions options;
+    StagingPool copy_pool(options.buffer_size, options.num_buffers,
+                          std::vector<int>(1, get_numa_node_for_gpu(device)));
+    options.staging_pool = &copy_pool;
+    CopyEngine engine(device, options);
+    bool ok = engine.ok();
+
+    std::vector<size_t> sizes;
+    for (size_t size = 1024 * 1024; size < max_size; size *= 4) {
+        sizes.push_back(size);
+    }
+    sizes.push_back(max_size);
+
+    auto fill_host = [&](size_t size) {
+        for (size_t offset = 0; offset < size; offset += pattern.size()) {
+            memcpy(host + offset, pattern.data(), std::min(pattern.size(), size - offset));
+        }
+    };
+    auto check_host = [&](size_t size) {
+        for (size_t offset = 0; offset < size; offset += pattern.size()) {
+            if (memcmp(host + offset, pattern.data(), std::min(pattern.size(), size - offset)) != 0) {
+                return false;
+            }
+        }
+        return true;
+    };
+    auto gib_per_second = [](size_t size, double seconds) {
+        return static_cast<double>(size) / (1024.0 * 1024.0 * 1024.0) / seconds;
+    };
+
+    printf("\n%12s %14s %14s %14s %14s\n", "size", "sync H2D GB/s", "async H2D GB/s", "sync D2H GB/s",
+           "async D2H GB/s");
+    for (size_t size : sizes) {
+        if (!ok) {
+            break;
+        }
+        fill_host(size);
+        hipSetDevice(device);
+
+        auto sync_start = std::chrono::high_resolution_clock::now();
+        ok = hipMemcpy((void*)mem.d_mem, host, size, hipMemcpyHostToDevice) == hipSuccess;
+        std::chrono::duration<double> sync_h2d = std::chrono::high_resolution_clock::now() - sync_start;
+
+        CopyEngineStats h2d_stats;
+        ok = ok && engine.to_device(mem.d_mem, host, size, &h2d_stats);
+
+        sync_start = std::chrono::high_resolution_clock::now();
+        ok = ok && hipMemcpy(host, (void*)mem.d_mem, size, hipMemcpyDeviceToHost) == hipSuccess;
+        std::chrono::duration<double> sync_d2h = std::chrono::high_resolution_clock::now() - sync_start;
+
+        // Only the engine's read-back is checked, so clear what the
+        // synchronous one brought back
+        memset(host, 0, size);
+        CopyEngineStats d2h_stats;
+        ok = ok && engine.to_host(host, mem.d_mem, size, &d2h_stats);
+        if (ok && !check_host(size)) {
+            std::cerr << "Data read back by the copy engine does not match" << std::endl;
+            ok = false;
+        }
+        if (ok) {
+            printf("%12s %14.2f %14.2f %14.2f %14.2f\n", format_size(size).c_str(),
+                   gib_per_second(size, sync_h2d.count()), gib_per_second(size, h2d_stats.seconds),
+                   gib_per_second(size, sync_d2h.count()), gib_per_second(size, d2h_stats.seconds));
+        }
+    }
+    if (!ok) {
+        std::cerr << "Copy engine benchmark failed" << std::endl;
+    } else {
+        std::cout << "Copy engine: " << options.num_buffers << " staging buffers of "
+                  << format_size(options.buffer_size) << std::endl;
+    }
+
+    free(host);
+    free_device_memory(mem);
+    return ok;
+}
+
+// Write a file of the given size through one IoEngine and read it back,
+// from page-aligned host buffers, so only the storage path is measured
+bool stream_file(IoEngineKind kind, const std::string& path, size_t size, size_t queue_depth,
+                 const std::vector<void*>& buffers, size_t buffer_size, bool write,
+                 double* seconds, const char** engine_name, bool* registered, bool* direct_io) {
+    int flags = write ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY;
+    int fd = open(path.c_str(), flags | O_DIRECT, 0644);
+    *direct_io = fd >= 0;
+    if (fd < 0) {
+        fd = open(path.c_str(), flags, 0644);
+    }
+    if (fd < 0) {
+        std::cerr << "Error opening " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    std::unique_ptr<IoEngine> engine = create_io_engine(kind, fd, write, buffers, buffer_size, queue_depth,
+                                                        1024 * 1024, -1);
+    if (!engine) {
+        close(fd);
+        return false;
+    }
+    *engine_name = engine->name();
+    *registered = engine->registered_buffers();
+    
+    auto start_time = std::chrono::high_resolution_clock::now();
+    bool ok = true;
+    size_t submitted = 0;
+    size_t in_flight = 0;
+    for (size_t offset = 0; offset < size && ok; offset += buffer_size) {
+        size_t buffer = submitted;
+        if (submitted >= buffers.size()) {
+            IoRequest done = engine->wait();
+            --in_flight;
+            ok = done.error == 0;
+            buffer = done.buffer;
+        }
+        engine->submit(IoRequest{buffer, offset, std::min(buffer_size, size - offset), 0, 0, 0});
+        ++submitted;
+        ++in_flight;
+    }
+    while (in_flight > 0) {
+        ok = engine->wait().error == 0 && ok;
+        --in_flight;
+    }
+    engine.reset();
+    if (write) {
+        ok = fdatasync(fd) == 0 && ok;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+    *seconds = elapsed.count();
+    close(fd);
+    return ok;
+}
+
+// Compare the io_uring and thread pool engines writing and reading a file of
+// the given size in directory at a few queue depths; needs no device
+bool run_io_engine_benchmark(size_t size, const std::string& directory) {
+    const size_t buffer_size = 64ULL * 1024 * 1024;
+    size = (size + buffer_size - 1) / buffer_size * buffer_size;
+    std::cout << "\nI/O engine benchmark: " << format_size(size) << " in " << directory << std::endl;
+    
+    std::vector<void*> buffers(4, nullptr);
+    bool ok = true;
+    for (void*& buffer : buffers) {
+        if (posix_memalign(&buffer, 4096, buffer_size) != 0) {
+            buffer = nullptr;
+            ok = false;
+            break;
+        }
+        memset(buffer, 0x5A, buffer_size);
+    }
+    
+    std::string path = directory + "/cumem_test_io.bin";
+    for (IoEngineKind kind : {IoEngineKind::kIoUring, IoEngineKind::kThreadPool}) {
+        for (size_t queue_depth : {1, 8, 32}) {
+            if (!ok) {
+                break;
+            }
+            double write_seconds = 0, read_seconds = 0;
+            const char* engine_name = "";
+            bool registered = false, direct_io = false;
+            if (!stream_file(kind, path, size, queue_depth, buffers, buffer_size, true, &write_seconds,
+                             &engine_name, &registered, &direct_io)) {
+                if (kind == IoEngineKind::kIoUring) {
+                    std::cout << "io_uring: unavailable, skipped" << std::endl;
+                    break;
+                }
+                ok = false;
+                break;
+            }
+            ok = stream_file(kind, path, size, queue_depth, buffers, buffer_size, false, &read_seconds,
+                             &engine_name, &registered, &direct_io);
+            std::cout << engine_name << ", queue depth " << queue_depth << ": write "
+                      << size / write_seconds / 1e9 << " GB/s, read " << size / read_seconds / 1e9 << " GB/s ("
+                      << (direct_io ? "O_DIRECT" : "buffered")
+                      << (registered ? ", registered buffers" : "") << ")" << std::endl;
+        }
+    }
+    unlink(path.c_str());
+    for (void* buffer : buffers) {
+        free(buffer);
+    }
+    if (!ok) {
+        std::cerr << "I/O engine benchmark failed" << std::endl;
+    }
+    return ok;
+}
+
+// Host-emulated microbenchmark of the caching allocator: segments come from
+// pageable host memory, so this measures only the allocator's bookkeeping.
+// Each thread works on its own stream with a sliding window of live blocks;
+// 90% of requests are small (512B-64KB), the rest large (1-64MB).
+void run_suballoc_benchmark(size_t num_threads, size_t ops_per_thread) {
+    HostSegmentSource source;
+    CachingAllocator allocator(&source);
+    const size_t live_window = 1024;
+    
+    auto start_time = std::chrono::high_resolution_clock::now();
+    std::vector<std::thread> threads;
+    std::atomic<size_t> failures(0);
+    for (size_t t = 0; t < num_threads; t++) {
+        threads.emplace_back([&, t]() {
+            CUstream stream = (CUstream)(uintptr_t)(t + 1);
+            std::mt19937_64 rng(t);
+            std::vector<void*> live(live_window, nullptr);
+            for (size_t i = 0; i < ops_per_thread; i++) {
+                size_t slot = rng() % live_window;
+                if (live[slot]) {
+                    allocator.free(live[slot]);
+                    live[slot] = nullptr;
+                    continue;
+                }
+                size_t size = rng() % 10 != 0 ? 512 + rng() % (64 * 1024) : (1 + rng() % 64) * 1024 * 1024;
+                live[slot] = allocator.malloc(size, stream);
+                if (!live[slot]) {
+                    failures++;
+                }
+            }
+            for (void* ptr : live) {
+                if (ptr) {
+                    allocator.free(ptr);
+                }
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+    
+    CachingAllocatorStats stats = allocator.stats();
+    double total_ops = static_cast<double>(num_threads * ops_per_thread);
+    std::cout << num_threads << " thread(s): " << total_ops / elapsed.count() / 1e6 << " M ops/s, "
+              << stats.num_segments << " segment(s) holding " << format_size(stats.reserved_bytes)
+              << ", cache hit rate " << 100.0 * stats.num_cache_hits / std::max<size_t>(stats.num_allocs, 1)
+              << "%" << (failures ? ", allocation failures!" : "") << std::endl;
+}
+
+// Global-lock baseline for the registry benchmark
+class GlobalLockRegistry {
+public:
+    bool insert(uintptr_t base, size_t size, void* data) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return entries_.emplace(base, AllocationRegistry::Entry{base, size, data}).second;
+    }
+    bool erase(uintptr_t base) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return entries_.erase(base) != 0;
+    }
+    bool find(uintptr_t base, AllocationRegistry::Entry* entry) const {
+        return find_containing(base, entry);
+    }
+    bool find_containing(uintptr_t ptr, AllocationRegistry::Entry* entry) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.upper_bound(ptr);
+        if (it == entries_.begin()) {
+            return false;
+        }
+        --it;
+        if (ptr - it->second.base >= it->second.size) {
+            return false;
+        }
+        *entry = it->second;
+        return true;
+    }
+private:
+    mutable std::mutex mutex_;
+    std::map<uintptr_t, AllocationRegistry::Entry> entries_;
+};
+
+// Run a lookup/insert/erase mix against a registry from several threads.
+// Each thread owns a disjoint slice of the address space and keeps up to 4096
+// live ranges of 4KB-512MB; half of the lookups are by base (the free path),
+// half by a random interior pointer. Returns millions of ops per second, or
+// a negative value if a lookup missed a live range.
+template <typename Registry>
+double run_registry_mix(Registry& registry, size_t num_threads, size_t ops_per_thread,
+                        unsigned lookup_percent) {
+    std::atomic<bool> lookup_failed(false);
+    std::vector<std::thread> threads;
+    auto start_time = std::chrono::high_resolution_clock::now();
+    for (size_t t = 0; t < num_threads; t++) {
+        threads.emplace_back([&, t]() {
+            std::mt19937_64 rng(t);
+            std::vector<std::pair<uintptr_t, size_t>> live;
+            uintptr_t cursor = (uintptr_t)(t + 1) << 44;
+            for (size_t i = 0; i < ops_per_thread; i++) {
+                unsigned op = rng() % 100;
+                if (op < lookup_percent && !live.empty()) {
+                    const std::pair<uintptr_t, size_t>& range = live[rng() % live.size()];
+                    AllocationRegistry::Entry entry;
+                    bool found = (i & 1) ? registry.find(range.first, &entry)
+                                         : registry.find_containing(range.first + rng() % range.second, &entry);
+                    if (!found || entry.base != range.first) {
+                        lookup_failed = true;
+                    }
+                } else if ((op % 2 == 0 || live.empty()) && live.size() < 4096) {
+                    size_t size = 4096ULL << (rng() % 18);
+                    registry.insert(cursor, size, nullptr);
+                    live.emplace_back(cursor, size);
+                    cursor += size;
+                } else {
+                    size_t index = rng() % live.size();
+                    registry.erase(live[index].first);
+                    live[index] = live.back();
+                    live.pop_back();
+                }
+            }
+            for (const std::pair<uintptr_t, size_t>& range : live) {
+                registry.erase(range.first);
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+    if (lookup_failed) {
+        return -1.0;
+    }
+    return num_threads * ops_per_thread / elapsed.count() / 1e6;
+}
+
+// Compare the sharded AllocationRegistry against a single mutex-protected
+// std::map across thread counts and operation mixes (host only)
+void run_registry_benchmark() {
+    const size_t ops_per_thread = 1000000;
+    size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::cout << "\nPointer registry benchmark (M ops/s, sharded vs global lock)" << std::endl;
+    for (unsigned lookup_percent : {90, 50}) {
+        std::cout << lookup_percent << "% lookups, " << (100 - lookup_percent) / 2 << "% inserts, "
+                  << (100 - lookup_percent) / 2 << "% erases:" << std::endl;
+        for (size_t num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+            AllocationRegistry sharded;
+            GlobalLockRegistry global;
+            double sharded_rate = run_registry_mix(sharded, num_threads, ops_per_thread, lookup_percent);
+            double global_rate = run_registry_mix(global, num_threads, ops_per_thread, lookup_percent);
+            std::cout << "  " << num_threads << " thread(s): ";
+            if (sharded_rate < 0 || global_rate < 0) {
+                std::cout << "lookup missed a live range!" << std::endl;
+                continue;
+            }
+            std::cout << sharded_rate << " vs " << global_rate << std::endl;
+        }
+    }
+}
+
+// Match "<flag>", which sets *bytes to default_gb, or "<flag>=<GB>". Throws
+// std::invalid_argument or std::out_of_range if the size does not parse.
+bool parse_gb_flag(const std::string& arg, const char* flag, size_t default_gb, size_t* bytes) {
+    size_t length = strlen(flag);
+    if (arg.compare(0, length, flag) != 0) {
+        return false;
+    }
+    if (arg.size() == length) {
+        *bytes = default_gb * 1024 * 1024 * 1024;
+        return true;
+    }
+    if (arg[length] != '=') {
+        return false;
+    }
+    *bytes = std::stoull(arg.substr(length + 1)) * 1024 * 1024 * 1024;
+    return true;
+}
+
+void print_usage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [--pipelined-create] [--pipelined-release]"
+              << " [--access-window=<MB>] [--bench-access-window] [--bench-peer-copy]"
+              << " [--striped] [--stripe-weights=<w0,w1,...>] [--bench-resize[=<GB>]]"
+              << " [--bench-defrag] [--bench-suballoc] [--bench-registry]"
+              << " [--bench-sleep[=<GB>]] [--compress=<lz|shuffle-lz>]"
+              << " [--bench-spill[=<GB>]] [--spill-dir=<path>] [--io-engine=<auto|io_uring|threads>]"
+              << " [--bench-io[=<GB>]] [--bench-mapped-restore[=<GB>]] [--host-backend]"
+              << " [--bench-broadcast[=<GB>]] [--bench-copy[=<GB>]] [--verify-samples=<N>]"
+              << " [--create-limit=<n0,n1,...>] [--bench-admission[=<GB>]]"
+              << " [--bench-alloc-order[=<GB>]] [--test-coordinator[=<ranks>]]" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    std::cout << "ROCM Memory Mapping Test - Simultaneous Allocation of 120GB on All Devices" << std::endl;
+    
+    // Parse command line options
+    bool pipelined_create = false;
+    bool pipelined_release = false;
+    bool bench_access_window = false;
+    bool bench_peer_copy = false;
+    bool striped = false;
+    size_t resize_bench_size = 0;
+    bool bench_defrag = false;
+    bool bench_suballoc = false;
+    bool bench_registry = false;
+    size_t sleep_bench_size = 0;
+    CompressionCodec compression = CompressionCodec::kNone;
+    size_t spill_bench_size = 0;
+    std::string spill_directory = "/tmp";
+    IoEngineKind io_engine = IoEngineKind::kAuto;
+    size_t io_bench_size = 0;
+    size_t mapped_restore_bench_size = 0;
+    bool host_backend = false;
+    size_t broadcast_bench_size = 0;
+    size_t copy_bench_size = 0;
+    size_t verify_samples = 0;
+    std::vector<size_t> create_limits;
+    size_t admission_bench_size = 0;
+    size_t alloc_order_bench_size = 0;
+    size_t coordinator_ranks = 0;
+    std::vector<unsigned int> stripe_weights;
+    unsigned long long access_window = 0;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool gb_flag = false;
+        try {
+            gb_flag = parse_gb_flag(arg, "--bench-resize", 8, &resize_bench_size) ||
+                      parse_gb_flag(arg, "--bench-sleep", 8, &sleep_bench_size) ||
+                      parse_gb_flag(arg, "--bench-spill", 8, &spill_bench_size) ||
+                      parse_gb_flag(arg, "--bench-mapped-restore", 8, &mapped_restore_bench_size) ||
+                      parse_gb_flag(arg, "--bench-broadcast", 8, &broadcast_bench_size) ||
+                      parse_gb_flag(arg, "--bench-admission", 16, &admission_bench_size) ||
+                      parse_gb_flag(arg, "--bench-alloc-order", 16, &alloc_order_bench_size) ||
+                      parse_gb_flag(arg, "--bench-copy", 120, &copy_bench_size) ||
+                      parse_gb_flag(arg, "--bench-io", 16, &io_bench_size);
+        } catch (const std::exception&) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        if (gb_flag) {
+            continue;
+        }
+        if (arg == "--pipelined-create") {
+            pipelined_create = true;
+        } else if (arg == "--pipelined-release") {
+            pipelined_release = true;
+        } else if (arg.compare(0, 16, "--access-window=") == 0) {
+            pipelined_create = true;
+            try {
+                access_window = std::stoull(arg.substr(16)) * 1024 * 1024;
+            } catch (const std::exception&) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--bench-access-window") {
+            bench_access_window = true;
+        } else if (arg == "--bench-peer-copy") {
+            bench_peer_copy = true;
+        } else if (arg == "--bench-suballoc") {
+            bench_suballoc = true;
+        } else if (arg.compare(0, 12, "--spill-dir=") == 0) {
+            spill_directory = arg.substr(12);
+        } else if (arg.compare(0, 12, "--io-engine=") == 0) {
+            if (!parse_io_engine(arg.c_str() + 12, &io_engine)) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (arg.compare(0, 17, "--verify-samples=") == 0) {
+            try {
+                verify_samples = std::stoull(arg.substr(17));
+            } catch (const std::exception&) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (arg.compare(0, 15, "--create-limit=") == 0) {
+            std::string list = arg.substr(15);
+            try {
+                size_t pos = 0;
+                while (pos <= list.size()) {
+                    size_t comma = list.find(',', pos);
+                    if (comma == std::string::npos) {
+                        comma = list.size();
+                    }
+                    create_limits.push_back(std::stoul(list.substr(pos, comma - pos)));
+                    pos = comma + 1;
+                }
+            } catch (const std::exception&) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--test-coordinator") {
+            coordinator_ranks = 8;
+        } else if (arg.compare(0, 19, "--test-coordinator=") == 0) {
+            try {
+                coordinator_ranks = std::stoull(arg.substr(19));
+            } catch (const std::exception&) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--host-backend") {
+            host_backend = true;
+        } else if (arg.compare(0, 11, "--compress=") == 0) {
+            if (!parse_compression_codec(arg.c_str() + 11, &compression)) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--bench-registry") {
+            bench_registry = true;
+        } else if (arg == "--bench-defrag") {
+            bench_defrag = true;
+        } else if (arg == "--striped") {
+            striped = true;
+        } else if (arg.compare(0, 17, "--stripe-weights=") == 0) {
+            striped = true;
+            std::string list = arg.substr(17);
+            try {
+                size_t pos = 0;
+                while (pos <= list.size()) {
+                    size_t comma = list.find(',', pos);
+                    if (comma == std::string::npos) {
+                        comma = list.size();
+                    }
+                    stripe_weights.push_back(std::stoul(list.substr(pos, comma - pos)));
+                    pos = comma + 1;
+                }
+            } catch (const std::exception&) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (bench_suballoc) {
+        // Host-emulated, so no device is needed
+        std::cout << "\nCaching allocator microbenchmark (host-emulated segments)" << std::endl;
+        for (size_t num_threads : {1, 4}) {
+            run_suballoc_benchmark(num_threads, 4000000);
+        }
+        return 0;
+    }
+    
+    if (bench_registry) {
+        run_registry_benchmark();
+        return 0;
+    }
+    
+    if (io_bench_size != 0) {
+        return run_io_engine_benchmark(io_bench_size, spill_directory) ? 0 : 1;
+    }
+    
+    if (mapped_restore_bench_size != 0 && host_backend) {
+        return run_mapped_restore_benchmark(0, mapped_restore_bench_size, 0, spill_directory, true) ? 0 : 1;
+    }
+    
+    if (coordinator_ranks != 0) {
+        return run_coordinator_test(coordinator_ranks, 4ULL * 1024 * 1024 * 1024) ? 0 : 1;
+    }
+    
+    // Initialize HIP
+    hipError_t hip_result = hipInit(0);
+    if (hip_result != hipSuccess) {
+        std::cerr << "Failed to initialize HIP runtime: " << hipGetErrorString(hip_result) << std::endl;
+        return 1;
+    }
+    
+    // Get device count
+    int deviceCount;
+    hip_result = hipGetDeviceCount(&deviceCount);
+    if (hip_result != hipSuccess) {
+        std::cerr << "Failed to get device count: " << hipGetErrorString(hip_result) << std::endl;
+        return 1;
+    }
+    
+    if (deviceCount == 0) {
+        std::cerr << "No HIP devices found" << std::endl;
+        return 1;
+    }
+    
+    std::cout << "Found " << deviceCount << " HIP device(s)" << std::endl;
+    
+    // Limit to 8 devices maximum (0-7)
+    int max_devices = std::min(deviceCount, 8);
+    
+    // Set allocation size to 120GB
+    size_t allocation_size = 120ULL * 1024 * 1024 * 1024;
+    
+    // Array to store device memory information
+    std::vector<DeviceMemory> device_memories(max_devices);
+    
+    // First pass: initialize contexts and get granularity for all devices
+    std::vector<size_t> granularities(max_devices);
+    for (int i = 0; i < max_devices; i++) {
+        hipDeviceProp_t deviceProp;
+        hip_result = hipGetDeviceProperties(&deviceProp, i);
+        if (hip_result != hipSuccess) {
+            std::cerr << "Failed to get device properties for device " << i 
+                     << ": " << hipGetErrorString(hip_result) << std::endl;
+            continue;
+        }
+        
+        std::cout << "Device " << i << ": " << deviceProp.name 
+                  << " (Memory: " << format_size(deviceProp.totalGlobalMem) << ")" << std::endl;
+        
+        // Initialize context
+        ensure_context(i);
+        
+        // Get granularity
+        granularities[i] = get_memory_granularity(i);
+        if (granularities[i] == 0) {
+            std::cerr << "Failed to get memory granularity for device " << i << std::endl;
+            continue;
+        }
+        
+        // Initialize device memory structure
+        device_memories[i].device = i;
+    }
+    
+    if (bench_access_window) {
+        if (granularities[0] != 0) {
+            run_access_window_benchmark(0, allocation_size, granularities[0]);
+        }
+        return 0;
+    }
+    
+    if (resize_bench_size != 0) {
+        if (granularities[0] != 0) {
+            run_resize_benchmark(0, resize_bench_size, granularities[0]);
+        }
+        return 0;
+    }
+    
+    if (bench_defrag) {
+        if (granularities[0] == 0) {
+            return 1;
+        }
+        return run_defrag_benchmark(0, allocation_size, granularities[0]) ? 0 : 1;
+    }
+    
+    if (sleep_bench_size != 0) {
+        if (granularities[0] == 0) {
+            return 1;
+        }
+        return run_sleep_benchmark(0, sleep_bench_size, granularities[0], compression) ? 0 : 1;
+    }
+    
+    if (spill_bench_size != 0) {
+        if (granularities[0] == 0) {
+            return 1;
+        }
+        return run_spill_benchmark(0, spill_bench_size, granularities[0], spill_directory, io_engine) ? 0 : 1;
+    }
+    
+    if (mapped_restore_bench_size != 0) {
+        if (granularities[0] == 0) {
+            return 1;
+        }
+        return run_mapped_restore_benchmark(0, mapped_restore_bench_size, granularities[0], spill_directory,
+                                            false) ? 0 : 1;
+    }
+    
+    if (admission_bench_size != 0) {
+        std::vector<unsigned long long> admission_devices;
+        for (int i = 0; i < max_devices; i++) {
+            if (granularities[i] != 0) {
+                admission_devices.push_back(i);
+            }
+        }
+        if (admission_devices.empty()) {
+            return 1;
+        }
+        return run_admission_benchmark(admission_devices, granularities, admission_bench_size) ? 0 : 1;
+    }
+    
+    if (alloc_order_bench_size != 0) {
+        std::vector<unsigned long long> order_devices;
+        for (int i = 0; i < max_devices; i++) {
+            if (granularities[i] != 0) {
+                order_devices.push_back(i);
+            }
+        }
+        if (order_devices.empty()) {
+            return 1;
+        }
+        return run_allocation_order_benchmark(order_devices, granularities, alloc_order_bench_size) ? 0 : 1;
+    }
+    
+    if (copy_bench_size != 0) {
+        if (granularities[0] == 0) {
+            return 1;
+        }
+        return run_copy_engine_benchmark(0, copy_bench_size, granularities[0]) ? 0 : 1;
+    }
+    
+    if (striped) {
+        std::vector<unsigned long long> stripe_devices;
+        size_t stripe_granularity = 0;
+        for (int i = 0; i < max_devices; i++) {
+            if (granularities[i] != 0) {
+                stripe_devices.push_back(i);
+                stripe_granularity = std::max(stripe_granularity, granularities[i]);
+            }
+        }
+        if (stripe_devices.empty()) {
+            std::cerr << "No usable devices to stripe across" << std::endl;
+            return 1;
+        }
+        if (!stripe_weights.empty() && stripe_weights.size() != stripe_devices.size()) {
+            std::cerr << "Expected " << stripe_devices.size() << " stripe weights, got "
+                      << stripe_weights.size() << std::endl;
+            return 1;
+        }
+        return run_striped_test(stripe_devices, stripe_weights, allocation_size, stripe_granularity) ? 0 : 1;
+    }
+    
+    if (broadcast_bench_size != 0) {
+        std::vector<unsigned long long> broadcast_devices;
+        for (int i = 0; i < max_devices; i++) {
+            if (granularities[i] != 0) {
+                broadcast_devices.push_back(i);
+            }
+        }
+        if (broadcast_devices.empty()) {
+            return 1;
+        }
+        return run_broadcast_benchmark(broadcast_devices, granularities, broadcast_bench_size) ? 0 : 1;
+    }
+    
+    if (bench_peer_copy) {
+        // Use a smaller region so the host-staged copy finishes in reasonable time
+        const size_t peer_copy_size = 4ULL * 1024 * 1024 * 1024;
+        if (max_devices < 2 || granularities[0] == 0 || granularities[1] == 0) {
+            std::cerr << "Peer copy benchmark needs two usable devices" << std::endl;
+            return 1;
+        }
+        run_peer_copy_benchmark(0, 1, peer_copy_size, granularities[0], granularities[1]);
+        return 0;
+    }
+    
+    // Staging slabs for verification on the NUMA node of every usable device
+    std::vector<int> staging_nodes;
+    for (int i = 0; i < max_devices; i++) {
+        int node = get_numa_node_for_gpu(i);
+        if (granularities[i] != 0 && std::find(staging_nodes.begin(), staging_nodes.end(), node) == staging_nodes.end()) {
+            staging_nodes.push_back(node);
+        }
+    }
+    StagingPool staging_pool(2 * 1024 * 1024, 8, staging_nodes);
+    g_staging_pool = &staging_pool;
+    
+    // One limit applies to every node; a list gives one per node, in order
+    CreateAdmission admission(create_limits.size() == 1 ? create_limits[0] : 0);
+    if (create_limits.size() > 1) {
+        for (size_t node = 0; node < create_limits.size(); node++) {
+            admission.set_limit(node, create_limits[node]);
+        }
+    }
+    if (!create_limits.empty()) {
+        set_create_admission(&admission);
+    }
+    
+    std::cout << "\nSimultaneously allocating " << format_size(allocation_size) 
+              << " on each device..." << std::endl;
+    
+    // Devices on nodes with the most free memory go first; devices on nodes
+    // that are short are deferred while reclaim runs there
+    std::vector<unsigned long long> plan_devices;
+    for (int i = 0; i < max_devices; i++) {
+        if (granularities[i] != 0) {  // Skip devices with granularity errors
+            plan_devices.push_back(i);
+        }
+    }
+    AllocationPlan plan = plan_allocation_order(plan_devices, allocation_size);
+    print_allocation_plan(plan);
+    
+    // Start timing
+    auto alloc_start_time = std::chrono::high_resolution_clock::now();
+    
+    // Second pass: allocate memory on all devices
+    AllocationRun run;
+    run_allocation_plan(plan, allocation_size, [&](unsigned long long i) {
+        std::cout << "Allocating on device " << i << " (" << format_size(allocation_size) << ")..." << std::endl;
+        if (!allocate_device_memory(device_memories[i], allocation_size, granularities[i], true,
+                                    pipelined_create, access_window, verify_samples)) {
+            std::cerr << "Failed to allocate memory on device " << i << std::endl;
+            return false;
+        }
+        std::cout << "Successfully allocated " << format_size(allocation_size) 
+                  << " on device " << i << std::endl;
+        return true;
+    }, 30.0, &run);
+    
+    auto alloc_end_time = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> alloc_time = alloc_end_time - alloc_start_time;
+    std::cout << "\nTotal allocation time for all devices: " << alloc_time.count() << " seconds" << std::endl;
+    print_allocation_run(run);
+    for (const StagingPoolStats& stats : staging_pool.stats()) {
+        std::cout << "Staging pool, NUMA node " << stats.node << ": " << stats.slabs << " slabs of "
+                  << format_size(staging_pool.slab_size()) << (stats.huge_pages ? " on huge pages" : "")
+                  << (stats.pinned ? ", pinned" : ", not pinned") << ", " << stats.acquires << " acquired, peak "
+                  << stats.peak_in_use << " in use (" << 100.0 * stats.peak_in_use / stats.slabs << "%), "
+                  << stats.failed_acquires << " failed" << std::endl;
+    }
+    if (!create_limits.empty()) {
+        set_create_admission(nullptr);
+        for (const AdmissionStats& stats : admission.stats()) {
+            std::cout << "Create admission, NUMA node " << stats.node << ": limit " << stats.limit << ", "
+                      << stats.admitted << " admitted, " << stats.waited << " queued (max wait "
+                      << stats.max_wait_seconds << " s), peak " << stats.peak_active << " in flight" << std::endl;
+        }
+    }
+    
+    // Catch host memory or devices on the wrong NUMA node at bring-up
+    probe_numa_bandwidth(device_memories);
     
     // Wait a moment to let the system stabilize
     std::cout << "\nGiving the system a moment to stabilize..." << std::endl;
@@ -298,7 +2508,7 @@ int main() {
         }
         
         std::cout << "Releasing memory from device " << i << "..." << std::endl;
-        if (!free_device_memory(device_memories[i])) {
+        if (!free_device_memory(device_memories[i], pipelined_release)) {
             std::cerr << "Failed to release memory from device " << i << std::endl;
         } else {
             std::cout << "Successfully released memory from device " << i << std::endl;
@@ -313,5 +2523,6 @@ int main() {
     std::chrono::duration<double> total_time = free_end_time - alloc_start_time;
     std::cout << "\nTotal test time: " << total_time.count() << " seconds" << std::endl;
     
+    g_staging_pool = nullptr;
     return 0;
 } 
\ No newline at end of file
@@ -0,0 +1,56 @@
+// NUMA-pinned worker pool
+#include "cumem_worker_pool.h"
+
+bool set_cpu_affinity_for_node(int node);
+
+WorkerPool::WorkerPool(size_t num_threads, int numa_node) : numa_node_(numa_node), stop_(false) {
+  if (num_threads == 0) {
+    num_threads = 1;
+  }
+  for (size_t i = 0; i < num_threads; ++i) {
+    threads_.emplace_back([this]() {
+      if (numa_node_ >= 0) {
+        set_cpu_affinity_for_node(numa_node_);
+      }
+      worker_loop();
+    });
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  for (std::thread& thread : threads_) {
+    thread.join();
+  }
+}
+
+std::future<bool> WorkerPool::submit(std::function<bool()> task) {
+  std::packaged_task<bool()> packaged(std::move(task));
+  std::future<bool> result = packaged.get_future();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.push_back(std::move(packaged));
+  }
+  cv_.notify_one();
+  return result;
+}
+
+void WorkerPool::worker_loop() {
+  for (;;) {
+    std::packaged_task<bool()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this]() { return stop_ || !tasks_.empty(); });
+      if (tasks_.empty()) {
+        return;
+      }
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    task();
+  }
+}
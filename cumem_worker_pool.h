@@ -0,0 +1,41 @@
+#pragma once
+
+// Fixed pool of worker threads pinned to the CPUs of one NUMA node, for
+// host-side work on chunks (compression, staging copies) that should run
+// next to the memory it touches.
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class WorkerPool {
+ public:
+  // numa_node < 0 leaves the workers unpinned
+  WorkerPool(size_t num_threads, int numa_node);
+  // Finishes the queued tasks before returning
+  ~WorkerPool();
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  // Queue a task; the future yields its result
+  std::future<bool> submit(std::function<bool()> task);
+
+  size_t size() const { return threads_.size(); }
+  int numa_node() const { return numa_node_; }
+
+ private:
+  void worker_loop();
+
+  int numa_node_;
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::packaged_task<bool()>> tasks_;
+  bool stop_;
+};